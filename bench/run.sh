@@ -0,0 +1,61 @@
+#!/bin/sh
+# Runs every benchmark script in this directory RUNS times with the given binary and
+# prints one JSON object per benchmark:
+#
+#   {"benchmark": "fib", "runs": 5, "median_ms": 201.2, "stddev_ms": 2.4, "ops_per_sec": 13382390}
+#
+# Each script declares how much work it does with an "// ops: N" line, ops_per_sec is
+# N over the median wall time. Extra arguments go to the binary (e.g. --optimize).
+# An untimed run first writes the script's cache, so every timed run loads it, and the
+# cache is removed once the script is done.
+#
+#   sh run.sh ../src/main-release 10 --optimize
+
+if [ $# -lt 1 ]; then
+  echo "Usage: run.sh binary [runs] [flags...]" >&2
+  exit 64
+fi
+binary=$1
+runs=${2:-5}
+[ $# -ge 2 ] && shift 2 || shift 1
+dir=$(dirname "$0")
+status=0
+
+for script in "$dir"/*.pandi; do
+  name=$(basename "$script" .pandi)
+  ops=$(sed -n 's|^// ops: *\([0-9][0-9]*\).*|\1|p' "$script" | head -n 1)
+  cache="$dir/$name.pandic"
+  rm -f "$cache"
+  times=""
+  i=-1
+  while [ $i -lt "$runs" ]; do
+    start=$(date +%s%N)
+    "$binary" "$@" "$script" > /dev/null 2>&1
+    code=$?
+    if [ $code -ne 0 ]; then
+      echo "{\"benchmark\": \"$name\", \"error\": \"exited with $code\"}"
+      status=1
+      rm -f "$cache"
+      continue 2
+    fi
+    end=$(date +%s%N)
+    # run -1 only warms the cache
+    [ $i -ge 0 ] && times="$times $(( (end - start) / 1000 ))"
+    i=$((i + 1))
+  done
+  rm -f "$cache"
+
+  # microseconds in, milliseconds out
+  echo $times | tr ' ' '\n' | sort -n | awk -v name="$name" -v ops="${ops:-0}" '
+    { t[NR] = $1 / 1000; sum += t[NR] }
+    END {
+      median = NR % 2 ? t[(NR + 1) / 2] : (t[NR / 2] + t[NR / 2 + 1]) / 2
+      mean = sum / NR
+      for (i = 1; i <= NR; i++) squares += (t[i] - mean) ^ 2
+      stddev = NR > 1 ? sqrt(squares / (NR - 1)) : 0
+      rate = median > 0 ? ops / (median / 1000) : 0
+      printf "{\"benchmark\": \"%s\", \"runs\": %d, \"median_ms\": %.1f, \"stddev_ms\": %.1f, \"ops_per_sec\": %.0f}\n",
+             name, NR, median, stddev, rate
+    }'
+done
+exit $status
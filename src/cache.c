@@ -0,0 +1,375 @@
+#include <fcntl.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "cache.h"
+#include "memory.h"
+
+/*Layout of a cache file, all integers little endian:
+    "PNDC" version:u32 sourceHash:u64 sourceLength:u64 function
+where a function is
+    arity:u32 upvalueCount:u32 hasName:u8 [name:string]
+    stackSize:u32 codeCount:u32 code:u8[codeCount]
+    runCount:u32 (line:u32 length:u32)[runCount]
+    constantCount:u32 constant[constantCount]
+the line table is run length encoded since whole statements share a line, and each
+constant starts with a tag byte. Nested functions are stored inline as constants, those
+still waiting for lazy compilation as
+    arity:u32 hasName:u8 [name:string] sourceOffset:u32 sourceLength:u32 line:u32
+pointing into the source the cache was made from*/
+
+#define CACHE_MAGIC "PNDC"
+
+//nested functions deeper than this mean the file is damaged
+#define MAX_NESTING 256
+
+typedef enum {
+    CONSTANT_NIL,
+    CONSTANT_FALSE,
+    CONSTANT_TRUE,
+    CONSTANT_NUMBER,
+    CONSTANT_INT,
+    CONSTANT_STRING,
+    CONSTANT_FUNCTION,
+    CONSTANT_LAZY_FUNCTION,
+} ConstantTag;
+
+/*FNV-1a, 64 bits so two versions of a script practically never collide*/
+static uint64_t hashSource(const char* source, size_t length) {
+    uint64_t hash = 14695981039346656037ull;
+    for (size_t i = 0; i < length; i++) {
+        hash ^= (uint8_t)source[i];
+        hash *= 1099511628211ull;
+    }
+    return hash;
+}
+
+static char* cachePath(const char* path) {
+    size_t length = strlen(path);
+    char* cache = ALLOCATE(char, length + sizeof(CACHE_SUFFIX));
+    memcpy(cache, path, length);
+    memcpy(cache + length, CACHE_SUFFIX, sizeof(CACHE_SUFFIX));
+    return cache;
+}
+
+// Writing ----------------------------------------------------------------------
+
+typedef struct {
+    uint8_t* bytes;
+    size_t count;
+    size_t capacity;
+    //lazy functions are stored as offsets into this
+    const char* source;
+} Writer;
+
+static void writeBytes(Writer* writer, const void* bytes, size_t count) {
+    if (writer->count + count > writer->capacity) {
+        size_t oldCapacity = writer->capacity;
+        while (writer->count + count > writer->capacity) {
+            writer->capacity = GROW_CAPACITY(writer->capacity);
+        }
+        writer->bytes = GROW_ARRAY(uint8_t, writer->bytes, oldCapacity, writer->capacity);
+    }
+    memcpy(writer->bytes + writer->count, bytes, count);
+    writer->count += count;
+}
+
+static void writeByte(Writer* writer, uint8_t byte) {
+    writeBytes(writer, &byte, 1);
+}
+
+static void writeU32(Writer* writer, uint32_t value) {
+    uint8_t bytes[4];
+    for (int i = 0; i < 4; i++) bytes[i] = (uint8_t)(value >> (8 * i));
+    writeBytes(writer, bytes, 4);
+}
+
+static void writeU64(Writer* writer, uint64_t value) {
+    writeU32(writer, (uint32_t)value);
+    writeU32(writer, (uint32_t)(value >> 32));
+}
+
+static void writeString(Writer* writer, ObjString* string) {
+    writeU32(writer, (uint32_t)string->length);
+    writeBytes(writer, string->chars, string->length);
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function);
+
+static void writeLazyFunction(Writer* writer, ObjFunction* function) {
+    writeU32(writer, (uint32_t)function->arity);
+    writeByte(writer, function->name != NULL);
+    if (function->name != NULL) writeString(writer, function->name);
+    writeU32(writer, (uint32_t)(function->lazySource - writer->source));
+    writeU32(writer, (uint32_t)function->lazyLength);
+    writeU32(writer, (uint32_t)function->lazyLine);
+}
+
+static void writeConstant(Writer* writer, Value value) {
+    switch (value.type) {
+        case VAL_NIL:
+            writeByte(writer, CONSTANT_NIL);
+            break;
+        case VAL_BOOL:
+            writeByte(writer, AS_BOOL(value) ? CONSTANT_TRUE : CONSTANT_FALSE);
+            break;
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(value);
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            writeByte(writer, CONSTANT_NUMBER);
+            writeU64(writer, bits);
+            break;
+        }
+        case VAL_INT:
+            writeByte(writer, CONSTANT_INT);
+            writeU32(writer, (uint32_t)AS_INT(value));
+            break;
+        case VAL_OBJ:
+            //the compiler only puts strings and functions into constant pools
+            if (IS_STRING(value)) {
+                writeByte(writer, CONSTANT_STRING);
+                writeString(writer, AS_STRING(value));
+            } else if (AS_FUNCTION(value)->lazySource != NULL) {
+                writeByte(writer, CONSTANT_LAZY_FUNCTION);
+                writeLazyFunction(writer, AS_FUNCTION(value));
+            } else {
+                writeByte(writer, CONSTANT_FUNCTION);
+                writeFunction(writer, AS_FUNCTION(value));
+            }
+            break;
+    }
+}
+
+static void writeFunction(Writer* writer, ObjFunction* function) {
+    Chunk* chunk = &function->chunk;
+    writeU32(writer, (uint32_t)function->arity);
+    writeU32(writer, (uint32_t)function->upvalueCount);
+    writeByte(writer, function->name != NULL);
+    if (function->name != NULL) writeString(writer, function->name);
+
+    writeU32(writer, (uint32_t)chunk->stackSize);
+    writeU32(writer, (uint32_t)chunk->count);
+    writeBytes(writer, chunk->code, chunk->count);
+
+    writeU32(writer, (uint32_t)chunk->lines.runCount);
+    for (int offset = 0; offset < chunk->count;) {
+        int end;
+        writeU32(writer, (uint32_t)getLineRun(chunk, offset, &end));
+        writeU32(writer, (uint32_t)(end - offset));
+        offset = end;
+    }
+
+    writeU32(writer, (uint32_t)chunk->constants.count);
+    for (int i = 0; i < chunk->constants.count; i++) {
+        writeConstant(writer, chunk->constants.values[i]);
+    }
+}
+
+bool writeCachedScript(const char* path, const char* source, size_t sourceLength,
+                       ObjFunction* function) {
+    Writer writer = {NULL, 0, 0, source};
+    writeBytes(&writer, CACHE_MAGIC, 4);
+    writeU32(&writer, CACHE_VERSION);
+    writeU64(&writer, hashSource(source, sourceLength));
+    writeU64(&writer, sourceLength);
+    writeFunction(&writer, function);
+
+    //written under a temporary name and renamed, so a reader never sees half a file
+    char* cache = cachePath(path);
+    size_t length = strlen(cache);
+    char* temporary = ALLOCATE(char, length + 5);
+    memcpy(temporary, cache, length);
+    memcpy(temporary + length, ".tmp", 5);
+
+    bool written = false;
+    FILE* file = fopen(temporary, "wb");
+    if (file != NULL) {
+        written = fwrite(writer.bytes, 1, writer.count, file) == writer.count;
+        written = fclose(file) == 0 && written;
+        written = written && rename(temporary, cache) == 0;
+        if (!written) remove(temporary);
+    }
+
+    FREE_ARRAY(char, temporary, length + 5);
+    FREE_ARRAY(char, cache, length + 1);
+    FREE_ARRAY(uint8_t, writer.bytes, writer.capacity);
+    return written;
+}
+
+// Reading ----------------------------------------------------------------------
+
+/*Reads straight out of the mapped file. Running past the end sets failed and from
+then on every read yields zeros, so the callers only check once at the end*/
+typedef struct {
+    //the VM the loaded objects are made for
+    VM* vm;
+    const uint8_t* current;
+    const uint8_t* end;
+    bool failed;
+    //the script's source, lazy functions point back into it
+    const char* source;
+    size_t sourceLength;
+    const char* path;
+} Reader;
+
+static const uint8_t* readBytes(Reader* reader, size_t count) {
+    if (reader->failed || (size_t)(reader->end - reader->current) < count) {
+        reader->failed = true;
+        return NULL;
+    }
+    const uint8_t* bytes = reader->current;
+    reader->current += count;
+    return bytes;
+}
+
+static uint8_t readByte(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 1);
+    return bytes != NULL ? bytes[0] : 0;
+}
+
+static uint32_t readU32(Reader* reader) {
+    const uint8_t* bytes = readBytes(reader, 4);
+    if (bytes == NULL) return 0;
+    return (uint32_t)bytes[0] | (uint32_t)bytes[1] << 8 |
+           (uint32_t)bytes[2] << 16 | (uint32_t)bytes[3] << 24;
+}
+
+static uint64_t readU64(Reader* reader) {
+    uint64_t low = readU32(reader);
+    return low | (uint64_t)readU32(reader) << 32;
+}
+
+static ObjString* readString(Reader* reader) {
+    uint32_t length = readU32(reader);
+    const uint8_t* chars = readBytes(reader, length);
+    return chars != NULL ? copyString(reader->vm, (const char*)chars, (int)length) : NULL;
+}
+
+static ObjFunction* readFunction(Reader* reader, int depth);
+
+static ObjFunction* readLazyFunction(Reader* reader) {
+    ObjFunction* function = newFunction(reader->vm);
+    function->arity = (int)readU32(reader);
+    if (readByte(reader)) function->name = readString(reader);
+    uint32_t offset = readU32(reader);
+    uint32_t length = readU32(reader);
+    function->lazyLine = (int)readU32(reader);
+    if (offset > reader->sourceLength || length > reader->sourceLength - offset ||
+        length == 0) {
+        reader->failed = true;
+        return NULL;
+    }
+    function->lazySource = reader->source + offset;
+    function->lazyLength = (int)length;
+    function->lazyPath = reader->path;
+    return reader->failed ? NULL : function;
+}
+
+static Value readConstant(Reader* reader, int depth) {
+    switch (readByte(reader)) {
+        case CONSTANT_NIL:   return NIL_VAL;
+        case CONSTANT_FALSE: return BOOL_VAL(false);
+        case CONSTANT_TRUE:  return BOOL_VAL(true);
+        case CONSTANT_NUMBER: {
+            uint64_t bits = readU64(reader);
+            double number;
+            memcpy(&number, &bits, sizeof(number));
+            return NUMBER_VAL(number);
+        }
+        case CONSTANT_INT:   return INT_VAL((int32_t)readU32(reader));
+        case CONSTANT_STRING: {
+            ObjString* string = readString(reader);
+            return string != NULL ? OBJ_VAL(string) : NIL_VAL;
+        }
+        case CONSTANT_FUNCTION: {
+            ObjFunction* function = readFunction(reader, depth + 1);
+            return function != NULL ? OBJ_VAL(function) : NIL_VAL;
+        }
+        case CONSTANT_LAZY_FUNCTION: {
+            ObjFunction* function = readLazyFunction(reader);
+            return function != NULL ? OBJ_VAL(function) : NIL_VAL;
+        }
+        default:
+            reader->failed = true;
+            return NIL_VAL;
+    }
+}
+
+static ObjFunction* readFunction(Reader* reader, int depth) {
+    if (depth > MAX_NESTING) reader->failed = true;
+    if (reader->failed) return NULL;
+
+    ObjFunction* function = newFunction(reader->vm);
+    Chunk* chunk = &function->chunk;
+    function->arity = (int)readU32(reader);
+    function->upvalueCount = (int)readU32(reader);
+    if (readByte(reader)) function->name = readString(reader);
+
+    chunk->stackSize = (int)readU32(reader);
+    uint32_t codeCount = readU32(reader);
+    const uint8_t* code = readBytes(reader, codeCount);
+    if (code == NULL) return NULL;
+    //the bytes go in through writeChunk, which builds the line table as it goes
+    chunk->code = ALLOCATE(uint8_t, codeCount);
+    chunk->capacity = (int)codeCount;
+    uint32_t runCount = readU32(reader);
+    uint32_t filled = 0;
+    for (uint32_t i = 0; i < runCount && !reader->failed; i++) {
+        int line = (int)readU32(reader);
+        uint32_t length = readU32(reader);
+        if (length > codeCount - filled) {
+            reader->failed = true;
+            break;
+        }
+        for (uint32_t j = 0; j < length; j++, filled++) {
+            writeChunk(chunk, code[filled], line);
+        }
+    }
+    if (filled != codeCount) reader->failed = true;
+
+    uint32_t constantCount = readU32(reader);
+    for (uint32_t i = 0; i < constantCount && !reader->failed; i++) {
+        writeValueArray(&chunk->constants, readConstant(reader, depth));
+    }
+    return reader->failed ? NULL : function;
+}
+
+ObjFunction* loadCachedScript(VM* vm, const char* path, const char* source,
+                              size_t sourceLength) {
+    char* cache = cachePath(path);
+    int fd = open(cache, O_RDONLY);
+    FREE_ARRAY(char, cache, strlen(path) + sizeof(CACHE_SUFFIX));
+    if (fd == -1) return NULL;
+
+    struct stat status;
+    if (fstat(fd, &status) != 0 || status.st_size == 0) {
+        close(fd);
+        return NULL;
+    }
+    //the mapping stays valid after the descriptor is closed
+    size_t size = (size_t)status.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    close(fd);
+    if (mapped == MAP_FAILED) return NULL;
+
+    Reader reader = {vm, (const uint8_t*)mapped, (const uint8_t*)mapped + size, false,
+                     source, sourceLength, path};
+    const uint8_t* magic = readBytes(&reader, 4);
+    ObjFunction* function = NULL;
+    if (magic != NULL && memcmp(magic, CACHE_MAGIC, 4) == 0 &&
+        readU32(&reader) == CACHE_VERSION &&
+        readU64(&reader) == hashSource(source, sourceLength) &&
+        readU64(&reader) == sourceLength) {
+        function = readFunction(&reader, 0);
+        //trailing bytes mean the file isn't what we wrote
+        if (reader.current != reader.end) function = NULL;
+    }
+
+    munmap(mapped, size);
+    return function;
+}
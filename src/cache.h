@@ -0,0 +1,22 @@
+#ifndef cpandi_cache_h
+#define cpandi_cache_h
+
+#include "object.h"
+
+/*Bump whenever the bytecode or the cache layout changes, older caches are then ignored*/
+#define CACHE_VERSION 5
+
+/*The cache for script.pandi lives next to it in script.pandic*/
+#define CACHE_SUFFIX "c"
+
+/*Returns the script function cached for this source, or NULL if there's no cache file
+or it was made from different source, by a different version or is damaged. Functions
+not compiled yet keep pointers to the source and path*/
+ObjFunction* loadCachedScript(VM* vm, const char* path, const char* source, size_t length);
+
+/*Writes the compiled script next to its source. Failing to write isn't an error, the
+script just gets compiled again next time*/
+bool writeCachedScript(const char* path, const char* source, size_t length,
+                       ObjFunction* function);
+
+#endif
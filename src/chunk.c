@@ -1,6 +1,105 @@
 #include <stdlib.h>
+#include <string.h>
 #include "memory.h"
 #include "chunk.h"
+#include "object.h"
+
+static void initLineTable(LineTable* lines) {
+    lines->runCount = 0;
+    lines->lastOffset = 0;
+    lines->lastLine = 0;
+    lines->count = 0;
+    lines->capacity = 0;
+    lines->bytes = NULL;
+    lines->checkpointCount = 0;
+    lines->checkpointCapacity = 0;
+    lines->checkpoints = NULL;
+}
+
+static void freeLineTable(LineTable* lines) {
+    FREE_ARRAY(uint8_t, lines->bytes, lines->capacity);
+    FREE_ARRAY(LineCheckpoint, lines->checkpoints, lines->checkpointCapacity);
+    initLineTable(lines);
+}
+
+static void writeLineByte(LineTable* lines, uint8_t byte) {
+    if (lines->capacity < lines->count + 1) {
+        int oldCapacity = lines->capacity;
+        lines->capacity = GROW_CAPACITY(oldCapacity);
+        lines->bytes = GROW_ARRAY(uint8_t, lines->bytes, oldCapacity, lines->capacity);
+    }
+    lines->bytes[lines->count++] = byte;
+}
+
+static void writeLineInt(LineTable* lines, int value) {
+    for (int shift = 24; shift >= 0; shift -= 8) writeLineByte(lines, (value >> shift) & 0xff);
+}
+
+/*A run is two bytes, the distance from the previous run's offset (never 0) and the
+change in line. A 0 first byte escapes to both as four byte numbers*/
+static void addLineRun(LineTable* lines, int offset, int line) {
+    if (lines->runCount % LINE_CHECKPOINT_INTERVAL == 0) {
+        if (lines->checkpointCapacity < lines->checkpointCount + 1) {
+            int oldCapacity = lines->checkpointCapacity;
+            lines->checkpointCapacity = GROW_CAPACITY(oldCapacity);
+            lines->checkpoints = GROW_ARRAY(LineCheckpoint, lines->checkpoints,
+                                            oldCapacity, lines->checkpointCapacity);
+        }
+        LineCheckpoint* checkpoint = &lines->checkpoints[lines->checkpointCount++];
+        checkpoint->offset = offset;
+        checkpoint->line = line;
+        checkpoint->position = lines->count;
+    } else {
+        int distance = offset - lines->lastOffset;
+        int delta = line - lines->lastLine;
+        if (distance <= UINT8_MAX && delta >= INT8_MIN && delta <= INT8_MAX) {
+            writeLineByte(lines, (uint8_t)distance);
+            writeLineByte(lines, (uint8_t)(int8_t)delta);
+        } else {
+            writeLineByte(lines, 0);
+            writeLineInt(lines, distance);
+            writeLineInt(lines, delta);
+        }
+    }
+    lines->runCount++;
+    lines->lastOffset = offset;
+    lines->lastLine = line;
+}
+
+static int readLineInt(LineTable* lines, int position) {
+    uint8_t* bytes = &lines->bytes[position];
+    return (int)((uint32_t)bytes[0] << 24 | bytes[1] << 16 | bytes[2] << 8 | bytes[3]);
+}
+
+/*Moves offset and line on to the run encoded at position, returns where the next
+one starts*/
+static int decodeLineRun(LineTable* lines, int position, int* offset, int* line) {
+    uint8_t distance = lines->bytes[position];
+    if (distance != 0) {
+        *offset += distance;
+        *line += (int8_t)lines->bytes[position + 1];
+        return position + 2;
+    }
+    *offset += readLineInt(lines, position + 1);
+    *line += readLineInt(lines, position + 5);
+    return position + 9;
+}
+
+/*The last checkpoint at or before offset, -1 if there is none*/
+static int findCheckpoint(LineTable* lines, int offset) {
+    int low = 0;
+    int high = lines->checkpointCount - 1;
+    if (high < 0 || lines->checkpoints[0].offset > offset) return -1;
+    while (low < high) {
+        int middle = (low + high + 1) / 2;
+        if (lines->checkpoints[middle].offset <= offset) {
+            low = middle;
+        } else {
+            high = middle - 1;
+        }
+    }
+    return low;
+}
 
 void initChunk(Chunk* chunk) {
     /*The count is initially set to 0*/
@@ -10,17 +109,20 @@ void initChunk(Chunk* chunk) {
     //This is the array that will store the chunks of code
     chunk->code = NULL;
     //The line number is set to null in beg.
-    chunk->lines = NULL;
+    initLineTable(&chunk->lines);
     //Initialising the constants !!
     initValueArray(&chunk->constants);
+    initTable(&chunk->constantIndex);
+    chunk->stackSize = 0;
 }
 
 void freeChunk(Chunk* chunk) {
     //The array is first freed using the FREE_ARRAY macro
     FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
     //Free the line number array
-    FREE_ARRAY(int, chunk->lines, chunk->capacity);
+    freeLineTable(&chunk->lines);
     freeValueArray(&chunk->constants);
+    freeTable(&chunk->constantIndex);
     //The next step after completely cleaning the array is that we call the init_chunk to 
     // return the array to an empty state :)
     initChunk(chunk);
@@ -34,20 +136,208 @@ void writeChunk(Chunk* chunk, uint8_t byte, int line) {
         chunk->capacity = GROW_CAPACITY(oldCapacity);
         //And we grow the array
         chunk->code = GROW_ARRAY(uint8_t, chunk->code, oldCapacity, chunk->capacity);
-        //and we also grow the line array
-        chunk->lines = GROW_ARRAY(int, chunk->lines, oldCapacity, chunk->capacity);
     }
     //Next we go into the chunk's array and store the code in the last byte (count)
     chunk->code[chunk->count] = byte;
-    //store the line numbers in the line array
-    chunk->lines[chunk->count] = line;
+    //a new run only starts when the line changes
+    LineTable* lines = &chunk->lines;
+    if (lines->runCount == 0 || lines->lastLine != line) addLineRun(lines, chunk->count, line);
     //Increment the count to the next byte !!
     chunk->count++;
 }
 
+void copyChunkCode(Chunk* chunk, Chunk* from) {
+    //a lazy function that hasn't been compiled yet
+    if (from->count == 0) return;
+    chunk->code = ALLOCATE(uint8_t, from->count);
+    memcpy(chunk->code, from->code, from->count);
+    chunk->count = from->count;
+    chunk->capacity = from->count;
+    chunk->stackSize = from->stackSize;
+
+    LineTable* lines = &chunk->lines;
+    *lines = from->lines;
+    lines->bytes = NULL;
+    lines->capacity = 0;
+    lines->checkpoints = NULL;
+    lines->checkpointCapacity = 0;
+    if (from->lines.count > 0) {
+        lines->bytes = ALLOCATE(uint8_t, from->lines.count);
+        memcpy(lines->bytes, from->lines.bytes, from->lines.count);
+        lines->capacity = from->lines.count;
+    }
+    if (from->lines.checkpointCount > 0) {
+        lines->checkpoints = ALLOCATE(LineCheckpoint, from->lines.checkpointCount);
+        memcpy(lines->checkpoints, from->lines.checkpoints,
+               sizeof(LineCheckpoint) * from->lines.checkpointCount);
+        lines->checkpointCapacity = from->lines.checkpointCount;
+    }
+}
+
+void truncateChunk(Chunk* chunk, int count) {
+    chunk->count = count;
+    LineTable* lines = &chunk->lines;
+    if (lines->runCount == 0 || lines->lastOffset < count) return;
+
+    //the last checkpoint that is kept, before it nothing changes
+    int checkpoint = findCheckpoint(lines, count - 1);
+    if (checkpoint < 0) {
+        freeLineTable(lines);
+        return;
+    }
+    LineCheckpoint* start = &lines->checkpoints[checkpoint];
+    int offset = start->offset;
+    int line = start->line;
+    int position = start->position;
+    int run = checkpoint * LINE_CHECKPOINT_INTERVAL;
+    //the runs up to the next checkpoint, which is dropped if there is one
+    while (run + 1 < lines->runCount && (run + 1) % LINE_CHECKPOINT_INTERVAL != 0) {
+        int nextOffset = offset;
+        int nextLine = line;
+        int next = decodeLineRun(lines, position, &nextOffset, &nextLine);
+        if (nextOffset >= count) break;
+        offset = nextOffset;
+        line = nextLine;
+        position = next;
+        run++;
+    }
+    lines->runCount = run + 1;
+    lines->lastOffset = offset;
+    lines->lastLine = line;
+    lines->count = position;
+    lines->checkpointCount = checkpoint + 1;
+}
+
+int getLineRun(Chunk* chunk, int offset, int* end) {
+    LineTable* lines = &chunk->lines;
+    int checkpoint = findCheckpoint(lines, offset);
+    LineCheckpoint* start = &lines->checkpoints[checkpoint];
+    int line = start->line;
+    int position = start->position;
+    //runs after the checkpoint, up to the next one or the end of the table
+    int runs = lines->runCount - checkpoint * LINE_CHECKPOINT_INTERVAL - 1;
+    if (runs > LINE_CHECKPOINT_INTERVAL - 1) runs = LINE_CHECKPOINT_INTERVAL - 1;
+
+    int nextOffset = start->offset;
+    int nextLine = line;
+    *end = chunk->count;
+    for (int i = 0; i < runs; i++) {
+        position = decodeLineRun(lines, position, &nextOffset, &nextLine);
+        if (nextOffset > offset) {
+            *end = nextOffset;
+            return line;
+        }
+        line = nextLine;
+    }
+    //the run after the last one decoded is the next checkpoint
+    if (checkpoint + 1 < lines->checkpointCount) *end = lines->checkpoints[checkpoint + 1].offset;
+    return line;
+}
+
+int getLine(Chunk* chunk, int offset) {
+    int end;
+    return getLineRun(chunk, offset, &end);
+}
+
+/*Map keys treat 0 and -0 as the same number, constants must not*/
+static bool sameConstant(Value a, Value b) {
+    if (a.type != b.type) return false;
+    if (a.type == VAL_NUMBER) {
+        return memcmp(&a.as.number, &b.as.number, sizeof(double)) == 0;
+    }
+    return valuesEqual(a, b);
+}
+
+/*Only values that compare by value (or interned strings) are shared*/
+static bool isDeduplicated(Value value) {
+    return !IS_OBJ(value) || IS_STRING(value);
+}
+
 /*This method writes the values to the chunk and then returns the 0 based index 
 of the last element appended*/
 int addConstant(Chunk* chunk, Value value) {
+    bool shared = isDeduplicated(value) && isValidKey(value);
+    if (shared) {
+        Value index;
+        if (tableGet(&chunk->constantIndex, value, &index) &&
+            sameConstant(chunk->constants.values[(int)AS_NUMBER(index)], value)) {
+            return (int)AS_NUMBER(index);
+        }
+    }
+
     writeValueArray(&chunk->constants, value);
-    return chunk->constants.count - 1;
-}
\ No newline at end of file
+    int index = chunk->constants.count - 1;
+    Value existing;
+    //a -0 that collides with 0 keeps its own slot, the index keeps pointing at the first
+    if (shared && !tableGet(&chunk->constantIndex, value, &existing)) {
+        tableSet(&chunk->constantIndex, value, NUMBER_VAL(index));
+    }
+    return index;
+}
+
+void removeLastConstant(Chunk* chunk) {
+    Value value = chunk->constants.values[chunk->constants.count - 1];
+    Value index;
+    if (isDeduplicated(value) && isValidKey(value) &&
+        tableGet(&chunk->constantIndex, value, &index) &&
+        (int)AS_NUMBER(index) == chunk->constants.count - 1) {
+        tableDelete(&chunk->constantIndex, value);
+    }
+    chunk->constants.count--;
+}
+int operandLength(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_POPN:
+        case OP_GET_LOCAL:
+        case OP_SET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_DEFINE_GLOBAL:
+        case OP_SET_GLOBAL:
+        case OP_GET_UPVALUE:
+        case OP_SET_UPVALUE:
+        case OP_BUILD_MAP:
+        case OP_CALL:
+        case OP_CLOSURE:
+            return 1;
+
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_LOOP:
+            return 2;
+
+        case OP_CONSTANT_LONG:
+        case OP_GET_GLOBAL_LONG:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_SET_GLOBAL_LONG:
+        case OP_JUMP_LONG:
+        case OP_JUMP_IF_FALSE_LONG:
+        case OP_LOOP_LONG:
+        case OP_CLOSURE_LONG:
+            return 3;
+
+        //slot, 24 bit constant, then the jump offset
+        case OP_GUARD_CALLEE:
+            return 6;
+        case OP_GUARD_CALLEE_LONG:
+            return 7;
+
+        default:
+            return 0;
+    }
+}
+
+int instructionLength(Chunk* chunk, int offset) {
+    uint8_t op = chunk->code[offset];
+    int length = 1 + operandLength(op);
+    //the function's upvalue count decides how many (isLocal, index) pairs follow
+    if (op == OP_CLOSURE || op == OP_CLOSURE_LONG) {
+        int constant = op == OP_CLOSURE_LONG ?
+            chunk->code[offset + 1] << 16 | chunk->code[offset + 2] << 8 |
+            chunk->code[offset + 3] :
+            chunk->code[offset + 1];
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+        length += function->upvalueCount * 2;
+    }
+    return length;
+}
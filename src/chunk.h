@@ -4,6 +4,7 @@
 #define cpandi_chunk_h
 
 #include "common.h"
+#include "table.h"
 #include "value.h"
 
 /*We create a typedef called enum which
@@ -12,32 +13,91 @@ and are called op codes for short*/
 
 typedef enum {
 OP_CONSTANT,
+OP_CONSTANT_LONG,
 OP_NIL,
 OP_TRUE,
 OP_FALSE,
 OP_POP,
+OP_POPN,
 OP_GET_LOCAL,
 OP_SET_LOCAL,
 OP_GET_GLOBAL,
+OP_GET_GLOBAL_LONG,
 OP_DEFINE_GLOBAL,
+OP_DEFINE_GLOBAL_LONG,
 OP_SET_GLOBAL,
+OP_SET_GLOBAL_LONG,
+OP_GET_UPVALUE,
+OP_SET_UPVALUE,
+OP_GET_INDEX,
+OP_SET_INDEX,
+OP_BUILD_MAP,
 OP_EQUAL,
 OP_GREATER,
 OP_LESS,
+OP_NOT_EQUAL,
+OP_GREATER_EQUAL,
+OP_LESS_EQUAL,
 OP_ADD,
 OP_SUBTRACT,
 OP_MULTIPLY,
 OP_DIVIDE,
 OP_NOT,
 OP_NEGATE,
+//typed forms, only emitted where the operands are proven numbers (or strings)
+OP_ADD_NUMBER,
+OP_ADD_STRING,
+OP_SUBTRACT_NUMBER,
+OP_MULTIPLY_NUMBER,
+OP_DIVIDE_NUMBER,
+OP_NEGATE_NUMBER,
+OP_GREATER_NUMBER,
+OP_LESS_NUMBER,
+OP_GREATER_EQUAL_NUMBER,
+OP_LESS_EQUAL_NUMBER,
 OP_PRINT,
 OP_JUMP,
+OP_JUMP_LONG,
 OP_JUMP_IF_FALSE,
+OP_JUMP_IF_FALSE_LONG,
 OP_LOOP,
+OP_LOOP_LONG,
 OP_CALL,
+OP_GUARD_CALLEE,
+OP_GUARD_CALLEE_LONG,
+OP_CLOSURE,
+OP_CLOSURE_LONG,
+OP_CLOSE_UPVALUE,
 OP_RETURN,
 } OpCode;
 
+/*Every this many runs the line table stores a run in full*/
+#define LINE_CHECKPOINT_INTERVAL 32
+
+/*A run stored in full: it starts at offset in the code, and the runs after it are
+encoded from position in the table's bytes onwards*/
+typedef struct {
+    int offset;
+    int line;
+    int position;
+} LineCheckpoint;
+
+/*The line of every code byte. A whole statement's bytes share a line, so the table
+keeps runs, and each run is stored as the distance in bytes and lines from the run
+before it, which mostly fits a byte each. Checkpoints let a lookup start close by*/
+typedef struct {
+    int runCount;
+    //the newest run, the next one is encoded relative to it
+    int lastOffset;
+    int lastLine;
+    int count;
+    int capacity;
+    uint8_t* bytes;
+    int checkpointCount;
+    int checkpointCapacity;
+    LineCheckpoint* checkpoints;
+} LineTable;
+
 /*This struct is a dynamic array which stores the count and the capacity*/
 typedef struct {
     int count;
@@ -45,8 +105,14 @@ typedef struct {
     /*And an array for bytecode !!!*/
     uint8_t* code;
     //for storing the line numbers
-    int* lines;
+    LineTable lines;
     ValueArray constants;
+    //maps each number, bool and string constant to its slot in the pool so
+    //repeated constants share one slot (only needed while compiling)
+    Table constantIndex;
+    //the most values the code ever has on the stack above the arguments, locals and
+    //temporaries included. A call makes sure the stack has this much room
+    int stackSize;
 } Chunk;
 
 
@@ -59,7 +125,31 @@ void freeChunk(Chunk* chunk);
 /*This method is used for appending a byte to the end of the chunk*/
 void writeChunk(Chunk* chunk, uint8_t byte, int line);
 
-/*Method to add constants to the chunk*/
+/*Copies the code and line table of from into the empty chunk, the constants are left
+to the caller*/
+void copyChunkCode(Chunk* chunk, Chunk* from);
+
+/*Drops the bytes from count onwards, with their lines*/
+void truncateChunk(Chunk* chunk, int count);
+
+/*The source line the byte at offset was compiled from*/
+int getLine(Chunk* chunk, int offset);
+
+/*Like getLine, and also sets end to where the bytes on that line stop*/
+int getLineRun(Chunk* chunk, int offset, int* end);
+
+/*Method to add constants to the chunk, returns the slot of an identical
+constant if the pool already has one*/
 int addConstant(Chunk* chunk, Value value);
 
+/*Removes the newest constant from the pool (used when its only use was folded away)*/
+void removeLastConstant(Chunk* chunk);
+
+/*Number of operand bytes that follow the opcode (closures are followed by their
+upvalue pairs on top of this)*/
+int operandLength(uint8_t op);
+
+/*Number of bytes the instruction at offset takes up, operands included*/
+int instructionLength(Chunk* chunk, int offset);
+
 #endif
\ No newline at end of file
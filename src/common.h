@@ -5,9 +5,17 @@
 #include <stddef.h>
 #include <stdint.h>
 
+//release builds (-DNDEBUG, like the ones make test and make bench run) leave out the
+//disassembly and tracing
+#ifndef NDEBUG
 #define DEBUG_PRINT_CODE
 #define DEBUG_TRACE_EXECUTION
+#endif
 
 #define UINT8_COUNT (UINT8_MAX + 1)
 
+/*Marks state that every thread gets its own copy of (the compiler runs on many
+threads at once)*/
+#define THREAD_LOCAL _Thread_local
+
 #endif
\ No newline at end of file
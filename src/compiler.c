@@ -2,7 +2,10 @@
 
 #include "common.h"
 #include "compiler.h"
+#include "memory.h"
+#include "peephole.h"
 #include "scanner.h"
+#include "types.h"
 #include <stdlib.h>
 #include <string.h>
 
@@ -12,10 +15,22 @@
 
 //Struct for storing tokens
 typedef struct {
+    //the VM the compiled objects are made for
+    VM* vm;
     Token current;
     Token previous;
     bool hadError;
     bool panicMode;
+    //the script the source came from, named in error messages (NULL for the REPL)
+    const char* path;
+    //where the left operand of the infix operator being compiled starts in the chunk
+    int operandStart;
+    //the size of the constant pool at that point
+    int operandConstants;
+    //top level functions only get pre-parsed, their bodies compile on the first call
+    bool lazy;
+    //checking the syntax of such a body, nothing that's emitted is kept
+    bool preparsing;
 } Parser;
 
 /*The operands are consumed as per the order of precedence
@@ -50,8 +65,22 @@ typedef struct {
 typedef struct {
     Token name;
     int depth;
+    //set once an inner function captures the variable, only these get closed over
+    //into an upvalue when they go out of scope, the rest are simply popped
+    bool isCaptured;
+    //a local initialized with a literal and never assigned again is read as that
+    //constant instead of from its slot
+    bool isConstant;
+    Value constant;
 } Local;
 
+/*A variable captured by a function: either a local slot of the enclosing function
+(isLocal) or one of the enclosing function's own upvalues*/
+typedef struct {
+    uint8_t index;
+    bool isLocal;
+} Upvalue;
+
 /*This enum helps the code distinguish between the main() function and the sub functions defined under it*/
 typedef enum {
     TYPE_FUNCTION,
@@ -71,11 +100,14 @@ typedef struct Compiler {
 
     Local locals[UINT8_COUNT];
     int localCount;
+    Upvalue upvalues[UINT8_COUNT];
     int scopeDepth;
+    //stands in for the function while pre-parsing, it's thrown away afterwards
+    ObjFunction preparsed;
 } Compiler;
 
-Parser parser;
-Compiler* current = NULL;
+static THREAD_LOCAL Parser parser;
+static THREAD_LOCAL Compiler* current = NULL;
 
 /*This method helps return the position of the current chunk*/
 static Chunk* currentChunk() {
@@ -91,8 +123,15 @@ static void errorAt(Token* token, const char* message) {
     if (parser.panicMode) return;
     //set panic mode to true
     parser.panicMode = true;
+    //other threads may be reporting errors in their own files, keep the message in one piece
+    flockfile(stderr);
     //Print in the stderr stream that there has been an error at line number....
-    fprintf(stderr, "[line %d] Error", token->line);
+    //scripts compile side by side, so the message says which one it's about
+    if (parser.path != NULL) {
+        fprintf(stderr, "[%s:%d] Error", parser.path, token->line);
+    } else {
+        fprintf(stderr, "[line %d] Error", token->line);
+    }
 
     if (token->type == TOKEN_EOF) {
         fprintf(stderr, " at end");
@@ -103,6 +142,7 @@ static void errorAt(Token* token, const char* message) {
     }
 
     fprintf(stderr, ": %s\n", message);
+    funlockfile(stderr);
     parser.hadError = true;
 }
 
@@ -136,6 +176,8 @@ static void consume(TokenType type, const char* message) {
         advance();
         return;
     }
+
+    errorAtCurrent(message);
 }
 
 /*This is a helper method for the match function which checks the type of the token*/
@@ -165,24 +207,29 @@ static void emitBytes(uint8_t byte1, uint8_t byte2) {
 
 /*This method helps the loop to re start from the beginning*/
 static void emitLoop(int loopStart) {
-    emitByte(OP_LOOP);
+    //always the long form, the peephole pass shrinks it when the loop is small enough
+    emitByte(OP_LOOP_LONG);
 
-    //take the current position subtract the loop start point and add 2 for size of OP_LOOP size
-    int offset = currentChunk()->count - loopStart + 2;
-    if (offset > UINT16_MAX) error("Loop body is too large maccha");
+    //take the current position subtract the loop start point and add 3 for size of the offset
+    int offset = currentChunk()->count - loopStart + 3;
+    if (offset > 0xffffff) error("Loop body is too large maccha");
 
-    emitByte((offset>>8) & 0xff);
+    emitByte((offset >> 16) & 0xff);
+    emitByte((offset >> 8) & 0xff);
     emitByte(offset & 0xff);
 }
 
-/*This method emits two placeholder address locations which are updated later*/
+/*This method emits three placeholder address locations which are updated later.
+Jumps start out long since the distance isn't known yet, the peephole pass turns
+them back into short jumps wherever they fit*/
 static int emitJump(uint8_t instruction) {
-    emitByte(instruction);
-    //Emit two placeholder bytes
+    emitByte(instruction == OP_JUMP ? OP_JUMP_LONG : OP_JUMP_IF_FALSE_LONG);
+    //Emit three placeholder bytes
+    emitByte(0xff);
     emitByte(0xff);
     emitByte(0xff);
     //return the chunk's position before the placeholder bytes (to be able to update them later)
-    return currentChunk()-> count - 2;
+    return currentChunk()-> count - 3;
 }
 
 static void emitReturn() {
@@ -190,50 +237,127 @@ static void emitReturn() {
     emitByte(OP_RETURN);
 }
 
-static uint8_t makeConstant(Value value) {
+static int makeConstant(Value value) {
+    //a pre-parsed body is thrown away, so there is no point filling its pool
+    if (parser.preparsing) return 0;
     //The add constant method will access the bytecode's constant pool and add the value to it
     int constant = addConstant(currentChunk(), value);
-    if (constant > UINT8_MAX) {
+    //the long instructions carry a 24 bit index
+    if (constant > 0xffffff) {
         error("Too many constants in one chunk da ");
         return 0;
     }
 
-    return (uint8_t)constant;
+    return constant;
+}
+
+/*Emits an instruction with a constant pool operand, switching to the 24 bit
+form once the index no longer fits in a byte*/
+static void emitConstantOp(OpCode op, int index) {
+    if (index <= UINT8_MAX) {
+        emitBytes(op, (uint8_t)index);
+        return;
+    }
+
+    OpCode longOp;
+    switch (op) {
+        case OP_CONSTANT:       longOp = OP_CONSTANT_LONG; break;
+        case OP_GET_GLOBAL:     longOp = OP_GET_GLOBAL_LONG; break;
+        case OP_DEFINE_GLOBAL:  longOp = OP_DEFINE_GLOBAL_LONG; break;
+        case OP_SET_GLOBAL:     longOp = OP_SET_GLOBAL_LONG; break;
+        case OP_CLOSURE:        longOp = OP_CLOSURE_LONG; break;
+        default:                longOp = op; break; // Unreachable.
+    }
+    emitByte(longOp);
+    emitByte((index >> 16) & 0xff);
+    emitByte((index >> 8) & 0xff);
+    emitByte(index & 0xff);
 }
 
 static void emitConstant(Value value) {
-    emitBytes(OP_CONSTANT, makeConstant(value));
+    emitConstantOp(OP_CONSTANT, makeConstant(value));
+}
+
+/*Emits the cheapest instruction that pushes the value*/
+static void emitValue(Value value) {
+    if (IS_NIL(value)) {
+        emitByte(OP_NIL);
+    } else if (IS_BOOL(value)) {
+        emitByte(AS_BOOL(value) ? OP_TRUE : OP_FALSE);
+    } else {
+        emitConstant(value);
+    }
+}
+
+/*Returns true if the code in [start, end) is a single instruction pushing a foldable
+constant (a number, bool, nil or string) and stores that constant in value*/
+static bool constantAt(int start, int end, Value* value) {
+    Chunk* chunk = currentChunk();
+    //the pool stays empty while pre-parsing
+    if (parser.preparsing) return false;
+    if (end - start == 1) {
+        switch (chunk->code[start]) {
+            case OP_NIL:   *value = NIL_VAL;         return true;
+            case OP_TRUE:  *value = BOOL_VAL(true);  return true;
+            case OP_FALSE: *value = BOOL_VAL(false); return true;
+            default:       return false;
+        }
+    }
+    if (end - start == 2 && chunk->code[start] == OP_CONSTANT) {
+        *value = chunk->constants.values[chunk->code[start + 1]];
+        return !IS_OBJ(*value) || IS_STRING(*value);
+    }
+    if (end - start == 4 && chunk->code[start] == OP_CONSTANT_LONG) {
+        uint8_t* operand = &chunk->code[start + 1];
+        *value = chunk->constants.values[operand[0] << 16 | operand[1] << 8 | operand[2]];
+        return !IS_OBJ(*value) || IS_STRING(*value);
+    }
+    return false;
 }
 
 static void patchJump(int offset) {
-    // -2 to adjust for the bytecode for the jump offset itself
-    int jump = currentChunk()->count - offset - 2;
+    // -3 to adjust for the bytecode for the jump offset itself
+    int jump = currentChunk()->count - offset - 3;
 
-    if (jump > UINT16_MAX) {
+    if (jump > 0xffffff) {
         error("Too much code to jump over");
     }
 
-    currentChunk()->code[offset] = (jump >> 8) & 0xff;
-    currentChunk()->code[offset+1] = jump & 0xff;
+    currentChunk()->code[offset] = (jump >> 16) & 0xff;
+    currentChunk()->code[offset+1] = (jump >> 8) & 0xff;
+    currentChunk()->code[offset+2] = jump & 0xff;
 }
 
-static void initCompiler(Compiler* compiler, FunctionType type) {
+/*function is the object to compile into, NULL makes a new one*/
+static void initCompiler(Compiler* compiler, FunctionType type, ObjFunction* function) {
     compiler->enclosing = current;
     compiler->function = NULL;
     compiler->type = type;
     compiler->localCount = 0;
     compiler->scopeDepth = 0;
-    compiler->function = newFunction();
+    if (parser.preparsing) {
+        //only the arity of a pre-parsed function is needed, it isn't worth an object
+        memset(&compiler->preparsed, 0, sizeof(ObjFunction));
+        initChunk(&compiler->preparsed.chunk);
+        compiler->function = &compiler->preparsed;
+    } else if (function != NULL) {
+        compiler->function = function;
+    } else {
+        compiler->function = newFunction(parser.vm);
+    }
     current = compiler;
 
-    if (type != TYPE_SCRIPT) {
-        current->function->name = copyString(parser.previous.start, parser.previous.length);
+    if (type != TYPE_SCRIPT && !parser.preparsing && current->function->name == NULL) {
+        current->function->name = copyString(parser.vm, parser.previous.start,
+                                             parser.previous.length);
     }
 
     //this is done so that the compiler's initial slot is not available for users to use
     //its reserved for the VM.
     Local* local = &current->locals[current->localCount++];
     local->depth = 0;
+    local->isCaptured = false;
+    local->isConstant = false;
     local->name.start = "";
     local->name.length = 0;
 }
@@ -241,6 +365,17 @@ static void initCompiler(Compiler* compiler, FunctionType type) {
 static ObjFunction* endCompiler() {
     emitReturn();
     ObjFunction* function = current->function;
+    if (parser.preparsing) {
+        freeChunk(&function->chunk);
+        current = current->enclosing;
+        return function;
+    }
+    //the constant index is only needed while compiling
+    freeTable(&currentChunk()->constantIndex);
+    if (!parser.hadError && !optimizeChunk(currentChunk())) {
+        error("Too much code to jump over");
+    }
+    if (!parser.hadError) specializeTypes(currentChunk(), function->arity);
     #ifdef DEBUG_PRINT_CODE
     if (!parser.hadError) {
         disassembleChunk(currentChunk(), function->name != NULL ? function->name->chars : "<script>");
@@ -263,7 +398,12 @@ static void endScope() {
     while (current->localCount > 0 && 
             current->locals[current->localCount - 1].depth >
                 current->scopeDepth) {
-                    emitByte(OP_POP);
+                    //only captured variables pay for moving into an upvalue
+                    if (current->locals[current->localCount - 1].isCaptured) {
+                        emitByte(OP_CLOSE_UPVALUE);
+                    } else {
+                        emitByte(OP_POP);
+                    }
                     current->localCount--;
                 }
 }
@@ -278,10 +418,11 @@ static void parsePrecedence(Precedence precedence);
 
 /*The method takes in the string, string interns it, then it adds the constant
 to the bytecode chunk !!!*/ 
-static uint8_t identifierConstant(Token* name) {
+static int identifierConstant(Token* name) {
+    if (parser.preparsing) return 0;
     // this method takes the string -> first string interns it and then 
     // adds it to the byte code chunk !!
-    return makeConstant(OBJ_VAL(copyString(name->start, name->length)));
+    return makeConstant(OBJ_VAL(copyString(parser.vm, name->start, name->length)));
 }
 
 static bool identifiersEqual(Token* a, Token* b) {
@@ -304,6 +445,46 @@ static int resolveLocal(Compiler* compiler, Token* name) {
     return -1;
 }
 
+/*Adds the captured variable to the function's upvalue list (reusing an existing entry)*/
+static int addUpvalue(Compiler* compiler, uint8_t index, bool isLocal) {
+    int upvalueCount = compiler->function->upvalueCount;
+
+    for (int i = 0; i < upvalueCount; i++) {
+        Upvalue* upvalue = &compiler->upvalues[i];
+        if (upvalue->index == index && upvalue->isLocal == isLocal) {
+            return i;
+        }
+    }
+
+    if (upvalueCount == UINT8_COUNT) {
+        error("Too many closure variables in function.");
+        return 0;
+    }
+
+    compiler->upvalues[upvalueCount].isLocal = isLocal;
+    compiler->upvalues[upvalueCount].index = index;
+    return compiler->function->upvalueCount++;
+}
+
+/*Looks the variable up in the enclosing functions, marking the local it resolves to
+as captured. Returns the upvalue index or -1 if it is a global*/
+static int resolveUpvalue(Compiler* compiler, Token* name) {
+    if (compiler->enclosing == NULL) return -1;
+
+    int local = resolveLocal(compiler->enclosing, name);
+    if (local != -1) {
+        compiler->enclosing->locals[local].isCaptured = true;
+        return addUpvalue(compiler, (uint8_t)local, true);
+    }
+
+    int upvalue = resolveUpvalue(compiler->enclosing, name);
+    if (upvalue != -1) {
+        return addUpvalue(compiler, (uint8_t)upvalue, false);
+    }
+
+    return -1;
+}
+
 
 /*Adds the local variable to the compiler's local variable list*/
 static void addLocal(Token name) {
@@ -318,6 +499,8 @@ static void addLocal(Token name) {
     local->name = name;
     //each variable's uninitialized state depth is -1
     local->depth = -1;
+    local->isCaptured = false;
+    local->isConstant = false;
 }
 
 /*This function is used for declaring a local variable*/
@@ -343,7 +526,7 @@ static void declareVariable() {
     addLocal(*name);
 }
 
-static uint8_t parseVariable(const char* errorMessage) {
+static int parseVariable(const char* errorMessage) {
     //consume the name of the variable
     consume(TOKEN_IDENTIFIER, errorMessage);
     
@@ -356,20 +539,71 @@ static uint8_t parseVariable(const char* errorMessage) {
     return identifierConstant(&parser.previous);
 }
 
+/*Looks ahead through the rest of the enclosing block for an assignment to name. The
+scan is purely lexical (any `name =` counts, even to a shadowing variable), so it
+can only ever be too careful. Very long blocks are assumed to assign*/
+static bool isAssignedLater(Token* name) {
+    Scanner saved = saveScanner();
+    TokenType beforePrevious = TOKEN_SEMICOLON;
+    Token previous = parser.previous;
+    Token token = parser.current;
+    int depth = 0;
+    bool assigned = true;
+
+    for (int scanned = 0; scanned < 4096; scanned++) {
+        if (token.type == TOKEN_EOF) {
+            assigned = false;
+            break;
+        }
+        //`var name = ...` declares a new variable, it doesn't assign this one
+        if (token.type == TOKEN_EQUAL && previous.type == TOKEN_IDENTIFIER &&
+            beforePrevious != TOKEN_VAR && identifiersEqual(&previous, name)) {
+            break;
+        }
+        if (token.type == TOKEN_LEFT_BRACE) depth++;
+        if (token.type == TOKEN_RIGHT_BRACE && depth-- == 0) {
+            //the block declaring the variable ends here
+            assigned = false;
+            break;
+        }
+        beforePrevious = previous.type;
+        previous = token;
+        token = scanToken();
+    }
+
+    restoreScanner(saved);
+    return assigned;
+}
+
+/*Finds a constant local of an enclosing function, so a closure can use the value
+instead of capturing the variable*/
+static bool resolveConstant(Compiler* compiler, Token* name, Value* value) {
+    for (Compiler* enclosing = compiler->enclosing; enclosing != NULL;
+         enclosing = enclosing->enclosing) {
+        int local = resolveLocal(enclosing, name);
+        if (local != -1) {
+            if (!enclosing->locals[local].isConstant) return false;
+            *value = enclosing->locals[local].constant;
+            return true;
+        }
+    }
+    return false;
+}
+
 /*This helper function helps marking the object as initialized by updating the depth from -1 to their actual values*/
 static void markInitialized() {
     if (current->scopeDepth == 0) return;
     current->locals[current->localCount - 1].depth = current->scopeDepth;
 }
 
-static void defineVariable(uint8_t global) {
+static void defineVariable(int global) {
     //if the current scope is nested -> then the variable is not global
     if (current->scopeDepth > 0) {
         markInitialized();
         return;
     }
     
-    emitBytes(OP_DEFINE_GLOBAL, global);
+    emitConstantOp(OP_DEFINE_GLOBAL, global);
 }
 
 static uint8_t argumentList() {
@@ -401,14 +635,111 @@ static void and_(bool canAssign) {
     patchJump(endJump);
 }
 
+/*Removes the constant instructions from start onwards (operands that were just
+folded), giving back their slots if they are the newest entries in the pool and were
+added after firstConstant (older slots may be shared with earlier code)*/
+static void discardConstants(int start, int firstConstant) {
+    Chunk* chunk = currentChunk();
+    int indices[2];
+    int count = 0;
+    for (int offset = start; offset < chunk->count; ) {
+        if (chunk->code[offset] == OP_CONSTANT) {
+            if (count < 2) indices[count++] = chunk->code[offset + 1];
+            offset += 2;
+        } else if (chunk->code[offset] == OP_CONSTANT_LONG) {
+            uint8_t* operand = &chunk->code[offset + 1];
+            if (count < 2) indices[count++] = operand[0] << 16 | operand[1] << 8 | operand[2];
+            offset += 4;
+        } else {
+            offset++;
+        }
+    }
+    for (int i = count - 1; i >= 0; i--) {
+        if (indices[i] == chunk->constants.count - 1 && indices[i] >= firstConstant) {
+            removeLastConstant(chunk);
+        }
+    }
+    truncateChunk(chunk, start);
+}
+
+static bool isFalsey(Value value) {
+    return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
+}
+
+/*Evaluates the operator on two constants at compile time. Returns false for
+anything the VM would reject (mismatched operand types) so the runtime error stays*/
+static bool foldBinary(TokenType operatorType, Value a, Value b, Value* result) {
+    switch (operatorType) {
+        case TOKEN_EQUAL_EQUAL: *result = BOOL_VAL(valuesEqual(a, b));  return true;
+        case TOKEN_BANG_EQUAL:  *result = BOOL_VAL(!valuesEqual(a, b)); return true;
+        default: break;
+    }
+
+    if (operatorType == TOKEN_PLUS && IS_STRING(a) && IS_STRING(b)) {
+        ObjString* left = AS_STRING(a);
+        ObjString* right = AS_STRING(b);
+        int length = left->length + right->length;
+        char* chars = ALLOCATE(char, length + 1);
+        memcpy(chars, left->chars, left->length);
+        memcpy(chars + left->length, right->chars, right->length);
+        chars[length] = '\0';
+        *result = OBJ_VAL(takeString(parser.vm, chars, length));
+        return true;
+    }
+
+    if (!IS_NUMBER(a) || !IS_NUMBER(b)) return false;
+    //the same integer paths the VM takes
+    if (IS_INT(a) && IS_INT(b)) {
+        int64_t i = AS_INT(a);
+        int64_t j = AS_INT(b);
+        switch (operatorType) {
+            case TOKEN_PLUS:          *result = intResult(i + j);                return true;
+            case TOKEN_MINUS:         *result = intResult(i - j);                return true;
+            case TOKEN_STAR:          *result = multiplyInts(AS_INT(a), AS_INT(b)); return true;
+            case TOKEN_GREATER:       *result = BOOL_VAL(i > j);                 return true;
+            case TOKEN_LESS:          *result = BOOL_VAL(i < j);                 return true;
+            case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(i >= j);                return true;
+            case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(i <= j);                return true;
+            default:                  break;
+        }
+    }
+    double x = AS_NUMBER(a);
+    double y = AS_NUMBER(b);
+    switch (operatorType) {
+        case TOKEN_PLUS:          *result = NUMBER_VAL(x + y);   return true;
+        case TOKEN_MINUS:         *result = NUMBER_VAL(x - y);   return true;
+        case TOKEN_STAR:          *result = NUMBER_VAL(x * y);   return true;
+        case TOKEN_SLASH:         *result = NUMBER_VAL(x / y);   return true;
+        case TOKEN_GREATER:       *result = BOOL_VAL(x > y);     return true;
+        case TOKEN_LESS:          *result = BOOL_VAL(x < y);     return true;
+        //written the way the VM runs them (OP_LESS, OP_NOT) so NaN behaves the same
+        case TOKEN_GREATER_EQUAL: *result = BOOL_VAL(!(x < y));  return true;
+        case TOKEN_LESS_EQUAL:    *result = BOOL_VAL(!(x > y));  return true;
+        default:                  return false;
+    }
+}
+
 static void binary(bool canAssign) {
     // The token type is saved 
     TokenType operatorType = parser.previous.type;
+    int leftStart = parser.operandStart;
+    int leftConstants = parser.operandConstants;
+    int rightStart = currentChunk()->count;
     // the rule is obtained from the operator type !
     ParseRule* rule = getRule(operatorType);
     // the precedence is set
     parsePrecedence((Precedence) (rule->precedence + 1));
 
+    //if both operands are constants, replace them with the result
+    Value a, b, result;
+    if (constantAt(leftStart, rightStart, &a) &&
+        constantAt(rightStart, currentChunk()->count, &b) &&
+        foldBinary(operatorType, a, b, &result)) {
+        discardConstants(leftStart, leftConstants);
+        emitValue(result);
+        return;
+    }
+
     switch (operatorType) {
         case TOKEN_BANG_EQUAL:    emitBytes(OP_EQUAL, OP_NOT); break;
         case TOKEN_EQUAL_EQUAL:   emitByte(OP_EQUAL); break;
@@ -439,6 +770,19 @@ static void call(bool canAssign) {
     emitBytes(OP_CALL, argCount);
 }
 
+/*Indexing, m[key] reads an entry and m[key] = value writes one*/
+static void subscript(bool canAssign) {
+    expression();
+    consume(TOKEN_RIGHT_BRACKET, "Expect ']' after index.");
+
+    if (canAssign && match(TOKEN_EQUAL)) {
+        expression();
+        emitByte(OP_SET_INDEX);
+    } else {
+        emitByte(OP_GET_INDEX);
+    }
+}
+
 static void literal(bool canAssign) {
     switch(parser.previous.type) {
         case TOKEN_FALSE:   emitByte(OP_FALSE); break;
@@ -448,6 +792,27 @@ static void literal(bool canAssign) {
     }
 }
 
+/*A map literal {key: value, ...}, the entries are pushed in order and the VM
+builds the map in one go with the right number of buckets*/
+static void mapLiteral(bool canAssign) {
+    int count = 0;
+    if (!check(TOKEN_RIGHT_BRACE)) {
+        do {
+            //allow a trailing comma
+            if (check(TOKEN_RIGHT_BRACE)) break;
+            expression();
+            consume(TOKEN_COLON, "Expect ':' after map key.");
+            expression();
+            if (count == UINT8_MAX) {
+                error("Can't have more than 255 entries in a map literal.");
+            }
+            count++;
+        } while (match(TOKEN_COMMA));
+    }
+    consume(TOKEN_RIGHT_BRACE, "Expect '}' after map entries.");
+    emitBytes(OP_BUILD_MAP, (uint8_t)count);
+}
+
 static void expression() {
     //the expression function shall parse the lowest precedence which shall 
     //consume all other expressions !
@@ -464,13 +829,8 @@ static void block() {
     consume(TOKEN_RIGHT_BRACE, "Expect '}' after block.");
 }
 
-/*The method */
-static void function(FunctionType type) {
-    
-    Compiler compiler;
-    
-    initCompiler(&compiler, type);
-    
+/*Parses the parameters and the body into the current compiler*/
+static void functionBody() {
     beginScope();
 
     consume(TOKEN_LEFT_PAREN, "Expect '(' after function name");
@@ -485,7 +845,7 @@ static void function(FunctionType type) {
                 errorAtCurrent("Can't have more than 255 parameters");
             }
             //the parameter is then saved and defined in the variable's local stack.
-            uint8_t constant = parseVariable("Expect a parameter's name");
+            int constant = parseVariable("Expect a parameter's name");
             defineVariable(constant);
         } while (match(TOKEN_COMMA));   
     }
@@ -494,16 +854,67 @@ static void function(FunctionType type) {
     consume(TOKEN_RIGHT_PAREN, "Expect ')' after parameters");
     consume(TOKEN_LEFT_BRACE, "Expect '{' after the function body.");
     block();
+}
+
+/*A function declared at the top of a script can only capture globals, so its body
+can be compiled on its own later. For now it's only checked for errors, and gets a
+stub that remembers where its source is until the first call compiles it*/
+static bool isLazy() {
+    return parser.lazy && !parser.preparsing &&
+           current->type == TYPE_SCRIPT && current->scopeDepth == 0;
+}
 
+static void lazyFunction() {
+    ObjFunction* stub = newFunction(parser.vm);
+    stub->name = copyString(parser.vm, parser.previous.start, parser.previous.length);
+    //the source starts at the '(' of the parameters
+    stub->lazySource = parser.current.start;
+    stub->lazyLine = parser.current.line;
+    stub->lazyPath = parser.path;
+
+    parser.preparsing = true;
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, NULL);
+    functionBody();
+    stub->arity = endCompiler()->arity;
+    parser.preparsing = false;
+
+    //and ends at the '}' that closes the body
+    stub->lazyLength = (int)(parser.previous.start + parser.previous.length - stub->lazySource);
+    emitConstant(OBJ_VAL(stub));
+}
+
+/*The method */
+static void function(FunctionType type) {
+    if (isLazy()) {
+        lazyFunction();
+        return;
+    }
+
+    Compiler compiler;
+    initCompiler(&compiler, type, NULL);
+    functionBody();
     ObjFunction* function = endCompiler();
-    emitBytes(OP_CONSTANT, makeConstant(OBJ_VAL(function)));
+
+    //a function that captures nothing is used as is, so creating and calling it
+    //never allocates a closure
+    if (function->upvalueCount == 0) {
+        emitConstant(OBJ_VAL(function));
+        return;
+    }
+
+    emitConstantOp(OP_CLOSURE, makeConstant(OBJ_VAL(function)));
+    for (int i = 0; i < function->upvalueCount; i++) {
+        emitByte(compiler.upvalues[i].isLocal ? 1 : 0);
+        emitByte(compiler.upvalues[i].index);
+    }
 }
 
 /*This method helps in function declaration*/
 /*A function declaration is considered as a variable declaration and the same is instantly marked as initialized*/
 static void funDeclaration() {
     //The name is defined and read.
-    uint8_t global = parseVariable("Expect function name");
+    int global = parseVariable("Expect function name");
     markInitialized();
     function(TYPE_FUNCTION);
     defineVariable(global);
@@ -512,7 +923,8 @@ static void funDeclaration() {
 /*This method helps with variable declaration in the stataments method*/
 static void varDeclaration() {
     //the variable is first parsed for its name
-    uint8_t global = parseVariable("Expect variable name");
+    int global = parseVariable("Expect variable name");
+    int initializerStart = currentChunk()->count;
 
     if (match(TOKEN_EQUAL)) {
         expression();
@@ -524,6 +936,17 @@ static void varDeclaration() {
     consume(TOKEN_SEMICOLON,
         "Expect ';' after variable declaration.");
 
+    //a local that starts as a literal and is never assigned is propagated as a constant
+    Value constant;
+    if (current->scopeDepth > 0 &&
+        constantAt(initializerStart, currentChunk()->count, &constant)) {
+        Local* local = &current->locals[current->localCount - 1];
+        if (!isAssignedLater(&local->name)) {
+            local->isConstant = true;
+            local->constant = constant;
+        }
+    }
+
     //define the variable which has been read.
     defineVariable(global);
 }
@@ -747,9 +1170,27 @@ static void grouping(bool canAssign) {
 }
 
 
-static void number(bool canAssign) {
+/*Tokens are slices of the source with nothing after them to stop strtod, so the digits
+get copied out first*/
+static double parseNumber(const char* start, int length) {
+    char buffer[64];
+    char* digits = length < (int)sizeof(buffer) ? buffer : ALLOCATE(char, length + 1);
+    memcpy(digits, start, length);
+    digits[length] = '\0';
     //strtod converts a string to a double int 
-    double value = strtod(parser.previous.start, NULL);
+    double value = strtod(digits, NULL);
+    if (digits != buffer) FREE_ARRAY(char, digits, length + 1);
+    return value;
+}
+
+static void number(bool canAssign) {
+    double value = parseNumber(parser.previous.start, parser.previous.length);
+    //literals without a fraction become ints when they fit
+    if (memchr(parser.previous.start, '.', parser.previous.length) == NULL &&
+        value <= INT32_MAX) {
+        emitConstant(INT_VAL((int32_t)value));
+        return;
+    }
     //emit the value but first use the number casting macro to cast the value to a number !
     emitConstant(NUMBER_VAL(value));
 }
@@ -768,18 +1209,32 @@ static void or_(bool canAssign) {
 
 /*This function helps form a bytecode for strings*/
 static void string(bool canAssign) {
+    if (parser.preparsing) {
+        emitByte(OP_NIL);
+        return;
+    }
     //(The +1 and -2 trim the leading and trailing quotation marks)
-    emitConstant(OBJ_VAL(copyString(parser.previous.start + 1,
-                                            parser.previous.length - 2)));
+    emitConstant(OBJ_VAL(copyString(parser.vm, parser.previous.start + 1,
+                                    parser.previous.length - 2)));
 }
 
 static void namedVariable(Token name, bool canAssign) {
     uint8_t getOp, setOp;
     int arg = resolveLocal(current, &name);
-    
-    if (arg != -1) {
+    Value constant;
+
+    if (arg != -1 && current->locals[arg].isConstant) {
+        emitValue(current->locals[arg].constant);
+        return;
+    } else if (arg == -1 && resolveConstant(current, &name, &constant)) {
+        emitValue(constant);
+        return;
+    } else if (arg != -1) {
         getOp = OP_GET_LOCAL;
         setOp = OP_SET_LOCAL;
+    } else if ((arg = resolveUpvalue(current, &name)) != -1) {
+        getOp = OP_GET_UPVALUE;
+        setOp = OP_SET_UPVALUE;
     } else {
         arg = identifierConstant(&name);
         getOp = OP_GET_GLOBAL;
@@ -791,10 +1246,10 @@ static void namedVariable(Token name, bool canAssign) {
     if (canAssign && match(TOKEN_EQUAL)) {
         expression();
         //emit the setter bytecode chunk
-        emitBytes(setOp, (uint8_t) arg);
+        emitConstantOp(setOp, arg);
     } else {
         //else emit the getter bytecode chunk
-        emitBytes(getOp, (uint8_t) arg);
+        emitConstantOp(getOp, arg);
     }
 }
 
@@ -807,8 +1262,27 @@ static void unary(bool canAssign) {
     //the previous token's type is saved into the operator type !!
     TokenType operatorType = parser.previous.type;
 
+    int operandStart = currentChunk()->count;
+    int operandConstants = currentChunk()->constants.count;
+
     //we limit the compilation to the point of finding the unary operator!
     parsePrecedence(PREC_UNARY);
+
+    //fold the operator into a constant operand
+    Value operand;
+    if (constantAt(operandStart, currentChunk()->count, &operand)) {
+        if (operatorType == TOKEN_BANG) {
+            discardConstants(operandStart, operandConstants);
+            emitValue(BOOL_VAL(isFalsey(operand)));
+            return;
+        }
+        if (operatorType == TOKEN_MINUS && IS_NUMBER(operand)) {
+            discardConstants(operandStart, operandConstants);
+            emitValue(IS_INT(operand) ? negateInt(AS_INT(operand))
+                                      : NUMBER_VAL(-AS_NUMBER(operand)));
+            return;
+        }
+    }
     
     //In case the type is a negate
     switch (operatorType) {
@@ -831,8 +1305,11 @@ ParseRule rules[] = {
     //Token = {Prefix (ParseFn ptr), Infix (ParseFn ptr), Precedence:)}
   [TOKEN_LEFT_PAREN]    = {grouping, call,   PREC_CALL},
   [TOKEN_RIGHT_PAREN]   = {NULL,     NULL,   PREC_NONE},
-  [TOKEN_LEFT_BRACE]    = {NULL,     NULL,   PREC_NONE}, 
+  [TOKEN_LEFT_BRACE]    = {mapLiteral, NULL, PREC_NONE},
   [TOKEN_RIGHT_BRACE]   = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_LEFT_BRACKET]  = {NULL,     subscript, PREC_CALL},
+  [TOKEN_RIGHT_BRACKET] = {NULL,     NULL,   PREC_NONE},
+  [TOKEN_COLON]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_COMMA]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_DOT]           = {NULL,     NULL,   PREC_NONE},
   [TOKEN_MINUS]         = {unary,    binary, PREC_TERM},
@@ -841,7 +1318,7 @@ ParseRule rules[] = {
   [TOKEN_SLASH]         = {NULL,     binary, PREC_FACTOR},
   [TOKEN_STAR]          = {NULL,     binary, PREC_FACTOR},
   [TOKEN_BANG]          = {unary,     NULL,  PREC_NONE},
-  [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_NONE},
+  [TOKEN_BANG_EQUAL]    = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_EQUAL]         = {NULL,     NULL,   PREC_NONE},
   [TOKEN_EQUAL_EQUAL]   = {NULL,     binary, PREC_EQUALITY},
   [TOKEN_GREATER]       = {NULL,     binary, PREC_COMPARISON},
@@ -889,6 +1366,8 @@ static void parsePrecedence(Precedence precedence) {
 
     
     bool canAssign = precedence <= PREC_ASSIGNMENT;
+    int start = currentChunk()->count;
+    int startConstants = currentChunk()->constants.count;
     //call the function so stored in the prefixRule !!
     prefixRule(canAssign);
 
@@ -897,6 +1376,9 @@ static void parsePrecedence(Precedence precedence) {
         advance();
         //ParseFn infixRule -> get the inflix fn 
         ParseFn infixRule = getRule(parser.previous.type)->infix;
+        //the left operand is everything compiled since the prefix started
+        parser.operandStart = start;
+        parser.operandConstants = startConstants;
         //run the infix function
         infixRule(canAssign);
     }
@@ -912,15 +1394,26 @@ static ParseRule* getRule(TokenType type) {
 }
 
 /*When compiling, the tokenized source code is passed as args to the function*/
-ObjFunction* compile(const char* source) {
-    
-    initScanner(source);
-    Compiler compiler;
-    initCompiler(&compiler, TYPE_SCRIPT);
+ObjFunction* compile(VM* vm, const char* path, const char* source, size_t length,
+                     bool lazy) {
+    //a compile may start in the middle of another one on the same thread, the state
+    //of the outer one is put back at the end
+    Parser enclosingParser = parser;
+    Compiler* enclosingCompiler = current;
+    Scanner enclosingScanner = saveScanner();
+    current = NULL;
 
     //Initialization for the bool variables in the parser !
+    parser.vm = vm;
     parser.hadError = false;
     parser.panicMode = false;
+    parser.path = path;
+    parser.lazy = lazy;
+    parser.preparsing = false;
+
+    initScanner(source, length, 1);
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_SCRIPT, NULL);
 
     //Reads the error free tokens !!
     advance();
@@ -930,5 +1423,41 @@ ObjFunction* compile(const char* source) {
     }
     
     ObjFunction* function = endCompiler();
-    return parser.hadError ? NULL : function;
-}
\ No newline at end of file
+    bool hadError = parser.hadError;
+
+    parser = enclosingParser;
+    current = enclosingCompiler;
+    restoreScanner(enclosingScanner);
+    return hadError ? NULL : function;
+}
+
+bool compileLazy(VM* vm, ObjFunction* function) {
+    Parser enclosingParser = parser;
+    Compiler* enclosingCompiler = current;
+    Scanner enclosingScanner = saveScanner();
+    current = NULL;
+
+    parser.vm = vm;
+    parser.hadError = false;
+    parser.panicMode = false;
+    parser.path = function->lazyPath;
+    //functions nested in this one are compiled along with it
+    parser.lazy = false;
+    parser.preparsing = false;
+
+    initScanner(function->lazySource, function->lazyLength, function->lazyLine);
+    advance();
+    Compiler compiler;
+    initCompiler(&compiler, TYPE_FUNCTION, function);
+    //the pre-parse already counted the parameters
+    function->arity = 0;
+    functionBody();
+    endCompiler();
+    bool hadError = parser.hadError;
+    if (!hadError) function->lazySource = NULL;
+
+    parser = enclosingParser;
+    current = enclosingCompiler;
+    restoreScanner(enclosingScanner);
+    return !hadError;
+}
@@ -4,6 +4,16 @@
 #include "object.h"
 #include "vm.h"
 
-ObjFunction* compile(const char* source);
+/*Compiles a script for the VM, which is NULL while an object arena collects everything
+the compile allocates. The path (NULL if there's no file) goes into error messages. The
+source needn't be '\0' terminated and has to stay alive while compiling. With lazy set
+the functions declared at the top of the script are only checked for errors and compile
+on their first call, so then the source and path have to outlive the script*/
+ObjFunction* compile(VM* vm, const char* path, const char* source, size_t length,
+                     bool lazy);
+
+/*Compiles the body of a function the lazy compile skipped. On an error the function
+stays uncompiled and false comes back*/
+bool compileLazy(VM* vm, ObjFunction* function);
 
 #endif
\ No newline at end of file
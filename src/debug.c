@@ -1,6 +1,7 @@
 #include <stdio.h>
 
 #include "debug.h"
+#include "object.h"
 #include "value.h"
 
 void disassembleChunk(Chunk* chunk, const char* name) {
@@ -27,6 +28,17 @@ static int constantInstruction(const char* name, Chunk* chunk, int offset) {
     return offset+2;
 }
 
+/*Same as constantInstruction but with the 24 bit index of the long forms*/
+static int constantLongInstruction(const char* name, Chunk* chunk, int offset) {
+    int constant = chunk->code[offset + 1] << 16 |
+                   chunk->code[offset + 2] << 8 |
+                   chunk->code[offset + 3];
+    printf("%-16s %4d ' ", name, constant);
+    printValue(chunk->constants.values[constant]);
+    printf("'\n");
+    return offset + 4;
+}
+
 static int simpleInstruction(const char* name, int offset) {
     printf("%s\n", name);
     return offset + 1;
@@ -48,15 +60,40 @@ static int jumpInstruction(const char* name, int sign, Chunk* chunk, int offset)
     return offset + 3;
 }
 
+static int jumpLongInstruction(const char* name, int sign, Chunk* chunk, int offset) {
+    int jump = chunk->code[offset + 1] << 16 |
+               chunk->code[offset + 2] << 8 |
+               chunk->code[offset + 3];
+    printf("%-16s %4d -> %d\n", name, offset, offset + 4 + sign * jump);
+    return offset + 4;
+}
+
+/*Checks that a slot still holds the function whose body was inlined after it, and
+jumps to the regular call if it doesn't*/
+static int guardInstruction(const char* name, Chunk* chunk, int offset, bool isLong) {
+    int slot = chunk->code[offset + 1];
+    int constant = chunk->code[offset + 2] << 16 |
+                   chunk->code[offset + 3] << 8 |
+                   chunk->code[offset + 4];
+    int jump = isLong ?
+        chunk->code[offset + 5] << 16 | chunk->code[offset + 6] << 8 | chunk->code[offset + 7] :
+        chunk->code[offset + 5] << 8 | chunk->code[offset + 6];
+    int length = isLong ? 8 : 7;
+    printf("%-16s %4d ", name, slot);
+    printValue(chunk->constants.values[constant]);
+    printf(" inlined, else -> %d\n", offset + length + jump);
+    return offset + length;
+}
+
 int disassembleInstruction(Chunk* chunk, int offset) {
     //Print the offset !
     printf("%04d ", offset);
       
-    if (offset > 0 &&
-    chunk->lines[offset] == chunk->lines[offset - 1]) {
+    int line = getLine(chunk, offset);
+    if (offset > 0 && line == getLine(chunk, offset - 1)) {
         printf("   | ");
   } else {
-        printf("%4d ", chunk->lines[offset]);
+        printf("%4d ", line);
   }
 
     //the instruction is then taken in from the array !
@@ -67,6 +104,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
     switch(instruction) {
         case OP_CONSTANT:
             return constantInstruction("OP_CONSTANT", chunk, offset);
+
+        case OP_CONSTANT_LONG:
+            return constantLongInstruction("OP_CONSTANT_LONG", chunk, offset);
         
         case OP_NIL:
             return simpleInstruction("OP_NIL", offset);
@@ -79,6 +119,9 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         
         case OP_POP:
             return simpleInstruction("OP_POP", offset);
+
+        case OP_POPN:
+            return byteInstruction("OP_POPN", chunk, offset);
         
         case OP_GET_LOCAL:
             return byteInstruction("OP_GET_LOCAL", chunk, offset);
@@ -88,12 +131,37 @@ int disassembleInstruction(Chunk* chunk, int offset) {
 
         case OP_GET_GLOBAL:
             return constantInstruction("OP_GET_GLOBAL", chunk, offset);
+
+        case OP_GET_GLOBAL_LONG:
+            return constantLongInstruction("OP_GET_GLOBAL_LONG", chunk, offset);
     
         case OP_DEFINE_GLOBAL:
             return constantInstruction("OP_DEFINE_GLOBAL", chunk,
                                     offset);
+
+        case OP_DEFINE_GLOBAL_LONG:
+            return constantLongInstruction("OP_DEFINE_GLOBAL_LONG", chunk, offset);
+
         case OP_SET_GLOBAL:
             return constantInstruction("OP_SET_GLOBAL", chunk, offset);
+
+        case OP_SET_GLOBAL_LONG:
+            return constantLongInstruction("OP_SET_GLOBAL_LONG", chunk, offset);
+
+        case OP_GET_UPVALUE:
+            return byteInstruction("OP_GET_UPVALUE", chunk, offset);
+
+        case OP_SET_UPVALUE:
+            return byteInstruction("OP_SET_UPVALUE", chunk, offset);
+
+        case OP_GET_INDEX:
+            return simpleInstruction("OP_GET_INDEX", offset);
+
+        case OP_SET_INDEX:
+            return simpleInstruction("OP_SET_INDEX", offset);
+
+        case OP_BUILD_MAP:
+            return byteInstruction("OP_BUILD_MAP", chunk, offset);
         
         case OP_EQUAL:
             return simpleInstruction("OP_EQUAL", offset);
@@ -103,6 +171,15 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         
         case OP_LESS:
             return simpleInstruction("OP_LESS", offset);
+
+        case OP_NOT_EQUAL:
+            return simpleInstruction("OP_NOT_EQUAL", offset);
+
+        case OP_GREATER_EQUAL:
+            return simpleInstruction("OP_GREATER_EQUAL", offset);
+
+        case OP_LESS_EQUAL:
+            return simpleInstruction("OP_LESS_EQUAL", offset);
         //Disassemblers for binary operators !
         
         case OP_ADD:
@@ -123,6 +200,27 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         //If it is OP_NEGATE then just return the Simple Instruction with OP_NEGATE!
         case OP_NEGATE:
             return simpleInstruction("OP_NEGATE", offset);
+
+        case OP_ADD_NUMBER:
+            return simpleInstruction("OP_ADD_NUMBER", offset);
+        case OP_ADD_STRING:
+            return simpleInstruction("OP_ADD_STRING", offset);
+        case OP_SUBTRACT_NUMBER:
+            return simpleInstruction("OP_SUBTRACT_NUMBER", offset);
+        case OP_MULTIPLY_NUMBER:
+            return simpleInstruction("OP_MULTIPLY_NUMBER", offset);
+        case OP_DIVIDE_NUMBER:
+            return simpleInstruction("OP_DIVIDE_NUMBER", offset);
+        case OP_NEGATE_NUMBER:
+            return simpleInstruction("OP_NEGATE_NUMBER", offset);
+        case OP_GREATER_NUMBER:
+            return simpleInstruction("OP_GREATER_NUMBER", offset);
+        case OP_LESS_NUMBER:
+            return simpleInstruction("OP_LESS_NUMBER", offset);
+        case OP_GREATER_EQUAL_NUMBER:
+            return simpleInstruction("OP_GREATER_EQUAL_NUMBER", offset);
+        case OP_LESS_EQUAL_NUMBER:
+            return simpleInstruction("OP_LESS_EQUAL_NUMBER", offset);
         
         case OP_PRINT:
             return simpleInstruction("OP_PRINT", offset);
@@ -136,8 +234,54 @@ int disassembleInstruction(Chunk* chunk, int offset) {
         case OP_LOOP:
             return jumpInstruction("OP_LOOP", -1, chunk, offset);
 
+        case OP_JUMP_LONG:
+            return jumpLongInstruction("OP_JUMP_LONG", 1, chunk, offset);
+
+        case OP_JUMP_IF_FALSE_LONG:
+            return jumpLongInstruction("OP_JUMP_IF_FALSE_LONG", 1, chunk, offset);
+
+        case OP_LOOP_LONG:
+            return jumpLongInstruction("OP_LOOP_LONG", -1, chunk, offset);
+
         case OP_CALL:
             return byteInstruction("OP_CALL", chunk, offset);
+
+        case OP_GUARD_CALLEE:
+            return guardInstruction("OP_GUARD_CALLEE", chunk, offset, false);
+
+        case OP_GUARD_CALLEE_LONG:
+            return guardInstruction("OP_GUARD_CALLEE_LONG", chunk, offset, true);
+
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG: {
+            int constant;
+            if (instruction == OP_CLOSURE) {
+                constant = chunk->code[offset + 1];
+                offset += 2;
+            } else {
+                constant = chunk->code[offset + 1] << 16 |
+                           chunk->code[offset + 2] << 8 |
+                           chunk->code[offset + 3];
+                offset += 4;
+            }
+            printf("%-16s %4d ", instruction == OP_CLOSURE ? "OP_CLOSURE" : "OP_CLOSURE_LONG",
+                   constant);
+            printValue(chunk->constants.values[constant]);
+            printf("\n");
+
+            //followed by an (isLocal, index) pair per captured variable
+            ObjFunction* function = AS_FUNCTION(chunk->constants.values[constant]);
+            for (int j = 0; j < function->upvalueCount; j++) {
+                int isLocal = chunk->code[offset++];
+                int index = chunk->code[offset++];
+                printf("%04d      |                     %s %d\n",
+                       offset - 2, isLocal ? "local" : "upvalue", index);
+            }
+            return offset;
+        }
+
+        case OP_CLOSE_UPVALUE:
+            return simpleInstruction("OP_CLOSE_UPVALUE", offset);
         
         //If it is OP_Return then return, Simple Instructions
         case OP_RETURN:
@@ -0,0 +1,75 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <unistd.h>
+
+#include "compiler.h"
+#include "loader.h"
+#include "memory.h"
+
+/*State shared by the pool. Workers take the next source off a counter, so big and
+small files even out across threads without any locking*/
+typedef struct {
+    //workers only read its interned strings
+    VM* vm;
+    const char** paths;
+    const char** sources;
+    const size_t* lengths;
+    ObjFunction** functions;
+    //one per source, so the results can be merged in source order afterwards
+    ObjectArena* arenas;
+    int count;
+    atomic_int next;
+} CompileJobs;
+
+static void* compileWorker(void* argument) {
+    CompileJobs* jobs = (CompileJobs*)argument;
+    for (;;) {
+        int index = atomic_fetch_add(&jobs->next, 1);
+        if (index >= jobs->count) break;
+
+        useObjectArena(&jobs->arenas[index]);
+        jobs->functions[index] = compile(jobs->vm, jobs->paths[index],
+                                         jobs->sources[index], jobs->lengths[index], true);
+        useObjectArena(NULL);
+    }
+    return NULL;
+}
+
+static int threadCount(int count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int threads = cores > 0 ? (int)cores : 1;
+    if (threads > MAX_COMPILE_THREADS) threads = MAX_COMPILE_THREADS;
+    return threads < count ? threads : count;
+}
+
+bool compileSources(VM* vm, const char** paths, const char** sources,
+                    const size_t* lengths, int count, ObjFunction** functions) {
+    CompileJobs jobs;
+    jobs.vm = vm;
+    jobs.paths = paths;
+    jobs.sources = sources;
+    jobs.lengths = lengths;
+    jobs.functions = functions;
+    jobs.arenas = ALLOCATE(ObjectArena, count);
+    jobs.count = count;
+    atomic_init(&jobs.next, 0);
+    for (int i = 0; i < count; i++) initObjectArena(&jobs.arenas[i]);
+
+    //the calling thread works through the jobs too, so one source needs no extra thread
+    int threads = threadCount(count);
+    pthread_t workers[MAX_COMPILE_THREADS];
+    int started = 0;
+    for (; started < threads - 1; started++) {
+        if (pthread_create(&workers[started], NULL, compileWorker, &jobs) != 0) break;
+    }
+    compileWorker(&jobs);
+    for (int i = 0; i < started; i++) pthread_join(workers[i], NULL);
+
+    bool compiled = true;
+    for (int i = 0; i < count; i++) {
+        mergeObjectArena(vm, &jobs.arenas[i]);
+        if (functions[i] == NULL) compiled = false;
+    }
+    FREE_ARRAY(ObjectArena, jobs.arenas, count);
+    return compiled;
+}
@@ -0,0 +1,16 @@
+#ifndef cpandi_loader_h
+#define cpandi_loader_h
+
+#include "object.h"
+
+/*Upper bound on compile threads, the pool never starts more threads than sources*/
+#define MAX_COMPILE_THREADS 16
+
+/*Compiles every source into its own script function for the VM on a pool of threads,
+sources[i] is lengths[i] characters long. functions[i] is NULL where sources[i] has a
+compile error, which is reported with paths[i]. The return value says whether all of
+them compiled. Must be called from the thread that runs the VM while it is idle*/
+bool compileSources(VM* vm, const char** paths, const char** sources,
+                    const size_t* lengths, int count, ObjFunction** functions);
+
+#endif
@@ -0,0 +1,426 @@
+//accept4() and pipe2() are GNU extensions
+#define _GNU_SOURCE
+#include <arpa/inet.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netinet/in.h>
+#include <poll.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/socket.h>
+#include <time.h>
+#include <unistd.h>
+#include "loop.h"
+#include "memory.h"
+#include "scheduler.h"
+#include "vm.h"
+
+//events handled per epoll_wait, more just wait for the next round
+#define EVENTS_MAX 64
+
+void initEventLoop(EventLoop* loop) {
+    loop->epollFd = -1;
+    loop->ready = NULL;
+    loop->readyStart = 0;
+    loop->readyCount = 0;
+    loop->readyCapacity = 0;
+    loop->timers = NULL;
+    loop->timerCount = 0;
+    loop->timerCapacity = 0;
+    loop->requests = NULL;
+    loop->requestCapacity = 0;
+    loop->requestCount = 0;
+    loop->worker = NULL;
+    loop->wakeFd = -1;
+}
+
+void freeEventLoop(EventLoop* loop) {
+    if (loop->epollFd >= 0) close(loop->epollFd);
+    if (loop->wakeFd >= 0) close(loop->wakeFd);
+    for (int i = 0; i < loop->requestCapacity; i++) {
+        if (loop->requests[i] != NULL) FREE(IoRequest, loop->requests[i]);
+    }
+    FREE_ARRAY(ReadyFiber, loop->ready, loop->readyCapacity);
+    FREE_ARRAY(Timer, loop->timers, loop->timerCapacity);
+    FREE_ARRAY(IoRequest*, loop->requests, loop->requestCapacity);
+    initEventLoop(loop);
+}
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+void scheduleFiber(EventLoop* loop, ObjFiber* fiber, Value value) {
+    if (loop->readyCapacity < loop->readyCount + 1) {
+        int oldCapacity = loop->readyCapacity;
+        loop->readyCapacity = GROW_CAPACITY(oldCapacity);
+        loop->ready = GROW_ARRAY(ReadyFiber, loop->ready, oldCapacity, loop->readyCapacity);
+        //the queue may wrap around the end, that part moves behind the old end
+        int wrapped = loop->readyStart + loop->readyCount - oldCapacity;
+        if (wrapped > 0) {
+            memcpy(&loop->ready[oldCapacity], loop->ready, sizeof(ReadyFiber) * wrapped);
+        }
+    }
+    int index = (loop->readyStart + loop->readyCount) % loop->readyCapacity;
+    loop->ready[index].fiber = fiber;
+    loop->ready[index].value = value;
+    loop->readyCount++;
+    fiber->waiting = true;
+}
+
+static void swapTimers(EventLoop* loop, int a, int b) {
+    Timer timer = loop->timers[a];
+    loop->timers[a] = loop->timers[b];
+    loop->timers[b] = timer;
+}
+
+void addTimer(EventLoop* loop, ObjFiber* fiber, double milliseconds) {
+    if (loop->timerCapacity < loop->timerCount + 1) {
+        int oldCapacity = loop->timerCapacity;
+        loop->timerCapacity = GROW_CAPACITY(oldCapacity);
+        loop->timers = GROW_ARRAY(Timer, loop->timers, oldCapacity, loop->timerCapacity);
+    }
+    int index = loop->timerCount++;
+    loop->timers[index].deadline = now() + milliseconds;
+    loop->timers[index].fiber = fiber;
+    //up the heap until the parent is due first
+    while (index > 0 && loop->timers[(index - 1) / 2].deadline > loop->timers[index].deadline) {
+        swapTimers(loop, index, (index - 1) / 2);
+        index = (index - 1) / 2;
+    }
+    fiber->waiting = true;
+}
+
+static void removeFirstTimer(EventLoop* loop) {
+    loop->timers[0] = loop->timers[--loop->timerCount];
+    int index = 0;
+    for (;;) {
+        int first = index;
+        int left = index * 2 + 1;
+        int right = left + 1;
+        if (left < loop->timerCount &&
+            loop->timers[left].deadline < loop->timers[first].deadline) first = left;
+        if (right < loop->timerCount &&
+            loop->timers[right].deadline < loop->timers[first].deadline) first = right;
+        if (first == index) return;
+        swapTimers(loop, index, first);
+        index = first;
+    }
+}
+
+/*Readies the fibers whose timers are due, in deadline order*/
+static void expireTimers(EventLoop* loop) {
+    if (loop->timerCount == 0) return;
+    double time = now();
+    while (loop->timerCount > 0 && loop->timers[0].deadline <= time) {
+        ObjFiber* fiber = loop->timers[0].fiber;
+        removeFirstTimer(loop);
+        scheduleFiber(loop, fiber, NIL_VAL);
+    }
+}
+
+/*Writes go through send() so a closed socket fails with EPIPE instead of killing the
+process, pipes and files fall back to write()*/
+static ssize_t writeSome(int fd, const char* bytes, size_t length) {
+    ssize_t count = send(fd, bytes, length, MSG_NOSIGNAL);
+    if (count < 0 && errno == ENOTSOCK) count = write(fd, bytes, length);
+    return count;
+}
+
+static bool wouldBlock() {
+    return errno == EAGAIN || errno == EWOULDBLOCK;
+}
+
+IoStatus tryIo(VM* vm, IoRequest* request, Value* result) {
+    switch (request->operation) {
+        case IO_READ: {
+            char* chars = ALLOCATE(char, request->size + 1);
+            ssize_t count = read(request->fd, chars, request->size);
+            if (count <= 0) {
+                FREE_ARRAY(char, chars, request->size + 1);
+                if (count < 0) return wouldBlock() ? IO_BLOCKED : IO_FAILED;
+                //the end of the input
+                *result = NIL_VAL;
+                return IO_DONE;
+            }
+            chars = GROW_ARRAY(char, chars, request->size + 1, count + 1);
+            chars[count] = '\0';
+            *result = OBJ_VAL(takeString(vm, chars, (int)count));
+            return IO_DONE;
+        }
+
+        case IO_WRITE: {
+            ObjString* data = request->data;
+            //as much as goes without blocking, a later round sends the rest
+            while (request->written < data->length) {
+                ssize_t count = writeSome(request->fd, data->chars + request->written,
+                                          data->length - request->written);
+                if (count < 0) return wouldBlock() ? IO_BLOCKED : IO_FAILED;
+                request->written += (int)count;
+            }
+            *result = NUMBER_VAL(request->written);
+            return IO_DONE;
+        }
+
+        case IO_ACCEPT: {
+            int fd = accept4(request->fd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+            if (fd < 0) return wouldBlock() ? IO_BLOCKED : IO_FAILED;
+            *result = NUMBER_VAL(fd);
+            return IO_DONE;
+        }
+
+        case IO_CONNECT: {
+            //only asked once the socket is writable, the connect went through or failed
+            int error = 0;
+            socklen_t length = sizeof(error);
+            if (getsockopt(request->fd, SOL_SOCKET, SO_ERROR, &error, &length) < 0) {
+                return IO_FAILED;
+            }
+            if (error != 0) {
+                errno = error;
+                return IO_FAILED;
+            }
+            *result = NUMBER_VAL(request->fd);
+            return IO_DONE;
+        }
+    }
+    return IO_FAILED;
+}
+
+bool waitForIo(EventLoop* loop, IoRequest* request) {
+    int fd = request->fd;
+    if (fd < loop->requestCapacity && loop->requests[fd] != NULL) return false;
+    if (loop->epollFd < 0) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd < 0) return false;
+    }
+
+    IoRequest* waiting = ALLOCATE(IoRequest, 1);
+    *waiting = *request;
+    struct epoll_event event;
+    event.events = request->operation == IO_READ || request->operation == IO_ACCEPT ?
+                   EPOLLIN : EPOLLOUT;
+    event.data.ptr = waiting;
+    //regular files can't be watched, but they never block either
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        FREE(IoRequest, waiting);
+        return false;
+    }
+
+    if (fd >= loop->requestCapacity) {
+        int oldCapacity = loop->requestCapacity;
+        loop->requestCapacity = GROW_CAPACITY(oldCapacity);
+        while (loop->requestCapacity <= fd) loop->requestCapacity *= 2;
+        loop->requests = GROW_ARRAY(IoRequest*, loop->requests, oldCapacity,
+                                    loop->requestCapacity);
+        for (int i = oldCapacity; i < loop->requestCapacity; i++) loop->requests[i] = NULL;
+    }
+    loop->requests[fd] = waiting;
+    loop->requestCount++;
+    request->fiber->waiting = true;
+    return true;
+}
+
+bool addWakeFd(EventLoop* loop) {
+    if (loop->epollFd < 0) {
+        loop->epollFd = epoll_create1(EPOLL_CLOEXEC);
+        if (loop->epollFd < 0) return false;
+    }
+    int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fd < 0) return false;
+    struct epoll_event event;
+    event.events = EPOLLIN;
+    //no request, pollEvents() tells it apart by that
+    event.data.ptr = NULL;
+    if (epoll_ctl(loop->epollFd, EPOLL_CTL_ADD, fd, &event) < 0) {
+        close(fd);
+        return false;
+    }
+    loop->wakeFd = fd;
+    return true;
+}
+
+void wakeEventLoop(EventLoop* loop) {
+    uint64_t one = 1;
+    //a full counter already wakes the loop, so a failed write loses nothing
+    ssize_t written = write(loop->wakeFd, &one, sizeof(one));
+    (void)written;
+}
+
+/*Stops watching the descriptor and readies the fiber waiting on it*/
+static void finishIo(EventLoop* loop, IoRequest* request, Value result) {
+    epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, request->fd, NULL);
+    loop->requests[request->fd] = NULL;
+    loop->requestCount--;
+    scheduleFiber(loop, request->fiber, result);
+    FREE(IoRequest, request);
+}
+
+void cancelIo(EventLoop* loop, int fd) {
+    if (fd >= loop->requestCapacity || loop->requests[fd] == NULL) return;
+    finishIo(loop, loop->requests[fd], NIL_VAL);
+}
+
+/*Waits up to timeout milliseconds (forever when it's -1) for descriptors to get ready,
+and goes ahead with the operations that can*/
+static void pollEvents(VM* vm, int timeout) {
+    EventLoop* loop = &vm->loop;
+    if (loop->requestCount == 0 && loop->wakeFd < 0) {
+        //only timers, there's nothing to watch
+        poll(NULL, 0, timeout);
+        return;
+    }
+
+    struct epoll_event events[EVENTS_MAX];
+    int count = epoll_wait(loop->epollFd, events, EVENTS_MAX, timeout);
+    for (int i = 0; i < count; i++) {
+        IoRequest* request = events[i].data.ptr;
+        if (request == NULL) {
+            //another thread woke the loop, the counter goes back to 0 for the next time
+            uint64_t count;
+            ssize_t drained = read(loop->wakeFd, &count, sizeof(count));
+            (void)drained;
+            continue;
+        }
+        Value result = NIL_VAL;
+        IoStatus status = tryIo(vm, request, &result);
+        //a failure wakes the fiber with nil, the same as when the descriptor is closed
+        if (status != IO_BLOCKED) finishIo(loop, request, status == IO_DONE ? result : NIL_VAL);
+    }
+}
+
+bool nextReadyFiber(VM* vm, ReadyFiber* next) {
+    EventLoop* loop = &vm->loop;
+    while (loop->readyCount == 0) {
+        if (loop->worker != NULL) {
+            //a task pool worker starts another task whenever its fibers are all waiting,
+            //it only stops when the pool does
+            if (findWork(vm)) continue;
+            if (workerStopping(loop->worker)) return false;
+        } else if (loop->timerCount == 0 && loop->requestCount == 0) {
+            return false;
+        }
+
+        int timeout = -1;
+        if (loop->timerCount > 0) {
+            double wait = loop->timers[0].deadline - now();
+            //rounded up, waking early would just mean waiting again
+            timeout = wait <= 0 ? 0 : (int)wait + 1;
+        }
+        if (timeout != 0) {
+            double start = now();
+            pollEvents(vm, timeout);
+            if (loop->worker != NULL) workerIdled(loop->worker, now() - start);
+        }
+        expireTimers(loop);
+    }
+
+    *next = loop->ready[loop->readyStart];
+    loop->readyStart = (loop->readyStart + 1) % loop->readyCapacity;
+    loop->readyCount--;
+    next->fiber->waiting = false;
+    return true;
+}
+
+/*A fiber that won't ever be continued, the main one just goes back to being idle*/
+static void dropFiber(VM* vm, ObjFiber* fiber) {
+    fiber->waiting = false;
+    if (fiber == vm->mainFiber || fiber->done) return;
+    //fibers that never started weren't counted
+    if (fiber->frameCount > 0) vm->activeFibers--;
+    fiber->caller = NULL;
+    fiber->done = true;
+}
+
+void clearEventLoop(VM* vm) {
+    EventLoop* loop = &vm->loop;
+    for (int i = 0; i < loop->readyCount; i++) {
+        dropFiber(vm, loop->ready[(loop->readyStart + i) % loop->readyCapacity].fiber);
+    }
+    for (int i = 0; i < loop->timerCount; i++) dropFiber(vm, loop->timers[i].fiber);
+    for (int i = 0; i < loop->requestCapacity && loop->requestCount > 0; i++) {
+        IoRequest* request = loop->requests[i];
+        if (request == NULL) continue;
+        dropFiber(vm, request->fiber);
+        epoll_ctl(loop->epollFd, EPOLL_CTL_DEL, request->fd, NULL);
+        loop->requests[i] = NULL;
+        loop->requestCount--;
+        FREE(IoRequest, request);
+    }
+    loop->readyStart = 0;
+    loop->readyCount = 0;
+    loop->timerCount = 0;
+}
+
+int openFile(const char* path, const char* mode) {
+    int flags;
+    if (strcmp(mode, "r") == 0) {
+        flags = O_RDONLY;
+    } else if (strcmp(mode, "w") == 0) {
+        flags = O_WRONLY | O_CREAT | O_TRUNC;
+    } else if (strcmp(mode, "a") == 0) {
+        flags = O_WRONLY | O_CREAT | O_APPEND;
+    } else {
+        errno = EINVAL;
+        return -1;
+    }
+    return open(path, flags | O_NONBLOCK | O_CLOEXEC, 0644);
+}
+
+bool openPipe(int fds[2]) {
+    return pipe2(fds, O_NONBLOCK | O_CLOEXEC) == 0;
+}
+
+/*Fills in the IPv4 address, only numeric hosts are understood*/
+static bool makeAddress(const char* host, int port, struct sockaddr_in* address) {
+    memset(address, 0, sizeof(*address));
+    address->sin_family = AF_INET;
+    address->sin_port = htons((uint16_t)port);
+    if (port < 0 || port > UINT16_MAX || inet_pton(AF_INET, host, &address->sin_addr) != 1) {
+        errno = EINVAL;
+        return false;
+    }
+    return true;
+}
+
+int listenOn(const char* host, int port) {
+    struct sockaddr_in address;
+    if (!makeAddress(host, port, &address)) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    int reuse = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+    if (bind(fd, (struct sockaddr*)&address, sizeof(address)) < 0 ||
+        listen(fd, SOMAXCONN) < 0) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+int startConnect(const char* host, int port, bool* connected) {
+    struct sockaddr_in address;
+    if (!makeAddress(host, port, &address)) return -1;
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    *connected = connect(fd, (struct sockaddr*)&address, sizeof(address)) == 0;
+    if (!*connected && errno != EINPROGRESS) {
+        int error = errno;
+        close(fd);
+        errno = error;
+        return -1;
+    }
+    return fd;
+}
+
+int socketPort(int fd) {
+    struct sockaddr_in address;
+    socklen_t length = sizeof(address);
+    if (getsockname(fd, (struct sockaddr*)&address, &length) < 0) return -1;
+    return ntohs(address.sin_port);
+}
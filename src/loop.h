@@ -0,0 +1,112 @@
+#ifndef cpandi_loop_h
+#define cpandi_loop_h
+
+#include "object.h"
+
+/*Bytes ioRead() returns at most when the script doesn't say*/
+#define IO_READ_SIZE 65536
+
+/*What a fiber blocked on a file descriptor is waiting to do*/
+typedef enum {
+    IO_READ,
+    IO_WRITE,
+    IO_ACCEPT,
+    IO_CONNECT,
+} IoOperation;
+
+typedef enum {
+    IO_DONE,
+    IO_BLOCKED,
+    IO_FAILED,
+} IoStatus;
+
+/*An operation a fiber waits on until the descriptor is ready for it*/
+typedef struct {
+    ObjFiber* fiber;
+    IoOperation operation;
+    int fd;
+    //reads return at most size bytes, writes send all of data counting what went out
+    int size;
+    ObjString* data;
+    int written;
+} IoRequest;
+
+/*A fiber that can run again and the value it continues with*/
+typedef struct {
+    ObjFiber* fiber;
+    Value value;
+} ReadyFiber;
+
+typedef struct {
+    //milliseconds on the monotonic clock
+    double deadline;
+    ObjFiber* fiber;
+} Timer;
+
+/*Every fiber that waits for I/O, a timer or just its turn, one loop per VM. The epoll
+instance is only made once some descriptor has to be waited on*/
+typedef struct {
+    int epollFd;
+    //a queue in a ring buffer
+    ReadyFiber* ready;
+    int readyStart;
+    int readyCount;
+    int readyCapacity;
+    //a binary heap, the earliest deadline first
+    Timer* timers;
+    int timerCount;
+    int timerCapacity;
+    //indexed by descriptor, only one fiber can wait on a descriptor at a time
+    IoRequest** requests;
+    int requestCapacity;
+    int requestCount;
+    //set when the loop runs a task pool worker, it runs tasks while fibers wait
+    struct Worker* worker;
+    //an eventfd other threads write to end the epoll_wait, -1 when there's none
+    int wakeFd;
+} EventLoop;
+
+void initEventLoop(EventLoop* loop);
+void freeEventLoop(EventLoop* loop);
+
+/*Tries the operation once without blocking. When it's done result is what the native
+returns, IO_FAILED leaves errno set*/
+IoStatus tryIo(VM* vm, IoRequest* request, Value* result);
+
+/*Parks the request's fiber until the operation can go ahead. False if some fiber already
+waits on the descriptor or epoll can't watch it*/
+bool waitForIo(EventLoop* loop, IoRequest* request);
+
+/*Wakes the fiber waiting on the descriptor with nil, for when it gets closed*/
+void cancelIo(EventLoop* loop, int fd);
+
+/*Parks the fiber until the milliseconds have passed, it continues with nil*/
+void addTimer(EventLoop* loop, ObjFiber* fiber, double milliseconds);
+
+/*Gives the loop an eventfd, so other threads can wake it with wakeEventLoop()*/
+bool addWakeFd(EventLoop* loop);
+
+/*Safe to call from any thread*/
+void wakeEventLoop(EventLoop* loop);
+
+/*Queues the fiber to continue with the value once the running one gives way*/
+void scheduleFiber(EventLoop* loop, ObjFiber* fiber, Value value);
+
+/*Takes the next fiber that can run, blocking in epoll or sleeping until a timer is due
+as long as it takes. False when no fiber is waiting at all*/
+bool nextReadyFiber(VM* vm, ReadyFiber* next);
+
+/*After a runtime error every waiting fiber ends, except the main one*/
+void clearEventLoop(VM* vm);
+
+/*The descriptor helpers return -1 with errno set when they fail. Everything they open
+is non blocking*/
+int openFile(const char* path, const char* mode);
+bool openPipe(int fds[2]);
+/*Listens on the IPv4 address, port 0 picks a free port*/
+int listenOn(const char* host, int port);
+/*Starts connecting, connected says whether it already went through*/
+int startConnect(const char* host, int port, bool* connected);
+int socketPort(int fd);
+
+#endif
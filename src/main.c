@@ -1,14 +1,32 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <dirent.h>
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
 
 #include "common.h"
+#include "cache.h"
 #include "chunk.h"
 #include "debug.h"
+#include "loader.h"
+#include "scanner.h"
+#include "scheduler.h"
+#include "types.h"
 #include "vm.h"
 
+#define SCRIPT_EXTENSION ".pandi"
+
+//--type-report prints how much arithmetic the compiler managed to specialize
+static bool typeReportRequested = false;
+//--scan only times the scanner and runs nothing
+static bool scanRequested = false;
+
 /*Declaring the REPL function here to help run the code from the command line*/
-static void repl() {
+static void repl(VM* vm) {
   //Creates a char array of 1024 characters !
   char line[1024];
   
@@ -24,87 +42,278 @@ static void repl() {
     }
 
     //else keep interpreting the line !
-    interpret(line);
+    interpret(vm, line);
   }
 }
 
-/*The read file method opens the file path and reads the entire content of the file*/
-static char* readFile(const char* path) {
-  //The file pointer opens the path with read binary !
-  FILE* file = fopen(path, "rb");
+/*A script's text. A mapped file has no '\0' after it, only the length says where it ends*/
+typedef struct {
+  const char* chars;
+  size_t length;
+  //whether chars is a mapping rather than a heap buffer
+  bool mapped;
+} SourceFile;
 
+/*The open source method maps the file read only, tokens then point straight into the
+mapping and even huge generated scripts are never copied. What can't be mapped (pipes,
+empty files) is read into a buffer instead*/
+static SourceFile openSource(const char* path) {
+  int fd = open(path, O_RDONLY);
   //If you are not able to open the file then exit the program !
-  if (file == NULL) {
+  if (fd == -1) {
     fprintf(stderr, "Could not open the file \"%s\".\n", path);
     exit(74);
   }
 
-  
-  //This sets the file pointer to the end of the file !
-  fseek(file, 0l, SEEK_END);
-  //The ftell function tells -> the size of the file !!
-  size_t fileSize = ftell(file);
-  //rewind the file to the beginning position
-  rewind(file);
-
-  //a char* buffer is created using the malloc with file size + 1
-  char* buffer = (char*) malloc (fileSize + 1);
+  struct stat status;
+  if (fstat(fd, &status) == 0 && S_ISREG(status.st_mode) && status.st_size > 0) {
+    size_t size = (size_t)status.st_size;
+    void* mapped = mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+    if (mapped != MAP_FAILED) {
+      //the scanner goes through it front to back exactly once
+      madvise(mapped, size, MADV_SEQUENTIAL);
+      close(fd);
+      return (SourceFile){(const char*)mapped, size, true};
+    }
+  }
+
+  size_t capacity = 4096;
+  size_t length = 0;
+  char* buffer = (char*) malloc(capacity);
+  ssize_t bytesRead;
+  while (buffer != NULL && (bytesRead = read(fd, buffer + length, capacity - length)) > 0) {
+    length += (size_t)bytesRead;
+    if (length == capacity) buffer = (char*) realloc(buffer, capacity *= 2);
+  }
   //If the malloc fails -> then print the error and exit !
   if (buffer == NULL) {
-    fprintf(stderr, "Not enough memory to read \%s\".\n", path);
+    fprintf(stderr, "Not enough memory to read \"%s\".\n", path);
     exit(74);
   }
-  
-  
-  //The bytesRead -> Read the buffer with the size of the file size
-  size_t bytesRead = fread(buffer, sizeof(char), fileSize, file);
   //If you cant read (read fails) -> then exit :(
-  if (bytesRead < fileSize) {
+  if (bytesRead < 0) {
     fprintf(stderr, "Could not read file \"%s\".\n", path);
     exit(74);
   }
-  
-  
-  buffer[bytesRead] = '\0';
-  //fclose the file !
-  fclose(file);
-  return buffer;
+  close(fd);
+  return (SourceFile){buffer, length, false};
 }
 
-/*The runfile method will read the file contents and interpret the results*/
-static void runFile(const char* path) {
-  //The source of the file, is stored as a char* array !
-  char* source = readFile(path);
-  //The result of the interpret result is stored in a result factor
-  InterpretResult result = interpret(source);
-  //free the source pointer !!
-  free(source);
+static void closeSource(SourceFile* source) {
+  if (source->mapped) {
+    munmap((void*)source->chars, source->length);
+  } else {
+    free((char*)source->chars);
+  }
+}
+
+/*Reads the scripts and compiles them, all at once on a pool of threads. Scripts whose
+cache matches the source are loaded from the cache instead, the others get one written.
+Functions compile lazily out of the sources, so the caller closes them only once the
+scripts are done running*/
+static bool loadScripts(VM* vm, const char** paths, int count, ObjFunction** functions,
+                        SourceFile* sources) {
+  //the scripts without a usable cache, packed to the front
+  const char** pending = (const char**) malloc(sizeof(char*) * count);
+  const char** pendingPaths = (const char**) malloc(sizeof(char*) * count);
+  size_t* pendingLengths = (size_t*) malloc(sizeof(size_t) * count);
+  ObjFunction** compiled = (ObjFunction**) malloc(sizeof(ObjFunction*) * count);
+  int* pendingIndex = (int*) malloc(sizeof(int) * count);
+  int pendingCount = 0;
+
+  for (int i = 0; i < count; i++) {
+    sources[i] = openSource(paths[i]);
+    functions[i] = loadCachedScript(vm, paths[i], sources[i].chars, sources[i].length);
+    if (functions[i] == NULL) {
+      pendingIndex[pendingCount] = i;
+      pendingPaths[pendingCount] = paths[i];
+      pendingLengths[pendingCount] = sources[i].length;
+      pending[pendingCount++] = sources[i].chars;
+    }
+  }
+
+  bool ok = pendingCount == 0 ||
+            compileSources(vm, pendingPaths, pending, pendingLengths, pendingCount,
+                           compiled);
+  for (int p = 0; p < pendingCount; p++) {
+    int i = pendingIndex[p];
+    functions[i] = compiled[p];
+    if (functions[i] != NULL) {
+      writeCachedScript(paths[i], sources[i].chars, sources[i].length, functions[i]);
+    }
+  }
+
+  free(pending);
+  free(pendingPaths);
+  free(pendingLengths);
+  free(compiled);
+  free(pendingIndex);
+  return ok;
+}
+
+/*Runs the scripts one after the other in the order they were given, nothing runs if
+any of them fails to compile*/
+static void runFiles(VM* vm, const char** paths, int count) {
+  ObjFunction** functions = (ObjFunction**) malloc(sizeof(ObjFunction*) * count);
+  SourceFile* sources = (SourceFile*) malloc(sizeof(SourceFile) * count);
+
+  InterpretResult result = loadScripts(vm, paths, count, functions, sources) ?
+                           INTERPRET_OK : INTERPRET_COMPILE_ERROR;
+  for (int i = 0; i < count && result == INTERPRET_OK; i++) {
+    result = interpretFunction(vm, functions[i]);
+  }
+  //tasks nobody joined may still be running and compiling functions out of the sources
+  freeTaskPool(vm);
+  if (typeReportRequested) {
+    //only after the run, function bodies compile on their first call. Whatever was
+    //loaded from a cache and never called isn't counted
+    int specialized, total;
+    typeReport(&specialized, &total);
+    fprintf(stderr, "%d of %d arithmetic sites typed (%.1f%%)\n", specialized, total,
+            total > 0 ? 100.0 * specialized / total : 0.0);
+  }
+  for (int i = 0; i < count; i++) closeSource(&sources[i]);
+  free(functions);
+  free(sources);
 
   //if the result results into a compile error/ runtime error -> Exit 
   if (result == INTERPRET_COMPILE_ERROR) exit(65);
   if (result == INTERPRET_RUNTIME_ERROR) exit(70);
 }
 
+/*Only runs the scanner over the scripts, as many rounds as it takes to get a stable
+time, and prints the lexer's throughput*/
+static void scanFiles(const char** paths, int count) {
+  SourceFile* sources = (SourceFile*) malloc(sizeof(SourceFile) * count);
+  size_t bytes = 0;
+  for (int i = 0; i < count; i++) {
+    sources[i] = openSource(paths[i]);
+    bytes += sources[i].length;
+  }
+
+  struct timespec start, now;
+  clock_gettime(CLOCK_MONOTONIC, &start);
+  double elapsed = 0;
+  long tokens = 0;
+  int rounds = 0;
+  do {
+    for (int i = 0; i < count; i++) {
+      initScanner(sources[i].chars, sources[i].length, 1);
+      while (scanToken().type != TOKEN_EOF) tokens++;
+    }
+    rounds++;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    elapsed = (now.tv_sec - start.tv_sec) + (now.tv_nsec - start.tv_nsec) / 1e9;
+  } while (elapsed < 0.5);
+
+  double megabytes = (double)bytes * rounds / (1024 * 1024);
+  printf("%ld tokens, %.1f MB in %.3fs: %.1f MB/s\n", tokens / rounds, megabytes / rounds,
+         elapsed / rounds, megabytes / elapsed);
+
+  for (int i = 0; i < count; i++) closeSource(&sources[i]);
+  free(sources);
+}
+
+static bool hasSuffix(const char* name, const char* suffix) {
+  size_t length = strlen(name);
+  size_t suffixLength = strlen(suffix);
+  return length >= suffixLength && strcmp(name + length - suffixLength, suffix) == 0;
+}
+
+/*Collects the paths of all scripts under the directory, subdirectories included*/
+static void findScripts(const char* directory, char*** paths, int* count, int* capacity) {
+  DIR* dir = opendir(directory);
+  if (dir == NULL) {
+    fprintf(stderr, "Could not open the directory \"%s\".\n", directory);
+    exit(74);
+  }
+
+  struct dirent* entry;
+  while ((entry = readdir(dir)) != NULL) {
+    if (strcmp(entry->d_name, ".") == 0 || strcmp(entry->d_name, "..") == 0) continue;
 
+    size_t length = strlen(directory) + strlen(entry->d_name) + 2;
+    char* path = (char*) malloc(length);
+    snprintf(path, length, "%s/%s", directory, entry->d_name);
+
+    struct stat status;
+    if (stat(path, &status) == 0 && S_ISDIR(status.st_mode)) {
+      findScripts(path, paths, count, capacity);
+    } else if (hasSuffix(entry->d_name, SCRIPT_EXTENSION)) {
+      if (*count == *capacity) {
+        *capacity = *capacity < 8 ? 8 : *capacity * 2;
+        *paths = (char**) realloc(*paths, sizeof(char*) * *capacity);
+      }
+      (*paths)[(*count)++] = path;
+      continue;
+    }
+    free(path);
+  }
+  closedir(dir);
+}
+
+/*Writes the cache of every script under the directory without running any of them*/
+static void precompileDirectory(VM* vm, const char* directory) {
+  char** paths = NULL;
+  int count = 0;
+  int capacity = 0;
+  findScripts(directory, &paths, &count, &capacity);
+
+  ObjFunction** functions = (ObjFunction**) malloc(sizeof(ObjFunction*) * (count + 1));
+  SourceFile* sources = (SourceFile*) malloc(sizeof(SourceFile) * (count + 1));
+  bool ok = count == 0 || loadScripts(vm, (const char**) paths, count, functions, sources);
+  for (int i = 0; i < count; i++) closeSource(&sources[i]);
+  free(sources);
+
+  for (int i = 0; i < count; i++) free(paths[i]);
+  free(paths);
+  free(functions);
+  if (!ok) exit(65);
+}
+
+static void usage() {
+  fprintf(stderr, "Usage: clox [--optimize] [--type-report] [path...]\n");
+  fprintf(stderr, "       clox --scan path...\n");
+  fprintf(stderr, "       clox --compile directory\n");
+  exit(64);
+}
 
 int main (int argc, const char* argv[]) {
     //Initialize a VM when the program runs
-    initVM();
+    VM vm;
+    initVM(&vm);
+
+    //flags come before the path
+    int arg = 1;
+    for (; arg < argc && strncmp(argv[arg], "--", 2) == 0; arg++) {
+      if (strcmp(argv[arg], "--optimize") == 0) {
+        vm.optimize = true;
+      } else if (strcmp(argv[arg], "--type-report") == 0) {
+        typeReportRequested = true;
+      } else if (strcmp(argv[arg], "--scan") == 0) {
+        scanRequested = true;
+      } else if (strcmp(argv[arg], "--compile") == 0 && arg == argc - 2) {
+        precompileDirectory(&vm, argv[arg + 1]);
+        freeVM(&vm);
+        return 0;
+      } else {
+        usage();
+      }
+    }
 
     //If there is no argument provided to the code then run the REPL
-    if (argc == 1) {
-      repl();
-    } else if (argc == 2) {
-      //If there is one argument then run the code from the file
-      runFile(argv[1]);
+    if (arg == argc) {
+      repl(&vm);
+    } else if (scanRequested) {
+      scanFiles(argv + arg, argc - arg);
     } else {
-      //Else syntax error -> use exit code 64 (incorrect syntax) and exit
-      fprintf(stderr, "Usage: clox [path]\n");
-      exit(64);
+      //else run the code from the files
+      runFiles(&vm, argv + arg, argc - arg);
     }
     
-    //Free the VM when exiting
-    freeVM();
+    //Free the VM when exiting, its objects go to the sweeper thread and the process
+    //exits without waiting for it
+    freeVM(&vm);
 
 
     return 0;
@@ -1,6 +1,8 @@
+#include <pthread.h>
 #include <stdlib.h>
 
 #include "memory.h"
+#include "transfer.h"
 #include "vm.h"
 
 void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
@@ -28,7 +30,28 @@ void* reallocate(void* pointer, size_t oldSize, size_t newSize) {
 static void freeObject(Obj* object) {
     switch (object->type) {
         //Cast the object to the correct type
-        
+        case OBJ_CLOSURE: {
+            ObjClosure* closure = (ObjClosure*)object;
+            reallocate(object, sizeof(ObjClosure) +
+                       sizeof(ObjUpvalue*) * closure->upvalueCount, 0);
+            break;
+        }
+
+        case OBJ_FIBER: {
+            ObjFiber* fiber = (ObjFiber*)object;
+            FREE_ARRAY(CallFrame, fiber->frames, FRAMES_MAX);
+            FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+            FREE(ObjFiber, object);
+            break;
+        }
+
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = (ObjFloat64Array*)object;
+            FREE_ARRAY(double, array->values, array->count);
+            FREE(ObjFloat64Array, object);
+            break;
+        }
+
         case OBJ_FUNCTION: {
             ObjFunction* function = (ObjFunction*) object;
             freeChunk(&function->chunk);
@@ -36,6 +59,13 @@ static void freeObject(Obj* object) {
             break;
         }
 
+        case OBJ_MAP: {
+            ObjMap* map = (ObjMap*)object;
+            freeTable(&map->table);
+            FREE(ObjMap, object);
+            break;
+        }
+
         case OBJ_NATIVE:
             FREE(ObjNative, object);
             break;
@@ -48,11 +78,88 @@ static void freeObject(Obj* object) {
             FREE(ObjString, object);
             break;
         }
+
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)object;
+            FREE_ARRAY(char, builder->chars, builder->capacity);
+            FREE(ObjStringBuilder, object);
+            break;
+        }
+
+        case OBJ_TASK: {
+            ObjTask* task = (ObjTask*)object;
+            freeParcel(&task->argument);
+            freeParcel(&task->packedResult);
+            FREE(ObjTask, object);
+            break;
+        }
+
+        case OBJ_UPVALUE:
+            FREE(ObjUpvalue, object);
+            break;
+    }
+}
+
+/*Object lists nothing points into any more, waiting for the sweeper thread. It's
+started on the first list and lives until the process exits*/
+typedef struct {
+    pthread_mutex_t lock;
+    pthread_cond_t ready;
+    Obj** lists;
+    int count;
+    int capacity;
+    bool started;
+} Sweeper;
+
+static Sweeper sweeper = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,
+                          NULL, 0, 0, false};
+
+static void* runSweeper(void* argument) {
+    (void)argument;
+    pthread_mutex_lock(&sweeper.lock);
+    for (;;) {
+        while (sweeper.count == 0) pthread_cond_wait(&sweeper.ready, &sweeper.lock);
+        Obj* objects = sweeper.lists[--sweeper.count];
+        //the lists are freed without the lock, so handing over another never waits
+        pthread_mutex_unlock(&sweeper.lock);
+        freeObjectList(objects);
+        pthread_mutex_lock(&sweeper.lock);
     }
+    return NULL;
+}
+
+void sweepObjects(Obj* objects) {
+    if (objects == NULL) return;
+    pthread_mutex_lock(&sweeper.lock);
+    if (!sweeper.started) {
+        pthread_t thread;
+        sweeper.started = pthread_create(&thread, NULL, runSweeper, NULL) == 0;
+        if (sweeper.started) pthread_detach(thread);
+    }
+    if (!sweeper.started) {
+        //without a thread the caller frees them itself
+        pthread_mutex_unlock(&sweeper.lock);
+        freeObjectList(objects);
+        return;
+    }
+
+    if (sweeper.capacity < sweeper.count + 1) {
+        int oldCapacity = sweeper.capacity;
+        sweeper.capacity = GROW_CAPACITY(oldCapacity);
+        sweeper.lists = GROW_ARRAY(Obj*, sweeper.lists, oldCapacity, sweeper.capacity);
+    }
+    sweeper.lists[sweeper.count++] = objects;
+    pthread_cond_signal(&sweeper.ready);
+    pthread_mutex_unlock(&sweeper.lock);
+}
+
+void freeObjects(VM* vm) {
+    sweepObjects(vm->objects);
+    vm->objects = NULL;
 }
 
-void freeObjects() {
-    Obj* object = vm.objects;
+void freeObjectList(Obj* objects) {
+    Obj* object = objects;
     while (object != NULL) {
         Obj* next = object->next;
         freeObject(object);
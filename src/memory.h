@@ -27,7 +27,16 @@
 /*The re allocate function helps resize the array*/
 void* reallocate(void* pointer, size_t oldSize, size_t newSize);
 
-/*The free objects method helps clear memory on heap allocated for the objects*/
-void freeObjects();
+/*The free objects method helps clear memory on heap allocated for the objects. They
+go to the sweeper, the VM doesn't wait for them to be freed*/
+void freeObjects(VM* vm);
+
+/*Hands a list of objects nothing points to any more to a background thread that frees
+them, so dropping a big heap costs the caller nothing. The process doesn't wait for the
+sweeper when it exits*/
+void sweepObjects(Obj* objects);
+
+/*Frees every object in a list linked through next*/
+void freeObjectList(Obj* objects);
 
 #endif
\ No newline at end of file
@@ -1,3 +1,4 @@
+#include <limits.h>
 #include <stdio.h>
 #include <string.h>
 
@@ -5,52 +6,145 @@
 #include "object.h"
 #include "value.h"
 #include "table.h"
+#include "transfer.h"
 #include "vm.h"
 
 /*This macro helps create an object pointer and returns the same*/
-#define ALLOCATE_OBJ(type, objectType) \
-    (type*)allocateObject(sizeof(type), objectType)
+#define ALLOCATE_OBJ(vm, type, objectType) \
+    (type*)allocateObject(vm, sizeof(type), objectType)
 
 /*This method creates a dynamically reallocated Object pointer and 
 stores the type and returns the same*/
 //It uses downcasting principles as the size of the object is passed as an argument, so even though
 // an Obj* is created but it can be downcasted to one of the base types of the relevant size
-static Obj* allocateObject(size_t size, ObjType type) {
+//NULL on the main thread, a worker thread compiling a script points it at its own arena
+static THREAD_LOCAL ObjectArena* arena = NULL;
+
+static Obj* allocateObject(VM* vm, size_t size, ObjType type) {
     Obj* object = (Obj*)reallocate(NULL, 0, size);
     object->type = type;
     
     //The next pointer stores the reference of the previous head
-    object->next = vm.objects;
+    Obj** objects = arena != NULL ? &arena->objects : &vm->objects;
+    object->next = *objects;
     //The new head is then updated to the current object
-    vm.objects = object;
+    *objects = object;
 
     return object;
 }
 
-ObjFunction* newFunction() {
+ObjClosure* newClosure(VM* vm, ObjFunction* function) {
+    ObjClosure* closure = (ObjClosure*)allocateObject(vm,
+        sizeof(ObjClosure) + sizeof(ObjUpvalue*) * function->upvalueCount, OBJ_CLOSURE);
+    closure->function = function;
+    closure->upvalueCount = function->upvalueCount;
+    for (int i = 0; i < function->upvalueCount; i++) {
+        closure->upvalues[i] = NULL;
+    }
+    return closure;
+}
+
+ObjFiber* newFiber(VM* vm, Value function) {
+    ObjFiber* fiber = ALLOCATE_OBJ(vm, ObjFiber, OBJ_FIBER);
+    fiber->function = function;
+    fiber->frames = ALLOCATE(CallFrame, FRAMES_MAX);
+    fiber->frameCount = 0;
+    fiber->stack = ALLOCATE(Value, FRAME_SLOTS);
+    fiber->stackTop = fiber->stack;
+    fiber->stackCapacity = FRAME_SLOTS;
+    fiber->openUpvalues = NULL;
+    fiber->caller = NULL;
+    fiber->done = false;
+    fiber->waiting = false;
+    fiber->task = NULL;
+    return fiber;
+}
+
+ObjTask* newTask(VM* vm, Value function, ObjString* name) {
+    ObjTask* task = ALLOCATE_OBJ(vm, ObjTask, OBJ_TASK);
+    task->vm = vm;
+    task->function = function;
+    task->name = name;
+    initParcel(&task->argument);
+    task->result = NIL_VAL;
+    initParcel(&task->packedResult);
+    task->resultPacked = false;
+    atomic_init(&task->state, TASK_PENDING);
+    task->joiner = NULL;
+    task->joined = false;
+    return task;
+}
+
+ObjFunction* newFunction(VM* vm) {
     //allocate space for a new object
-    ObjFunction* function = ALLOCATE_OBJ(ObjFunction, OBJ_FUNCTION);
+    ObjFunction* function = ALLOCATE_OBJ(vm, ObjFunction, OBJ_FUNCTION);
     //set everything else to 0
     function->arity = 0;
+    function->upvalueCount = 0;
     function->name = NULL;
+    function->callCount = 0;
+    function->isOptimized = false;
+    function->lazySource = NULL;
+    function->lazyLength = 0;
+    function->lazyLine = 0;
+    function->lazyPath = NULL;
     initChunk(&function->chunk);
     return function;
 }
 
-ObjNative* newNative(NativeFn function) {
-    ObjNative* native = ALLOCATE_OBJ(ObjNative, OBJ_NATIVE);
+ObjUpvalue* newUpvalue(VM* vm, Value* slot) {
+    ObjUpvalue* upvalue = ALLOCATE_OBJ(vm, ObjUpvalue, OBJ_UPVALUE);
+    upvalue->location = slot;
+    upvalue->closed = NIL_VAL;
+    upvalue->next = NULL;
+    return upvalue;
+}
+
+ObjFloat64Array* newFloat64Array(VM* vm, int count) {
+    ObjFloat64Array* array = ALLOCATE_OBJ(vm, ObjFloat64Array, OBJ_FLOAT64_ARRAY);
+    array->count = count;
+    array->values = NULL;
+    if (count > 0) {
+        array->values = ALLOCATE(double, count);
+        memset(array->values, 0, sizeof(double) * count);
+    }
+    return array;
+}
+
+ObjMap* newMap(VM* vm) {
+    ObjMap* map = ALLOCATE_OBJ(vm, ObjMap, OBJ_MAP);
+    map->count = 0;
+    initTable(&map->table);
+    return map;
+}
+
+//the table counts its tombstones too, the map only counts live keys
+bool mapSet(ObjMap* map, Value key, Value value) {
+    bool isNewKey = tableSet(&map->table, key, value);
+    if (isNewKey) map->count++;
+    return isNewKey;
+}
+
+bool mapDelete(ObjMap* map, Value key) {
+    bool deleted = tableDelete(&map->table, key);
+    if (deleted) map->count--;
+    return deleted;
+}
+
+ObjNative* newNative(VM* vm, NativeFn function) {
+    ObjNative* native = ALLOCATE_OBJ(vm, ObjNative, OBJ_NATIVE);
     native->function = function;
     return native;
 }
 
 /*The allocate string function first creates an Obj pointer, then it stores the length,
 chars and returns the ObjString* */
-static ObjString* allocateString(char* chars, int length, uint32_t hash) {
-    ObjString* string = ALLOCATE_OBJ(ObjString, OBJ_STRING);
+static ObjString* allocateString(VM* vm, char* chars, int length, uint32_t hash) {
+    ObjString* string = ALLOCATE_OBJ(vm, ObjString, OBJ_STRING);
     string->length = length;
     string->chars = chars;
     string->hash = hash;
-    tableSet(&vm.strings, string, NIL_VAL);
+    tableSet(arena != NULL ? &arena->strings : &vm->strings, OBJ_VAL(string), NIL_VAL);
     return string;
 }
 
@@ -65,23 +159,45 @@ static uint32_t hashString(const char* key, int length) {
 }
 
 
-ObjString* takeString(char* chars, int length) {
+/*A shared program's strings never change, so any thread can look them up. They come
+first so every VM running the program agrees on them*/
+static ObjString* findVMString(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* interned = NULL;
+    if (vm->program != NULL) {
+        interned = tableFindString(&vm->program->heap.strings, chars, length, hash);
+    }
+    if (interned == NULL) interned = tableFindString(&vm->strings, chars, length, hash);
+    return interned;
+}
+
+/*The VM's strings only change on the thread running it, and that thread waits while
+workers compile for it, so workers can look them up too. Compiling a program has no VM,
+only the arena*/
+static ObjString* findInterned(VM* vm, const char* chars, int length, uint32_t hash) {
+    ObjString* interned = vm != NULL ? findVMString(vm, chars, length, hash) : NULL;
+    if (interned == NULL && arena != NULL) {
+        interned = tableFindString(&arena->strings, chars, length, hash);
+    }
+    return interned;
+}
+
+ObjString* takeString(VM* vm, char* chars, int length) {
   uint32_t hash = hashString(chars, length);
 
-  ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+  ObjString* interned = findInterned(vm, chars, length, hash);
 
   if (interned != NULL) {
     FREE_ARRAY(char, chars, length+1);
     return interned;
   }
 
-  return allocateString(chars, length, hash);
+  return allocateString(vm, chars, length, hash);
 }
 
-ObjString* copyString(const char* chars, int length) {
+ObjString* copyString(VM* vm, const char* chars, int length) {
     uint32_t hash = hashString(chars, length);
     
-    ObjString* interned = tableFindString(&vm.strings, chars, length, hash);
+    ObjString* interned = findInterned(vm, chars, length, hash);
     if (interned != NULL) return interned;
     
     //Create a char array to help allocate the char with a size of length + 1 (To accomodate the \0)
@@ -90,7 +206,96 @@ ObjString* copyString(const char* chars, int length) {
     memcpy(heapChars, chars, length);
     //last element is the null termination
     heapChars[length] = '\0';
-    return allocateString(heapChars, length, hash);
+    return allocateString(vm, heapChars, length, hash);
+}
+
+void initObjectArena(ObjectArena* objects) {
+    objects->objects = NULL;
+    initTable(&objects->strings);
+}
+
+void useObjectArena(ObjectArena* objects) {
+    arena = objects;
+}
+
+static Value canonicalString(Table* replaced, Value value) {
+    Value interned;
+    if (IS_STRING(value) && tableGet(replaced, value, &interned)) return interned;
+    return value;
+}
+
+void mergeObjectArena(VM* vm, ObjectArena* objects) {
+    //a string some earlier script interned first wins, the arena's copy is just garbage then
+    Table replaced;
+    initTable(&replaced);
+    Table* strings = &objects->strings;
+    for (int i = tableNext(strings, -1); i != -1; i = tableNext(strings, i)) {
+        ObjString* string = AS_STRING(strings->entries[i].key);
+        ObjString* interned = findVMString(vm, string->chars, string->length, string->hash);
+        if (interned != NULL) {
+            tableSet(&replaced, OBJ_VAL(string), OBJ_VAL(interned));
+        } else {
+            tableSet(&vm->strings, OBJ_VAL(string), NIL_VAL);
+        }
+    }
+
+    Obj* object = objects->objects;
+    while (object != NULL) {
+        Obj* next = object->next;
+        //compiling only makes functions and strings, and strings are only referenced
+        //from function names and constants
+        if (replaced.count > 0 && object->type == OBJ_FUNCTION) {
+            ObjFunction* function = (ObjFunction*)object;
+            if (function->name != NULL) {
+                function->name = AS_STRING(canonicalString(&replaced, OBJ_VAL(function->name)));
+            }
+            ValueArray* constants = &function->chunk.constants;
+            for (int c = 0; c < constants->count; c++) {
+                constants->values[c] = canonicalString(&replaced, constants->values[c]);
+            }
+        }
+        object->next = vm->objects;
+        vm->objects = object;
+        object = next;
+    }
+
+    freeTable(&replaced);
+    freeTable(strings);
+    initObjectArena(objects);
+}
+
+ObjStringBuilder* newStringBuilder(VM* vm, int capacity) {
+    ObjStringBuilder* builder = ALLOCATE_OBJ(vm, ObjStringBuilder, OBJ_STRING_BUILDER);
+    builder->length = 0;
+    builder->capacity = 0;
+    builder->chars = NULL;
+    if (capacity > 0) {
+        builder->chars = ALLOCATE(char, capacity);
+        builder->capacity = capacity;
+    }
+    return builder;
+}
+
+bool appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length) {
+    //the length is an int, so that's as much text as a builder holds
+    size_t needed = (size_t)builder->length + length;
+    if (needed > INT_MAX) return false;
+    if ((size_t)builder->capacity < needed) {
+        //the chars can be the builder's own (sbAppend(sb, sb)), which growing moves
+        bool own = builder->chars != NULL && chars >= builder->chars &&
+                   chars < builder->chars + builder->length;
+        size_t offset = own ? (size_t)(chars - builder->chars) : 0;
+        int oldCapacity = builder->capacity;
+        size_t capacity = GROW_CAPACITY(oldCapacity);
+        while (capacity < needed) capacity *= 2;
+        if (capacity > INT_MAX) capacity = INT_MAX;
+        builder->chars = GROW_ARRAY(char, builder->chars, oldCapacity, capacity);
+        builder->capacity = (int)capacity;
+        if (own) chars = builder->chars + offset;
+    }
+    memcpy(builder->chars + builder->length, chars, length);
+    builder->length += length;
+    return true;
 }
 
 static void printFunction(ObjFunction* function) {
@@ -102,16 +307,59 @@ static void printFunction(ObjFunction* function) {
     printf("<fn %s>", function->name->chars);
 }
 
+static void printMap(ObjMap* map) {
+    printf("{");
+    bool first = true;
+    for (int i = tableNext(&map->table, -1); i != -1; i = tableNext(&map->table, i)) {
+        if (!first) printf(", ");
+        first = false;
+        printValue(map->table.entries[i].key);
+        printf(": ");
+        printValue(map->table.entries[i].value);
+    }
+    printf("}");
+}
+
+static void printFloat64Array(ObjFloat64Array* array) {
+    printf("[");
+    for (int i = 0; i < array->count; i++) {
+        if (i > 0) printf(", ");
+        printf("%g", array->values[i]);
+    }
+    printf("]");
+}
+
 void printObject(Value value) {
     switch (OBJ_TYPE(value)) {
+        case OBJ_CLOSURE:
+            printFunction(AS_CLOSURE(value)->function);
+            break;
+        case OBJ_FIBER:
+            printf("<fiber>");
+            break;
+        case OBJ_FLOAT64_ARRAY:
+            printFloat64Array(AS_FLOAT64_ARRAY(value));
+            break;
+        case OBJ_TASK:
+            printf("<task>");
+            break;
         case OBJ_FUNCTION:
             printFunction(AS_FUNCTION(value));
             break;
+        case OBJ_MAP:
+            printMap(AS_MAP(value));
+            break;
         case OBJ_STRING:
             printf("%s", AS_CSTRING(value));
             break;
         case OBJ_NATIVE:
             printf("<native fn>");
             break;
+        case OBJ_STRING_BUILDER:
+            printf("<string builder>");
+            break;
+        case OBJ_UPVALUE:
+            printf("upvalue");
+            break;
     }
 }
\ No newline at end of file
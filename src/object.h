@@ -1,24 +1,46 @@
 #ifndef cpandi_object_h
 #define cpandi_object_h
 
+#include <stdatomic.h>
+
 #include "common.h"
 #include "value.h"
 #include "chunk.h"
+#include "table.h"
+
+//every object belongs to the VM it was allocated for
+typedef struct VM VM;
 
 /*These macro fetches the type identifier*/
 #define OBJ_TYPE(value)     (AS_OBJ(value)->type)
 
+#define IS_CLOSURE(value)   isObjType(value, OBJ_CLOSURE)
+
 #define IS_FUNCTION(value)  isObjType(value, OBJ_FUNCTION)
 
+#define IS_FIBER(value)     isObjType(value, OBJ_FIBER)
+
 #define IS_NATIVE(value)       isObjType(value, OBJ_NATIVE)
 
+#define IS_MAP(value)       isObjType(value, OBJ_MAP)
+
+#define IS_FLOAT64_ARRAY(value) isObjType(value, OBJ_FLOAT64_ARRAY)
+
+#define IS_TASK(value)      isObjType(value, OBJ_TASK)
+
 /*These macros check if the given the values are of the requisite type*/
 #define IS_STRING(value)    isObjType(value, OBJ_STRING)
 
+#define IS_STRING_BUILDER(value) isObjType(value, OBJ_STRING_BUILDER)
+
 /*These macros help in downcasting the Obj Value to a ObjString* */
 #define AS_STRING(value)    ((ObjString*) AS_OBJ(value))
 #define AS_CSTRING(value)   (((ObjString*) AS_OBJ(value)) -> chars)
 
+#define AS_STRING_BUILDER(value) ((ObjStringBuilder*)AS_OBJ(value))
+
+
+#define AS_CLOSURE(value)   ((ObjClosure*)AS_OBJ(value))
 
 /*These macros help in downcasting the Obj pointers to a Function object*/
 #define AS_FUNCTION(value)  ((ObjFunction*)AS_OBJ(value))
@@ -26,11 +48,26 @@
 #define AS_NATIVE(value) \
     (((ObjNative*)AS_OBJ(value))->function)
 
+#define AS_MAP(value)       ((ObjMap*)AS_OBJ(value))
+
+#define AS_FIBER(value)     ((ObjFiber*)AS_OBJ(value))
+
+#define AS_FLOAT64_ARRAY(value) ((ObjFloat64Array*)AS_OBJ(value))
+
+#define AS_TASK(value)      ((ObjTask*)AS_OBJ(value))
+
 /*These are the identifiers type which help identify the Object*/
 typedef enum {
+    OBJ_CLOSURE,
+    OBJ_FIBER,
+    OBJ_FLOAT64_ARRAY,
     OBJ_FUNCTION,
+    OBJ_MAP,
     OBJ_NATIVE,
     OBJ_STRING,
+    OBJ_STRING_BUILDER,
+    OBJ_TASK,
+    OBJ_UPVALUE,
 } ObjType;
 
 struct Obj {
@@ -45,17 +82,102 @@ struct Obj {
 typedef struct {
     Obj obj;
     int arity;
+    //number of variables captured from enclosing functions, 0 means the function
+    //is used directly without a closure
+    int upvalueCount;
     Chunk chunk;
     ObjString* name;
+    //calls so far, the optimizing tier picks the function up once it gets hot
+    int callCount;
+    bool isOptimized;
+    //until a lazily compiled function is first called, this is its source (from the
+    //'(' of its parameters to the closing '}') and the chunk is empty
+    const char* lazySource;
+    int lazyLength;
+    int lazyLine;
+    //the script's path for error messages, NULL if it didn't come from a file
+    const char* lazyPath;
 } ObjFunction;
 
-typedef Value (*NativeFn)(int argCount, Value* args);
+/*A captured variable. While the variable is still on the stack location points
+into the stack, once it goes out of scope the value moves into closed*/
+typedef struct ObjUpvalue {
+    Obj obj;
+    Value* location;
+    Value closed;
+    //open upvalues form a list sorted by stack slot, top most first
+    struct ObjUpvalue* next;
+} ObjUpvalue;
+
+/*A function together with its captured variables. The upvalue pointers live inline
+after the header so a closure is a single flat allocation*/
+typedef struct {
+    Obj obj;
+    ObjFunction* function;
+    int upvalueCount;
+    ObjUpvalue* upvalues[];
+} ObjClosure;
+
+/*Data structure to keep track of the Call frame*/
+typedef struct {
+    ObjFunction* function;
+    //the closure being run, NULL when the function captures nothing
+    ObjClosure* closure;
+    //the caller stores the return address so that the function can jump here once
+    //the callee finishes its execution
+    uint8_t* ip;
+    //The first slot in the stack that we had reserved -> is used by the function
+    Value* slots;
+} CallFrame;
+
+/*A coroutine with its own value stack and call frames. The VM runs one fiber at a time
+and keeps the running one's stack and frames in its own fields, so switching fibers is
+only saving those and loading another fiber's*/
+typedef struct ObjFiber {
+    Obj obj;
+    //called with the value of the first resume
+    Value function;
+    CallFrame* frames;
+    int frameCount;
+    Value* stack;
+    Value* stackTop;
+    int stackCapacity;
+    ObjUpvalue* openUpvalues;
+    //the fiber that resumed this one, where yields and the final return go. Only the
+    //fibers waiting on the running one (and the running one) have one
+    struct ObjFiber* caller;
+    bool done;
+    //parked in the event loop until I/O, a timer or its turn lets it go on
+    bool waiting;
+    //the task it runs on a task pool worker, whose result its return hands on
+    struct ObjTask* task;
+} ObjFiber;
+
+/*Natives get their arguments in args[0..argCount-1] and store their result in args[-1]
+(the callee's slot). Returning false means the native raised a runtime error*/
+typedef bool (*NativeFn)(VM* vm, int argCount, Value* args);
 
 typedef struct {
     Obj obj;
     NativeFn function;
 } ObjNative;
 
+/*A script visible hash map, the buckets are a regular Table keyed by numbers, bools or strings*/
+typedef struct {
+    Obj obj;
+    //number of live keys (the table's own count also includes tombstones)
+    int count;
+    Table table;
+} ObjMap;
+
+/*A fixed length array of raw doubles stored contiguously (no boxing), so the bulk
+natives can run vector kernels straight over the values*/
+typedef struct {
+    Obj obj;
+    int count;
+    double* values;
+} ObjFloat64Array;
+
 struct ObjString {
     //The obj pointer stores the type !
     Obj obj;
@@ -64,16 +186,107 @@ struct ObjString {
     uint32_t hash;
 };
 
+/*A mutable text buffer that grows geometrically, nothing gets hashed or interned
+until the final string is produced*/
+typedef struct {
+    Obj obj;
+    int length;
+    int capacity;
+    char* chars;
+} ObjStringBuilder;
+
+/*Objects and interned strings created by a compile on a worker thread. They stay out
+of the VM until mergeObjectArena moves them in on the thread running it*/
+typedef struct {
+    Obj* objects;
+    Table strings;
+} ObjectArena;
+
+/*A value deep copied out of its VM into an arena of its own. Nothing in it changes, so
+any thread can copy it into another VM (see transfer.h)*/
+typedef struct {
+    Value value;
+    ObjectArena heap;
+} Parcel;
+
+/*Where a task is, the worker that runs it and the fiber joining it only meet here*/
+typedef enum {
+    TASK_PENDING,
+    TASK_WAITING,
+    TASK_DONE,
+} TaskState;
+
+/*A call of a top level function that a task pool worker runs (see scheduler.h). It
+belongs to the VM that spawned it, whichever worker runs it only touches the parcels
+and the state*/
+typedef struct ObjTask {
+    Obj obj;
+    VM* vm;
+    Value function;
+    //a worker with another VM looks the function up under its name in its own globals
+    ObjString* name;
+    //always a copy, whether the task runs in the spawning VM or another one
+    Parcel argument;
+    //the result goes into result when the spawning VM ran the task, else it's packed
+    Value result;
+    Parcel packedResult;
+    bool resultPacked;
+    atomic_int state;
+    //the fiber parked in taskJoin(), a VM that isn't a worker blocks its thread instead
+    ObjFiber* joiner;
+    bool joined;
+} ObjTask;
+
+void initObjectArena(ObjectArena* arena);
+
+/*New objects made on the calling thread go into the arena, NULL sends them to the VM again*/
+void useObjectArena(ObjectArena* arena);
+
+/*Moves the arena's objects into the VM. Strings the VM already interned replace the
+arena's copies in every function's constants, so interned strings stay unique*/
+void mergeObjectArena(VM* vm, ObjectArena* arena);
+
+/*This method creates a closure with room for all of the function's upvalues*/
+ObjClosure* newClosure(VM* vm, ObjFunction* function);
+
+/*This method creates a fiber that hasn't started running function yet*/
+ObjFiber* newFiber(VM* vm, Value function);
+
 /*This method initiallizes a new function object*/
-ObjFunction* newFunction();
+ObjFunction* newFunction(VM* vm);
+
+/*This method creates an open upvalue pointing at the stack slot*/
+ObjUpvalue* newUpvalue(VM* vm, Value* slot);
+
+/*This method creates a zero filled array of count doubles*/
+ObjFloat64Array* newFloat64Array(VM* vm, int count);
+
+/*This method creates a task that hasn't been handed to a worker yet*/
+ObjTask* newTask(VM* vm, Value function, ObjString* name);
+
+/*This method creates an empty map*/
+ObjMap* newMap(VM* vm);
+
+/*Sets the key of the map, counting it when it's new. Returns true if it was*/
+bool mapSet(ObjMap* map, Value key, Value value);
+
+/*Deletes the key from the map, returns true if the map had it*/
+bool mapDelete(ObjMap* map, Value key);
 
 /*This method is a constructor for the native functions*/
-ObjNative* newNative(NativeFn function);
+ObjNative* newNative(VM* vm, NativeFn function);
+
+ObjString* takeString(VM* vm, char* chars, int length);
+
+/*This method creates an empty builder with room for capacity characters*/
+ObjStringBuilder* newStringBuilder(VM* vm, int capacity);
 
-ObjString* takeString(char* chars, int length);
+/*Appends length characters to the builder, growing the buffer geometrically. False,
+with nothing appended, if the text would get longer than INT_MAX characters*/
+bool appendStringBuilder(ObjStringBuilder* builder, const char* chars, int length);
 
 /*This method helps the compiler emit the string bytecode !*/
-ObjString* copyString(const char* chars, int length);
+ObjString* copyString(VM* vm, const char* chars, int length);
 
 /*This method helps print the strings in debugging mode*/
 void printObject(Value value);
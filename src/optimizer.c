@@ -0,0 +1,1506 @@
+#include <stdio.h>
+#include <stdlib.h>
+
+#include "debug.h"
+#include "memory.h"
+#include "optimizer.h"
+#include "peephole.h"
+#include "vm.h"
+
+/*Hoisted and shared values are kept in extra local slots reserved at the start of the
+frame (right after the parameters), this caps how many a function gets*/
+#define MAX_REGISTERS 32
+
+/*Inlining budget: callee size in instructions, and call sites per function*/
+#define INLINE_MAX_INSTRUCTIONS 24
+#define INLINE_MAX_SITES 8
+
+/*The IR doesn't copy the bytecode, it annotates it. Every stack slot and every global the
+function touches is a variable, and each instruction reads and writes those variables.
+Reading a variable gives an SSA value, so two reads of the same local with no store
+in between give the same value, and a global read whose state didn't change since
+the last read gives the same value too*/
+typedef enum {
+    SSA_ENTRY,    // a parameter, or a global as it was when the function was entered
+    SSA_PHI,
+    SSA_OP,       // a value pushed by an instruction
+    SSA_COPY,     // a value written into a local by OP_SET_LOCAL
+    SSA_STORE,    // a global after OP_SET_GLOBAL or OP_DEFINE_GLOBAL wrote into it
+    SSA_CLOBBER,  // a global after a call, which could have done anything to it
+} SsaKind;
+
+typedef struct {
+    SsaKind kind;
+    int block;
+    //the instruction that created the value, -1 for phis and entries
+    int instruction;
+    //the value copied or stored, or the global state an OP_GET_GLOBAL read
+    int operand;
+    int* phiOperands;
+    int phiCount;
+    int phiCapacity;
+    //a phi that only merges one value is replaced by that value
+    int replacement;
+    //the first value known to be equal to this one (itself if there's none)
+    int leader;
+    //register holding the value for later uses, and the loop it was hoisted out of
+    int reg;
+    int hoistedTo;
+    bool live;
+} SsaValue;
+
+typedef struct {
+    //instructions [start, end)
+    int start;
+    int end;
+    int entryHeight;
+    int successors[2];
+    int successorCount;
+    int* predecessors;
+    int predecessorCount;
+    int predecessorCapacity;
+    //position in reverse postorder
+    int order;
+    int idom;
+    bool filled;
+    bool sealed;
+    //the current SSA value of every variable, and phis still waiting for their operands
+    int* defs;
+    int* incomplete;
+} Block;
+
+typedef struct {
+    int header;
+    bool* body;
+    int size;
+} Loop;
+
+typedef struct {
+    //inlining looks callees up in the VM's globals
+    VM* vm;
+    ObjFunction* function;
+    InstructionList list;
+
+    //block 0 is an empty entry block in front of the code, so a loop that starts at the
+    //first instruction still has a predecessor outside of it
+    Block* blocks;
+    int blockCount;
+    int* blockOf;
+    int* order;
+    int orderCount;
+    int* headerLoop;
+    //stack height in front of every instruction
+    int* heightAt;
+
+    //the stack slots come first, then one variable per global
+    int slotCount;
+    int variableCount;
+    int* globals;
+    int globalCount;
+
+    SsaValue* values;
+    int valueCount;
+    int valueCapacity;
+
+    //per instruction: the values it pops (bottom first) and the value it creates
+    int* inputStart;
+    int* inputCount;
+    int* inputs;
+    int inputTotal;
+    int inputCapacity;
+    int* created;
+
+    Loop* loops;
+    int loopCount;
+    int loopCapacity;
+
+    //per instruction: dropped, replaced by a register read, or followed by a register write
+    bool* deleted;
+    int* replaceWith;
+    int* storeTo;
+    int registerCount;
+
+    int inlined;
+    int hoisted;
+    int shared;
+    int removed;
+} Optimizer;
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_GUARD_CALLEE;
+}
+
+static bool isGlobalLoad(uint8_t op) {
+    return op == OP_GET_GLOBAL || op == OP_GET_GLOBAL_LONG;
+}
+
+/*Instructions whose result only depends on their operands (and, for global loads, on
+the state of the global). They may still fail, but then the first one fails too*/
+static bool isPure(uint8_t op) {
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_NEGATE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+            return true;
+        default:
+            return false;
+    }
+}
+
+/*How many values the instruction pops and pushes. Instructions that only peek at the
+top (OP_SET_LOCAL, OP_JUMP_IF_FALSE...) count as popping it and pushing it back.
+Returns false for instructions the tier doesn't handle*/
+static bool stackEffect(Instruction* instruction, int* pops, int* pushes) {
+    *pops = 0;
+    *pushes = 0;
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+            *pushes = 1;
+            return true;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_RETURN:
+            *pops = 1;
+            return true;
+
+        case OP_POPN:
+            *pops = instruction->operand;
+            return true;
+
+        case OP_SET_LOCAL:
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_JUMP_IF_FALSE:
+        case OP_NOT:
+        case OP_NEGATE:
+        case OP_NEGATE_NUMBER:
+            *pops = 1;
+            *pushes = 1;
+            return true;
+
+        case OP_JUMP:
+        case OP_GUARD_CALLEE:
+            return true;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_GET_INDEX:
+            *pops = 2;
+            *pushes = 1;
+            return true;
+
+        case OP_SET_INDEX:
+            *pops = 3;
+            *pushes = 1;
+            return true;
+
+        case OP_BUILD_MAP:
+            *pops = instruction->operand * 2;
+            *pushes = 1;
+            return true;
+
+        case OP_CALL:
+            *pops = instruction->operand + 1;
+            *pushes = 1;
+            return true;
+
+        //closures capture stack slots, which would pin every local in place
+        default:
+            return false;
+    }
+}
+
+/*Takes over the instruction list*/
+static void initOptimizer(Optimizer* opt, VM* vm, ObjFunction* function,
+                          InstructionList list) {
+    opt->vm = vm;
+    opt->function = function;
+    opt->list = list;
+    int count = list.count;
+
+    opt->blocks = NULL;
+    opt->blockCount = 0;
+    opt->blockOf = ALLOCATE(int, count);
+    opt->order = NULL;
+    opt->orderCount = 0;
+    opt->headerLoop = NULL;
+    opt->heightAt = ALLOCATE(int, count);
+    opt->slotCount = 0;
+    opt->variableCount = 0;
+    opt->globals = ALLOCATE(int, count);
+    opt->globalCount = 0;
+    opt->values = NULL;
+    opt->valueCount = 0;
+    opt->valueCapacity = 0;
+    opt->inputStart = ALLOCATE(int, count);
+    opt->inputCount = ALLOCATE(int, count);
+    opt->inputs = NULL;
+    opt->inputTotal = 0;
+    opt->inputCapacity = 0;
+    opt->created = ALLOCATE(int, count);
+    opt->loops = NULL;
+    opt->loopCount = 0;
+    opt->loopCapacity = 0;
+    opt->deleted = ALLOCATE(bool, count);
+    opt->replaceWith = ALLOCATE(int, count);
+    opt->storeTo = ALLOCATE(int, count);
+    opt->registerCount = 0;
+    opt->inlined = 0;
+    opt->hoisted = 0;
+    opt->shared = 0;
+    opt->removed = 0;
+
+    for (int i = 0; i < count; i++) {
+        opt->inputStart[i] = 0;
+        opt->inputCount[i] = 0;
+        opt->created[i] = -1;
+        opt->deleted[i] = false;
+        opt->replaceWith[i] = -1;
+        opt->storeTo[i] = -1;
+    }
+}
+
+static void freeOptimizer(Optimizer* opt) {
+    int count = opt->list.count;
+    for (int b = 0; b < opt->blockCount; b++) {
+        Block* block = &opt->blocks[b];
+        FREE_ARRAY(int, block->predecessors, block->predecessorCapacity);
+        FREE_ARRAY(int, block->defs, opt->variableCount);
+        FREE_ARRAY(int, block->incomplete, opt->variableCount);
+    }
+    for (int l = 0; l < opt->loopCount; l++) {
+        FREE_ARRAY(bool, opt->loops[l].body, opt->blockCount);
+    }
+    for (int v = 0; v < opt->valueCount; v++) {
+        FREE_ARRAY(int, opt->values[v].phiOperands, opt->values[v].phiCapacity);
+    }
+    FREE_ARRAY(Block, opt->blocks, opt->blockCount);
+    FREE_ARRAY(int, opt->blockOf, count);
+    FREE_ARRAY(int, opt->order, opt->blockCount);
+    FREE_ARRAY(int, opt->headerLoop, opt->blockCount);
+    FREE_ARRAY(int, opt->heightAt, count);
+    FREE_ARRAY(int, opt->globals, count);
+    FREE_ARRAY(SsaValue, opt->values, opt->valueCapacity);
+    FREE_ARRAY(int, opt->inputStart, count);
+    FREE_ARRAY(int, opt->inputCount, count);
+    FREE_ARRAY(int, opt->inputs, opt->inputCapacity);
+    FREE_ARRAY(int, opt->created, count);
+    FREE_ARRAY(Loop, opt->loops, opt->loopCapacity);
+    FREE_ARRAY(bool, opt->deleted, count);
+    FREE_ARRAY(int, opt->replaceWith, count);
+    FREE_ARRAY(int, opt->storeTo, count);
+    freeInstructionList(&opt->list);
+}
+
+// Control flow ----------------------------------------------------------------
+
+static void addEdge(Optimizer* opt, int from, int to) {
+    Block* source = &opt->blocks[from];
+    source->successors[source->successorCount++] = to;
+
+    Block* target = &opt->blocks[to];
+    if (target->predecessorCapacity < target->predecessorCount + 1) {
+        int oldCapacity = target->predecessorCapacity;
+        target->predecessorCapacity = GROW_CAPACITY(oldCapacity);
+        target->predecessors = GROW_ARRAY(int, target->predecessors,
+                                          oldCapacity, target->predecessorCapacity);
+    }
+    target->predecessors[target->predecessorCount++] = from;
+}
+
+/*A block starts at the first instruction, at every jump target and after every jump
+or return*/
+static bool buildBlocks(Optimizer* opt) {
+    int count = opt->list.count;
+    bool* isLeader = ALLOCATE(bool, count + 1);
+    for (int i = 0; i <= count; i++) isLeader[i] = false;
+    isLeader[0] = true;
+
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &opt->list.code[i];
+        if (isJump(instruction->op)) {
+            if (instruction->operand >= count) {
+                FREE_ARRAY(bool, isLeader, count + 1);
+                return false;
+            }
+            isLeader[instruction->operand] = true;
+            isLeader[i + 1] = true;
+        } else if (instruction->op == OP_RETURN) {
+            isLeader[i + 1] = true;
+        }
+    }
+
+    int blockCount = 1;
+    for (int i = 0; i < count; i++) {
+        if (isLeader[i]) blockCount++;
+    }
+
+    opt->blocks = ALLOCATE(Block, blockCount);
+    opt->blockCount = blockCount;
+    for (int b = 0; b < blockCount; b++) {
+        Block* block = &opt->blocks[b];
+        block->start = 0;
+        block->end = 0;
+        block->entryHeight = -1;
+        block->successorCount = 0;
+        block->predecessors = NULL;
+        block->predecessorCount = 0;
+        block->predecessorCapacity = 0;
+        block->order = -1;
+        block->idom = -1;
+        block->filled = false;
+        block->sealed = false;
+        block->defs = NULL;
+        block->incomplete = NULL;
+    }
+
+    int current = 0;
+    for (int i = 0; i < count; i++) {
+        if (isLeader[i]) {
+            current++;
+            opt->blocks[current].start = i;
+        }
+        opt->blocks[current].end = i + 1;
+        opt->blockOf[i] = current;
+    }
+    FREE_ARRAY(bool, isLeader, count + 1);
+
+    addEdge(opt, 0, 1);
+    for (int b = 1; b < blockCount; b++) {
+        Instruction* last = &opt->list.code[opt->blocks[b].end - 1];
+        bool fallsThrough = last->op != OP_JUMP && last->op != OP_RETURN;
+        if (fallsThrough && opt->blocks[b].end < count) {
+            addEdge(opt, b, opt->blockOf[opt->blocks[b].end]);
+        }
+        if (isJump(last->op)) addEdge(opt, b, opt->blockOf[last->operand]);
+    }
+    return true;
+}
+
+static bool computeOrder(Optimizer* opt) {
+    int blockCount = opt->blockCount;
+    int* stack = ALLOCATE(int, blockCount);
+    int* next = ALLOCATE(int, blockCount);
+    int* postorder = ALLOCATE(int, blockCount);
+    bool* visited = ALLOCATE(bool, blockCount);
+    for (int b = 0; b < blockCount; b++) {
+        next[b] = 0;
+        visited[b] = false;
+    }
+
+    int depth = 0;
+    int postCount = 0;
+    stack[depth++] = 0;
+    visited[0] = true;
+    while (depth > 0) {
+        Block* block = &opt->blocks[stack[depth - 1]];
+        if (next[stack[depth - 1]] < block->successorCount) {
+            int successor = block->successors[next[stack[depth - 1]]++];
+            if (!visited[successor]) {
+                visited[successor] = true;
+                stack[depth++] = successor;
+            }
+        } else {
+            postorder[postCount++] = stack[--depth];
+        }
+    }
+
+    opt->order = ALLOCATE(int, blockCount);
+    opt->orderCount = postCount;
+    for (int k = 0; k < postCount; k++) {
+        opt->order[k] = postorder[postCount - 1 - k];
+        opt->blocks[opt->order[k]].order = k;
+    }
+
+    FREE_ARRAY(int, stack, blockCount);
+    FREE_ARRAY(int, next, blockCount);
+    FREE_ARRAY(int, postorder, blockCount);
+    FREE_ARRAY(bool, visited, blockCount);
+    //the peephole pass already dropped unreachable code
+    return postCount == blockCount;
+}
+
+static int intersect(Optimizer* opt, int a, int b) {
+    while (a != b) {
+        while (opt->blocks[a].order > opt->blocks[b].order) a = opt->blocks[a].idom;
+        while (opt->blocks[b].order > opt->blocks[a].order) b = opt->blocks[b].idom;
+    }
+    return a;
+}
+
+/*Cooper, Harvey and Kennedy's iterative dominator algorithm*/
+static void computeDominators(Optimizer* opt) {
+    opt->blocks[0].idom = 0;
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int k = 1; k < opt->orderCount; k++) {
+            Block* block = &opt->blocks[opt->order[k]];
+            int idom = -1;
+            for (int p = 0; p < block->predecessorCount; p++) {
+                int predecessor = block->predecessors[p];
+                if (opt->blocks[predecessor].idom == -1) continue;
+                idom = idom == -1 ? predecessor : intersect(opt, predecessor, idom);
+            }
+            if (block->idom != idom) {
+                block->idom = idom;
+                changed = true;
+            }
+        }
+    }
+}
+
+static bool dominates(Optimizer* opt, int a, int b) {
+    for (;;) {
+        if (a == b) return true;
+        if (b == 0) return false;
+        b = opt->blocks[b].idom;
+    }
+}
+
+/*Every edge into a block that dominates its source closes a loop. The loop body is
+everything that reaches the source without going through the header*/
+static void findLoops(Optimizer* opt) {
+    opt->headerLoop = ALLOCATE(int, opt->blockCount);
+    for (int b = 0; b < opt->blockCount; b++) opt->headerLoop[b] = -1;
+    int* work = ALLOCATE(int, opt->blockCount);
+
+    for (int b = 1; b < opt->blockCount; b++) {
+        for (int s = 0; s < opt->blocks[b].successorCount; s++) {
+            int header = opt->blocks[b].successors[s];
+            if (!dominates(opt, header, b)) continue;
+
+            int l = opt->headerLoop[header];
+            if (l == -1) {
+                if (opt->loopCapacity < opt->loopCount + 1) {
+                    int oldCapacity = opt->loopCapacity;
+                    opt->loopCapacity = GROW_CAPACITY(oldCapacity);
+                    opt->loops = GROW_ARRAY(Loop, opt->loops, oldCapacity, opt->loopCapacity);
+                }
+                l = opt->loopCount++;
+                Loop* loop = &opt->loops[l];
+                loop->header = header;
+                loop->body = ALLOCATE(bool, opt->blockCount);
+                for (int x = 0; x < opt->blockCount; x++) loop->body[x] = false;
+                loop->body[header] = true;
+                loop->size = 1;
+                opt->headerLoop[header] = l;
+            }
+
+            Loop* loop = &opt->loops[l];
+            int pending = 0;
+            if (!loop->body[b]) {
+                loop->body[b] = true;
+                loop->size++;
+                work[pending++] = b;
+            }
+            while (pending > 0) {
+                Block* block = &opt->blocks[work[--pending]];
+                for (int p = 0; p < block->predecessorCount; p++) {
+                    int predecessor = block->predecessors[p];
+                    if (loop->body[predecessor]) continue;
+                    loop->body[predecessor] = true;
+                    loop->size++;
+                    work[pending++] = predecessor;
+                }
+            }
+        }
+    }
+    FREE_ARRAY(int, work, opt->blockCount);
+}
+
+/*Stack height at the start of every block, which has to be the same along every path.
+Also finds the globals the function touches*/
+static bool computeHeights(Optimizer* opt) {
+    opt->blocks[0].entryHeight = opt->function->arity + 1;
+    opt->blocks[1].entryHeight = opt->function->arity + 1;
+    int maxHeight = opt->function->arity + 1;
+
+    for (int k = 1; k < opt->orderCount; k++) {
+        Block* block = &opt->blocks[opt->order[k]];
+        int height = block->entryHeight;
+        if (height < 0) return false;
+
+        for (int i = block->start; i < block->end; i++) {
+            Instruction* instruction = &opt->list.code[i];
+            int pops, pushes;
+            opt->heightAt[i] = height;
+            if (!stackEffect(instruction, &pops, &pushes)) return false;
+            if (pops > height) return false;
+            height += pushes - pops;
+            if (height > maxHeight) maxHeight = height;
+
+            switch (instruction->op) {
+                case OP_GET_GLOBAL:
+                case OP_GET_GLOBAL_LONG:
+                case OP_SET_GLOBAL:
+                case OP_SET_GLOBAL_LONG:
+                case OP_DEFINE_GLOBAL:
+                case OP_DEFINE_GLOBAL_LONG: {
+                    //the pool holds each name once, so the constant index identifies the global
+                    bool seen = false;
+                    for (int g = 0; g < opt->globalCount; g++) {
+                        if (opt->globals[g] == instruction->operand) seen = true;
+                    }
+                    if (!seen) opt->globals[opt->globalCount++] = instruction->operand;
+                    break;
+                }
+                case OP_GET_LOCAL:
+                case OP_SET_LOCAL:
+                    if (instruction->operand >= height) return false;
+                    break;
+                case OP_GUARD_CALLEE:
+                    if (instruction->guardSlot >= height) return false;
+                    break;
+            }
+        }
+
+        for (int s = 0; s < block->successorCount; s++) {
+            Block* successor = &opt->blocks[block->successors[s]];
+            if (successor->entryHeight == -1) {
+                successor->entryHeight = height;
+            } else if (successor->entryHeight != height) {
+                return false;
+            }
+        }
+    }
+
+    opt->slotCount = maxHeight;
+    opt->variableCount = maxHeight + opt->globalCount;
+    return true;
+}
+
+// SSA construction --------------------------------------------------------------
+
+static int newValue(Optimizer* opt, SsaKind kind, int block, int instruction) {
+    if (opt->valueCapacity < opt->valueCount + 1) {
+        int oldCapacity = opt->valueCapacity;
+        opt->valueCapacity = GROW_CAPACITY(oldCapacity);
+        opt->values = GROW_ARRAY(SsaValue, opt->values, oldCapacity, opt->valueCapacity);
+    }
+    int index = opt->valueCount++;
+    SsaValue* value = &opt->values[index];
+    value->kind = kind;
+    value->block = block;
+    value->instruction = instruction;
+    value->operand = -1;
+    value->phiOperands = NULL;
+    value->phiCount = 0;
+    value->phiCapacity = 0;
+    value->replacement = index;
+    value->leader = index;
+    value->reg = -1;
+    value->hoistedTo = -1;
+    value->live = false;
+    return index;
+}
+
+static void addPhiOperand(Optimizer* opt, int phi, int operand) {
+    SsaValue* value = &opt->values[phi];
+    if (value->phiCapacity < value->phiCount + 1) {
+        int oldCapacity = value->phiCapacity;
+        value->phiCapacity = GROW_CAPACITY(oldCapacity);
+        value->phiOperands = GROW_ARRAY(int, value->phiOperands,
+                                        oldCapacity, value->phiCapacity);
+    }
+    value->phiOperands[value->phiCount++] = operand;
+}
+
+static int resolve(Optimizer* opt, int value) {
+    while (opt->values[value].replacement != value) value = opt->values[value].replacement;
+    return value;
+}
+
+static int leaderOf(Optimizer* opt, int value) {
+    return opt->values[resolve(opt, value)].leader;
+}
+
+static int globalVariable(Optimizer* opt, int constant) {
+    for (int g = 0; g < opt->globalCount; g++) {
+        if (opt->globals[g] == constant) return opt->slotCount + g;
+    }
+    return -1;
+}
+
+static void writeVariable(Optimizer* opt, int variable, int block, int value) {
+    opt->blocks[block].defs[variable] = value;
+}
+
+static int readVariable(Optimizer* opt, int variable, int block);
+
+static void addPhiOperands(Optimizer* opt, int variable, int phi) {
+    int block = opt->values[phi].block;
+    for (int p = 0; p < opt->blocks[block].predecessorCount; p++) {
+        int operand = readVariable(opt, variable, opt->blocks[block].predecessors[p]);
+        addPhiOperand(opt, phi, operand);
+    }
+}
+
+/*Braun et al.'s SSA construction. A block that can still get predecessors (a loop header
+whose back edge hasn't been lifted yet) gets an empty phi that is filled in once it is sealed*/
+static int readVariable(Optimizer* opt, int variable, int block) {
+    if (opt->blocks[block].defs[variable] != -1) return opt->blocks[block].defs[variable];
+
+    int value;
+    if (!opt->blocks[block].sealed) {
+        value = newValue(opt, SSA_PHI, block, -1);
+        opt->blocks[block].incomplete[variable] = value;
+    } else if (opt->blocks[block].predecessorCount == 1) {
+        value = readVariable(opt, variable, opt->blocks[block].predecessors[0]);
+    } else if (opt->blocks[block].predecessorCount == 0) {
+        value = newValue(opt, SSA_ENTRY, block, -1);
+    } else {
+        value = newValue(opt, SSA_PHI, block, -1);
+        writeVariable(opt, variable, block, value);
+        addPhiOperands(opt, variable, value);
+    }
+    writeVariable(opt, variable, block, value);
+    return value;
+}
+
+static void sealBlock(Optimizer* opt, int block) {
+    opt->blocks[block].sealed = true;
+    for (int variable = 0; variable < opt->variableCount; variable++) {
+        int phi = opt->blocks[block].incomplete[variable];
+        if (phi != -1) addPhiOperands(opt, variable, phi);
+    }
+}
+
+static void trySeal(Optimizer* opt, int block) {
+    Block* target = &opt->blocks[block];
+    if (target->sealed) return;
+    for (int p = 0; p < target->predecessorCount; p++) {
+        if (!opt->blocks[target->predecessors[p]].filled) return;
+    }
+    sealBlock(opt, block);
+}
+
+static void addInput(Optimizer* opt, int value) {
+    if (opt->inputCapacity < opt->inputTotal + 1) {
+        int oldCapacity = opt->inputCapacity;
+        opt->inputCapacity = GROW_CAPACITY(oldCapacity);
+        opt->inputs = GROW_ARRAY(int, opt->inputs, oldCapacity, opt->inputCapacity);
+    }
+    opt->inputs[opt->inputTotal++] = value;
+}
+
+static void liftBlock(Optimizer* opt, int block) {
+    int height = opt->blocks[block].entryHeight;
+
+    for (int i = opt->blocks[block].start; i < opt->blocks[block].end; i++) {
+        Instruction* instruction = &opt->list.code[i];
+        int pops, pushes;
+        stackEffect(instruction, &pops, &pushes);
+
+        opt->inputStart[i] = opt->inputTotal;
+        opt->inputCount[i] = pops;
+        for (int p = 0; p < pops; p++) {
+            addInput(opt, readVariable(opt, height - pops + p, block));
+        }
+        int top = pops > 0 ? opt->inputs[opt->inputTotal - 1] : -1;
+        height -= pops;
+
+        int result = -1;
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+                result = readVariable(opt, instruction->operand, block);
+                break;
+
+            case OP_SET_LOCAL: {
+                int copy = newValue(opt, SSA_COPY, block, i);
+                opt->values[copy].operand = top;
+                opt->created[i] = copy;
+                writeVariable(opt, instruction->operand, block, copy);
+                result = top;
+                break;
+            }
+
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                int state = readVariable(opt, globalVariable(opt, instruction->operand), block);
+                result = newValue(opt, SSA_OP, block, i);
+                opt->values[result].operand = state;
+                opt->created[i] = result;
+                break;
+            }
+
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG: {
+                int store = newValue(opt, SSA_STORE, block, i);
+                opt->values[store].operand = top;
+                opt->created[i] = store;
+                writeVariable(opt, globalVariable(opt, instruction->operand), block, store);
+                if (pushes > 0) result = top;
+                break;
+            }
+
+            case OP_SET_UPVALUE:
+            case OP_JUMP_IF_FALSE:
+                result = top;
+                break;
+
+            case OP_GUARD_CALLEE:
+                addInput(opt, readVariable(opt, instruction->guardSlot, block));
+                opt->inputCount[i] = 1;
+                break;
+
+            case OP_CALL:
+                for (int g = 0; g < opt->globalCount; g++) {
+                    writeVariable(opt, opt->slotCount + g, block,
+                                  newValue(opt, SSA_CLOBBER, block, i));
+                }
+                result = newValue(opt, SSA_OP, block, i);
+                opt->created[i] = result;
+                break;
+
+            default:
+                if (pushes > 0) {
+                    result = newValue(opt, SSA_OP, block, i);
+                    opt->created[i] = result;
+                }
+                break;
+        }
+
+        if (result != -1) {
+            writeVariable(opt, height, block, result);
+            height++;
+        }
+    }
+}
+
+static void buildSsa(Optimizer* opt) {
+    for (int b = 0; b < opt->blockCount; b++) {
+        Block* block = &opt->blocks[b];
+        block->defs = ALLOCATE(int, opt->variableCount);
+        block->incomplete = ALLOCATE(int, opt->variableCount);
+        for (int v = 0; v < opt->variableCount; v++) {
+            block->defs[v] = -1;
+            block->incomplete[v] = -1;
+        }
+    }
+
+    //the parameters and the globals as they are on entry
+    for (int slot = 0; slot <= opt->function->arity; slot++) {
+        writeVariable(opt, slot, 0, newValue(opt, SSA_ENTRY, 0, -1));
+    }
+    for (int g = 0; g < opt->globalCount; g++) {
+        writeVariable(opt, opt->slotCount + g, 0, newValue(opt, SSA_ENTRY, 0, -1));
+    }
+    opt->blocks[0].sealed = true;
+    opt->blocks[0].filled = true;
+
+    for (int k = 1; k < opt->orderCount; k++) {
+        int block = opt->order[k];
+        trySeal(opt, block);
+        liftBlock(opt, block);
+        opt->blocks[block].filled = true;
+        for (int s = 0; s < opt->blocks[block].successorCount; s++) {
+            trySeal(opt, opt->blocks[block].successors[s]);
+        }
+    }
+
+    //a phi that merges one value (and maybe itself) is that value
+    bool changed = true;
+    while (changed) {
+        changed = false;
+        for (int v = 0; v < opt->valueCount; v++) {
+            SsaValue* phi = &opt->values[v];
+            if (phi->kind != SSA_PHI || phi->replacement != v) continue;
+
+            int same = -1;
+            bool trivial = true;
+            for (int o = 0; o < phi->phiCount; o++) {
+                int operand = resolve(opt, phi->phiOperands[o]);
+                if (operand == v || operand == same) continue;
+                if (same != -1) {
+                    trivial = false;
+                    break;
+                }
+                same = operand;
+            }
+            if (trivial && same != -1) {
+                phi->replacement = same;
+                changed = true;
+            }
+        }
+    }
+}
+
+// Inlining ----------------------------------------------------------------------
+
+static bool analyze(Optimizer* opt) {
+    return opt->list.count > 0 && buildBlocks(opt) && computeOrder(opt) &&
+           computeHeights(opt);
+}
+
+/*The instruction that pushed the callee of the call at i, or -1 if it isn't in the
+same block*/
+static int calleeLoad(Optimizer* opt, int i) {
+    int blockStart = opt->blocks[opt->blockOf[i]].start;
+    //the callee sits below the arguments
+    int need = opt->list.code[i].operand + 1;
+    for (int j = i - 1; j >= blockStart; j--) {
+        int pops, pushes;
+        stackEffect(&opt->list.code[j], &pops, &pushes);
+        if (pushes >= need) return j;
+        need += pops - pushes;
+    }
+    return -1;
+}
+
+/*Small, calls nothing (so it can't recurse either), and fits in the caller's slots
+once its slots are moved up to where the callee sits*/
+static bool analyzeCallee(Optimizer* opt, ObjFunction* callee, int base,
+                          Optimizer* calleeOpt) {
+    InstructionList list;
+    decodeChunk(&callee->chunk, &list);
+    initOptimizer(calleeOpt, opt->vm, callee, list);
+    if (list.count > INLINE_MAX_INSTRUCTIONS || !analyze(calleeOpt)) return false;
+
+    for (int i = 0; i < list.count; i++) {
+        switch (list.code[i].op) {
+            case OP_CALL:
+            case OP_GUARD_CALLEE:
+            case OP_GET_UPVALUE:
+            case OP_SET_UPVALUE:
+                return false;
+        }
+    }
+    return base + calleeOpt->slotCount <= UINT8_MAX;
+}
+
+static ObjFunction* inlineCandidate(Optimizer* opt, int i) {
+    Instruction* call = &opt->list.code[i];
+    int load = calleeLoad(opt, i);
+    if (load == -1 || !isGlobalLoad(opt->list.code[load].op)) return NULL;
+
+    Value callee;
+    Value name = opt->function->chunk.constants.values[opt->list.code[load].operand];
+    if (!tableGet(&opt->vm->globals, name, &callee) || !IS_FUNCTION(callee)) return NULL;
+    ObjFunction* function = AS_FUNCTION(callee);
+    //a function that was never called may not even be compiled yet
+    if (function == opt->function || function->arity != call->operand ||
+        function->upvalueCount > 0 || function->lazySource != NULL) {
+        return NULL;
+    }
+
+    Optimizer calleeOpt;
+    bool inlinable = analyzeCallee(opt, function, opt->heightAt[i] - call->operand - 1,
+                                   &calleeOpt);
+    freeOptimizer(&calleeOpt);
+    return inlinable ? function : NULL;
+}
+
+static uint8_t constantOp(uint8_t op, int index) {
+    bool isLong = index > UINT8_MAX;
+    switch (op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            return isLong ? OP_CONSTANT_LONG : OP_CONSTANT;
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+            return isLong ? OP_GET_GLOBAL_LONG : OP_GET_GLOBAL;
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+            return isLong ? OP_SET_GLOBAL_LONG : OP_SET_GLOBAL;
+        default:
+            return isLong ? OP_DEFINE_GLOBAL_LONG : OP_DEFINE_GLOBAL;
+    }
+}
+
+/*Copies the callee's body in place of the call. The callee's slots become the caller's
+slots starting where the callee value sits, its constants move into the caller's pool,
+and each return stores the result over the callee value, pops the rest and jumps past
+the call. The guard in front sends the call to the regular OP_CALL after the body when
+the global no longer holds this function*/
+static void inlineBody(Optimizer* opt, int i, ObjFunction* callee, InstructionList* out) {
+    Instruction* call = &opt->list.code[i];
+    int line = call->line;
+    int base = opt->heightAt[i] - call->operand - 1;
+    Chunk* chunk = &opt->function->chunk;
+
+    Optimizer calleeOpt;
+    analyzeCallee(opt, callee, base, &calleeOpt);
+    int calleeCount = calleeOpt.list.count;
+    int* newIndex = ALLOCATE(int, calleeCount);
+    int* exits = ALLOCATE(int, calleeCount);
+    int exitCount = 0;
+
+    int guard = writeInstruction(out, OP_GUARD_CALLEE, 0, line);
+    out->code[guard].guardSlot = base;
+    out->code[guard].guardConstant = addConstant(chunk, OBJ_VAL(callee));
+
+    for (int c = 0; c < calleeCount; c++) {
+        Instruction* instruction = &calleeOpt.list.code[c];
+        newIndex[c] = out->count;
+        switch (instruction->op) {
+            case OP_GET_LOCAL:
+            case OP_SET_LOCAL:
+                writeInstruction(out, instruction->op, base + instruction->operand, line);
+                break;
+
+            case OP_CONSTANT:
+            case OP_CONSTANT_LONG:
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG:
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG:
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG: {
+                int index = addConstant(chunk, callee->chunk.constants.values[instruction->operand]);
+                writeInstruction(out, constantOp(instruction->op, index), index, line);
+                break;
+            }
+
+            case OP_RETURN: {
+                //the result is on top of everything the callee had on the stack
+                int pops = calleeOpt.heightAt[c] - 1;
+                writeInstruction(out, OP_SET_LOCAL, base, line);
+                if (pops == 1) writeInstruction(out, OP_POP, 0, line);
+                else writeInstruction(out, OP_POPN, pops, line);
+                exits[exitCount++] = writeInstruction(out, OP_JUMP, 0, line);
+                break;
+            }
+
+            default:
+                writeInstruction(out, instruction->op, instruction->operand, line);
+                break;
+        }
+    }
+
+    //jumps inside the body still point at callee instructions
+    for (int c = 0; c < calleeCount; c++) {
+        Instruction* instruction = &calleeOpt.list.code[c];
+        if (isJump(instruction->op)) {
+            out->code[newIndex[c]].operand = newIndex[instruction->operand];
+        }
+    }
+
+    int slowPath = writeInstruction(out, OP_CALL, call->operand, line);
+    out->code[guard].operand = slowPath;
+    for (int e = 0; e < exitCount; e++) out->code[exits[e]].operand = slowPath + 1;
+
+    FREE_ARRAY(int, newIndex, calleeCount);
+    FREE_ARRAY(int, exits, calleeCount);
+    freeOptimizer(&calleeOpt);
+}
+
+/*Call sites whose callee is a global holding a small leaf function right now get a copy
+of the function's body. Returns false if there was nothing to inline*/
+static bool inlineCalls(Optimizer* opt, InstructionList* out) {
+    int count = opt->list.count;
+    ObjFunction** callees = ALLOCATE(ObjFunction*, count);
+    int sites = 0;
+    for (int i = 0; i < count; i++) {
+        callees[i] = NULL;
+        if (opt->list.code[i].op != OP_CALL || sites == INLINE_MAX_SITES) continue;
+        callees[i] = inlineCandidate(opt, i);
+        if (callees[i] != NULL) sites++;
+    }
+
+    if (sites > 0) {
+        int* newIndex = ALLOCATE(int, count + 1);
+        initInstructionList(out);
+        for (int i = 0; i < count; i++) {
+            newIndex[i] = out->count;
+            if (callees[i] != NULL) {
+                inlineBody(opt, i, callees[i], out);
+            } else {
+                Instruction* instruction = &opt->list.code[i];
+                int index = writeInstruction(out, instruction->op, instruction->operand,
+                                             instruction->line);
+                out->code[index].guardSlot = instruction->guardSlot;
+                out->code[index].guardConstant = instruction->guardConstant;
+            }
+        }
+        newIndex[count] = out->count;
+
+        for (int i = 0; i < count; i++) {
+            Instruction* instruction = &opt->list.code[i];
+            if (callees[i] == NULL && isJump(instruction->op)) {
+                out->code[newIndex[i]].operand = newIndex[instruction->operand];
+            }
+        }
+        FREE_ARRAY(int, newIndex, count + 1);
+    }
+
+    FREE_ARRAY(ObjFunction*, callees, count);
+    opt->inlined = sites;
+    return sites > 0;
+}
+
+// Optimizations ----------------------------------------------------------------
+
+static bool isGlobalDefined(Optimizer* opt, int constant) {
+    Value value;
+    return tableGet(&opt->vm->globals, opt->function->chunk.constants.values[constant], &value);
+}
+
+static bool dominatesValue(Optimizer* opt, int a, int b) {
+    if (opt->values[a].block == opt->values[b].block) return a < b;
+    return dominates(opt, opt->values[a].block, opt->values[b].block);
+}
+
+static bool sameComputation(Optimizer* opt, int a, int b) {
+    Instruction* first = &opt->list.code[opt->values[a].instruction];
+    Instruction* second = &opt->list.code[opt->values[b].instruction];
+    if (first->op != second->op || first->operand != second->operand) return false;
+
+    if (isGlobalLoad(first->op)) {
+        return resolve(opt, opt->values[a].operand) == resolve(opt, opt->values[b].operand);
+    }
+
+    int firstInputs = opt->inputStart[opt->values[a].instruction];
+    int secondInputs = opt->inputStart[opt->values[b].instruction];
+    for (int i = 0; i < opt->inputCount[opt->values[a].instruction]; i++) {
+        if (leaderOf(opt, opt->inputs[firstInputs + i]) !=
+            leaderOf(opt, opt->inputs[secondInputs + i])) {
+            return false;
+        }
+    }
+    return true;
+}
+
+/*Global value numbering: a pure instruction computing the same thing from the same
+operands as an earlier one that dominates it gets that one as its leader. A global
+load right after a store to that global is the stored value*/
+static void numberValues(Optimizer* opt) {
+    int* candidates = ALLOCATE(int, opt->valueCount);
+    int candidateCount = 0;
+
+    for (int v = 0; v < opt->valueCount; v++) {
+        SsaValue* value = &opt->values[v];
+        if (value->kind == SSA_COPY) {
+            value->leader = leaderOf(opt, value->operand);
+            continue;
+        }
+        if (value->kind != SSA_OP) continue;
+        uint8_t op = opt->list.code[value->instruction].op;
+        if (!isPure(op)) continue;
+
+        if (isGlobalLoad(op)) {
+            SsaValue* state = &opt->values[resolve(opt, value->operand)];
+            if (state->kind == SSA_STORE) {
+                int stored = leaderOf(opt, state->operand);
+                if (opt->values[stored].kind == SSA_OP) {
+                    value->leader = stored;
+                    continue;
+                }
+            }
+        }
+
+        for (int c = candidateCount - 1; c >= 0; c--) {
+            if (sameComputation(opt, candidates[c], v) &&
+                dominatesValue(opt, candidates[c], v)) {
+                value->leader = candidates[c];
+                break;
+            }
+        }
+        if (value->leader == v) candidates[candidateCount++] = v;
+    }
+
+    FREE_ARRAY(int, candidates, opt->valueCount);
+}
+
+/*A global load inside a loop that nothing in the loop can write to (no store to that
+global and no call) reads the same value on every iteration. It moves in front of the
+loop into a register. The global has to exist already, otherwise the load could fail
+in front of a loop that never runs; globals are never removed, so it stays that way*/
+static void hoistInvariants(Optimizer* opt) {
+    for (int v = 0; v < opt->valueCount; v++) {
+        SsaValue* value = &opt->values[v];
+        if (value->kind != SSA_OP || value->leader != v) continue;
+        Instruction* instruction = &opt->list.code[value->instruction];
+        if (!isGlobalLoad(instruction->op)) continue;
+        if (!isGlobalDefined(opt, instruction->operand)) continue;
+
+        int stateBlock = opt->values[resolve(opt, value->operand)].block;
+        int best = -1;
+        for (int l = 0; l < opt->loopCount; l++) {
+            Loop* loop = &opt->loops[l];
+            if (!loop->body[value->block] || loop->body[stateBlock]) continue;
+            if (best == -1 || loop->size > opt->loops[best].size) best = l;
+        }
+        if (best == -1 || opt->registerCount == MAX_REGISTERS) continue;
+
+        value->hoistedTo = best;
+        value->reg = opt->registerCount++;
+        opt->replaceWith[value->instruction] = value->reg;
+        opt->hoisted++;
+    }
+}
+
+static bool isPlain(uint8_t op) {
+    return isPure(op) || op == OP_GET_LOCAL;
+}
+
+static int inputsUsed(Optimizer* opt, int i) {
+    return opt->replaceWith[i] != -1 ? 0 : opt->inputCount[i];
+}
+
+/*In stack code the operands of an instruction are computed right before it, so an
+expression is a run of instructions ending in the one producing its value. Returns where
+that run starts, or -1 if it isn't made of plain loads and pure operations only*/
+static int expressionStart(Optimizer* opt, int i) {
+    int blockStart = opt->blocks[opt->blockOf[i]].start;
+    int need = inputsUsed(opt, i);
+    int j = i;
+    while (need > 0) {
+        j--;
+        if (j < blockStart || opt->deleted[j] || opt->storeTo[j] != -1) return -1;
+        if (!isPlain(opt->list.code[j].op)) return -1;
+        need += inputsUsed(opt, j) - 1;
+    }
+    return j;
+}
+
+/*A redundant expression is replaced by a read of the register its leader was saved in.
+Going backwards means the outermost redundant expression is found first and replaced
+as a whole*/
+static void shareRedundant(Optimizer* opt) {
+    for (int i = opt->list.count - 1; i >= 0; i--) {
+        if (opt->deleted[i] || opt->replaceWith[i] != -1) continue;
+        int v = opt->created[i];
+        if (v == -1 || opt->values[v].kind != SSA_OP) continue;
+        uint8_t op = opt->list.code[i].op;
+        if (!isPure(op)) continue;
+
+        int leader = leaderOf(opt, v);
+        if (leader == v || opt->values[leader].kind != SSA_OP) continue;
+
+        int start = expressionStart(opt, i);
+        //a single constant is cheaper to push again than to keep in a register
+        if (start == -1 || (start == i && !isGlobalLoad(op))) continue;
+
+        SsaValue* saved = &opt->values[leader];
+        if (saved->reg == -1) {
+            if (opt->registerCount == MAX_REGISTERS) continue;
+            saved->reg = opt->registerCount++;
+            opt->storeTo[saved->instruction] = saved->reg;
+        }
+
+        for (int j = start; j < i; j++) opt->deleted[j] = true;
+        opt->replaceWith[i] = saved->reg;
+        opt->shared++;
+    }
+}
+
+static void markLive(Optimizer* opt, int v) {
+    v = resolve(opt, v);
+    SsaValue* value = &opt->values[v];
+    if (value->live) return;
+    value->live = true;
+
+    if (value->kind == SSA_PHI) {
+        for (int o = 0; o < value->phiCount; o++) markLive(opt, value->phiOperands[o]);
+    } else if (value->kind == SSA_COPY) {
+        markLive(opt, value->operand);
+    }
+}
+
+/*Leaves out whatever never gets executed: stores to locals nothing reads afterwards,
+and expression statements that can't fail and whose value is only popped*/
+static void removeDeadCode(Optimizer* opt) {
+    int count = opt->list.count;
+    for (int i = 0; i < count; i++) {
+        if (opt->deleted[i] || opt->replaceWith[i] != -1) continue;
+        uint8_t op = opt->list.code[i].op;
+        //popping a value or storing it somewhere nobody reads doesn't use it
+        if (op == OP_POP || op == OP_POPN || op == OP_SET_LOCAL) continue;
+        for (int n = 0; n < opt->inputCount[i]; n++) {
+            markLive(opt, opt->inputs[opt->inputStart[i] + n]);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (opt->deleted[i] || opt->list.code[i].op != OP_SET_LOCAL) continue;
+        if (!opt->values[opt->created[i]].live) {
+            opt->deleted[i] = true;
+            opt->removed++;
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (opt->deleted[i] || opt->list.code[i].op != OP_POP) continue;
+
+        int blockStart = opt->blocks[opt->blockOf[i]].start;
+        int need = 1;
+        int j = i;
+        bool harmless = true;
+        while (need > 0 && harmless) {
+            j--;
+            if (j < blockStart || opt->storeTo[j] != -1) {
+                harmless = false;
+                break;
+            }
+            if (opt->deleted[j]) continue;
+
+            Instruction* instruction = &opt->list.code[j];
+            switch (instruction->op) {
+                case OP_CONSTANT:
+                case OP_CONSTANT_LONG:
+                case OP_NIL:
+                case OP_TRUE:
+                case OP_FALSE:
+                case OP_GET_LOCAL:
+                case OP_EQUAL:
+                case OP_NOT_EQUAL:
+                case OP_NOT:
+                //the typed forms can't fail
+                case OP_ADD_NUMBER:
+                case OP_ADD_STRING:
+                case OP_SUBTRACT_NUMBER:
+                case OP_MULTIPLY_NUMBER:
+                case OP_DIVIDE_NUMBER:
+                case OP_NEGATE_NUMBER:
+                case OP_GREATER_NUMBER:
+                case OP_LESS_NUMBER:
+                case OP_GREATER_EQUAL_NUMBER:
+                case OP_LESS_EQUAL_NUMBER:
+                    break;
+                case OP_GET_GLOBAL:
+                case OP_GET_GLOBAL_LONG:
+                    harmless = opt->replaceWith[j] != -1 ||
+                               isGlobalDefined(opt, instruction->operand);
+                    break;
+                default:
+                    harmless = opt->replaceWith[j] != -1;
+                    break;
+            }
+            need += inputsUsed(opt, j) - 1;
+        }
+        if (!harmless) continue;
+
+        for (int k = j; k <= i; k++) {
+            if (!opt->deleted[k]) {
+                opt->deleted[k] = true;
+                opt->removed++;
+            }
+        }
+    }
+}
+
+// Lowering ----------------------------------------------------------------------
+
+/*Registers sit right above the parameters, so every other local moves up by the
+number of registers*/
+static int registerSlot(Optimizer* opt, int reg) {
+    return opt->function->arity + 1 + reg;
+}
+
+static bool canLower(Optimizer* opt) {
+    int arity = opt->function->arity;
+    if (arity + opt->registerCount >= UINT8_COUNT - 1) return false;
+
+    for (int i = 0; i < opt->list.count; i++) {
+        Instruction* instruction = &opt->list.code[i];
+        int slot;
+        if (instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL) {
+            slot = instruction->operand;
+        } else if (instruction->op == OP_GUARD_CALLEE) {
+            slot = instruction->guardSlot;
+        } else {
+            continue;
+        }
+        if (slot > arity && slot + opt->registerCount > UINT8_MAX) return false;
+    }
+
+    //a register is only read where the instruction that writes it still runs
+    for (int v = 0; v < opt->valueCount; v++) {
+        SsaValue* value = &opt->values[v];
+        if (value->reg != -1 && value->hoistedTo == -1 && opt->deleted[value->instruction]) {
+            return false;
+        }
+    }
+    return true;
+}
+
+static void lower(Optimizer* opt, InstructionList* out) {
+    int count = opt->list.count;
+    int arity = opt->function->arity;
+    int* newIndex = ALLOCATE(int, count + 1);
+    int* preheader = ALLOCATE(int, count);
+    int* emitted = ALLOCATE(int, count);
+
+    initInstructionList(out);
+    int firstLine = opt->list.code[0].line;
+    for (int r = 0; r < opt->registerCount; r++) writeInstruction(out, OP_NIL, 0, firstLine);
+
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &opt->list.code[i];
+        preheader[i] = -1;
+        emitted[i] = -1;
+
+        //hoisted loads go in front of their loop, only entries from outside run them
+        int block = opt->blockOf[i];
+        if (opt->blocks[block].start == i && opt->headerLoop[block] != -1) {
+            for (int v = 0; v < opt->valueCount; v++) {
+                SsaValue* value = &opt->values[v];
+                if (value->hoistedTo != opt->headerLoop[block]) continue;
+                Instruction* load = &opt->list.code[value->instruction];
+                if (preheader[i] == -1) preheader[i] = out->count;
+                writeInstruction(out, load->op, load->operand, instruction->line);
+                writeInstruction(out, OP_SET_LOCAL, registerSlot(opt, value->reg),
+                                 instruction->line);
+                writeInstruction(out, OP_POP, 0, instruction->line);
+            }
+        }
+
+        newIndex[i] = out->count;
+        if (opt->deleted[i]) continue;
+
+        if (opt->replaceWith[i] != -1) {
+            writeInstruction(out, OP_GET_LOCAL, registerSlot(opt, opt->replaceWith[i]),
+                             instruction->line);
+        } else {
+            int operand = instruction->operand;
+            if ((instruction->op == OP_GET_LOCAL || instruction->op == OP_SET_LOCAL) &&
+                operand > arity) {
+                operand += opt->registerCount;
+            }
+            emitted[i] = writeInstruction(out, instruction->op, operand, instruction->line);
+            if (instruction->op == OP_GUARD_CALLEE) {
+                int slot = instruction->guardSlot;
+                out->code[emitted[i]].guardSlot = slot > arity ? slot + opt->registerCount : slot;
+                out->code[emitted[i]].guardConstant = instruction->guardConstant;
+            }
+        }
+
+        if (opt->storeTo[i] != -1) {
+            writeInstruction(out, OP_SET_LOCAL, registerSlot(opt, opt->storeTo[i]),
+                             instruction->line);
+        }
+    }
+    newIndex[count] = out->count;
+
+    for (int i = 0; i < count; i++) {
+        if (emitted[i] == -1 || !isJump(opt->list.code[i].op)) continue;
+        int target = opt->list.code[i].operand;
+        int l = opt->headerLoop[opt->blockOf[target]];
+        bool fromOutside = l != -1 && !opt->loops[l].body[opt->blockOf[i]];
+        out->code[emitted[i]].operand =
+            fromOutside && preheader[target] != -1 ? preheader[target] : newIndex[target];
+    }
+
+    FREE_ARRAY(int, newIndex, count + 1);
+    FREE_ARRAY(int, preheader, count);
+    FREE_ARRAY(int, emitted, count);
+}
+
+void optimizeFunction(VM* vm, ObjFunction* function) {
+    function->isOptimized = true;
+
+    InstructionList list;
+    decodeChunk(&function->chunk, &list);
+    Optimizer opt;
+    initOptimizer(&opt, vm, function, list);
+    if (!analyze(&opt)) {
+        freeOptimizer(&opt);
+        return;
+    }
+
+    //inlined bodies go through the rest of the passes with the caller's code
+    InstructionList inlined;
+    if (inlineCalls(&opt, &inlined)) {
+        int inlinedCount = opt.inlined;
+        freeOptimizer(&opt);
+        initOptimizer(&opt, vm, function, inlined);
+        opt.inlined = inlinedCount;
+        if (!analyze(&opt)) {
+            //the inlined code is still correct as it is, just not optimized further
+            encodeChunk(&function->chunk, &opt.list);
+            freeOptimizer(&opt);
+            return;
+        }
+    }
+
+    computeDominators(&opt);
+    findLoops(&opt);
+    buildSsa(&opt);
+    numberValues(&opt);
+    hoistInvariants(&opt);
+    shareRedundant(&opt);
+    removeDeadCode(&opt);
+
+    InstructionList out;
+    bool lowered = opt.hoisted + opt.shared + opt.removed > 0 && canLower(&opt);
+    if (lowered) {
+        lower(&opt, &out);
+    } else {
+        out = opt.list;
+        initInstructionList(&opt.list);
+    }
+
+    if (lowered || opt.inlined > 0) {
+        //the list's jump targets are instruction indices, so the old code isn't needed
+        if (encodeChunk(&function->chunk, &out)) optimizeChunk(&function->chunk);
+
+        #ifdef DEBUG_PRINT_CODE
+        printf("-- optimized %s: %d inlined, %d hoisted, %d shared, %d removed --\n",
+               function->name != NULL ? function->name->chars : "<script>",
+               opt.inlined, opt.hoisted, opt.shared, opt.removed);
+        disassembleChunk(&function->chunk,
+                         function->name != NULL ? function->name->chars : "<script>");
+        #endif
+    }
+
+    freeInstructionList(&out);
+    freeOptimizer(&opt);
+}
@@ -0,0 +1,18 @@
+/*Optional optimizing tier. A function that gets hot is lifted from bytecode into SSA
+form, gets loop invariant code motion, common subexpression elimination and dead code
+elimination, and is lowered back into bytecode in place*/
+
+#ifndef cpandi_optimizer_h
+#define cpandi_optimizer_h
+
+#include "object.h"
+
+/*Number of calls after which a function counts as hot*/
+#define HOT_CALL_COUNT 100
+
+/*Rewrites the function's chunk. It must not be running in any frame while this happens.
+Functions the tier can't handle are left as they are, either way the function is marked
+optimized so it isn't tried again*/
+void optimizeFunction(VM* vm, ObjFunction* function);
+
+#endif
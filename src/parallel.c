@@ -0,0 +1,147 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "parallel.h"
+#include "transfer.h"
+
+/*Why a parallelMap() stopped early*/
+typedef enum {
+    MAP_OK,
+    MAP_RUNTIME_ERROR,
+    MAP_FIBER,
+} MapStatus;
+
+/*State shared by the workers. Like the compile pool they take the next item off a
+counter, and the result goes into the item's own slot so the order doesn't matter*/
+typedef struct {
+    //the calling VM, it's stopped in parallelMap() so the workers can read its objects
+    VM* vm;
+    Value function;
+    Value* keys;
+    Value* values;
+    //what the function returned for each value, an object in the worker's own VM
+    Value* results;
+    //which worker made each result
+    int* owners;
+    int count;
+    atomic_int next;
+    atomic_int status;
+} MapJobs;
+
+typedef struct {
+    MapJobs* jobs;
+    int index;
+    VM vm;
+} Worker;
+
+static void* mapWorker(void* argument) {
+    Worker* worker = (Worker*)argument;
+    MapJobs* jobs = worker->jobs;
+    VM* vm = &worker->vm;
+
+    //the worker sees the globals as they were when parallelMap() was called, except
+    //for fibers which become nil
+    Transfer transfer;
+    initTransfer(&transfer, vm);
+    transferTable(&transfer, &jobs->vm->globals, &vm->globals);
+    Value function = transferValue(&transfer, jobs->function);
+    transfer.failed = false;
+
+    while (atomic_load(&jobs->status) == MAP_OK) {
+        int index = atomic_fetch_add(&jobs->next, 1);
+        if (index >= jobs->count) break;
+
+        Value value = transferValue(&transfer, jobs->values[index]);
+        if (transfer.failed) {
+            atomic_store(&jobs->status, MAP_FIBER);
+            break;
+        }
+        if (callFunction(vm, function, 1, &value, &jobs->results[index]) != INTERPRET_OK) {
+            atomic_store(&jobs->status, MAP_RUNTIME_ERROR);
+            break;
+        }
+        jobs->owners[index] = worker->index;
+    }
+    freeTransfer(&transfer);
+    return NULL;
+}
+
+static int workerCount(int count) {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int)cores : 1;
+    if (workers > MAX_WORKERS) workers = MAX_WORKERS;
+    return workers < count ? workers : count;
+}
+
+bool parallelMap(VM* vm, Value function, ObjMap* items, ObjMap** results) {
+    MapJobs jobs;
+    jobs.vm = vm;
+    jobs.function = function;
+    jobs.count = items->count;
+    jobs.keys = ALLOCATE(Value, jobs.count);
+    jobs.values = ALLOCATE(Value, jobs.count);
+    jobs.results = ALLOCATE(Value, jobs.count);
+    jobs.owners = ALLOCATE(int, jobs.count);
+    atomic_init(&jobs.next, 0);
+    atomic_init(&jobs.status, MAP_OK);
+    int count = 0;
+    for (int i = 0; i < items->table.capacity; i++) {
+        Entry* entry = &items->table.entries[i];
+        if (IS_NIL(entry->key)) continue;
+        jobs.keys[count] = entry->key;
+        jobs.values[count] = entry->value;
+        count++;
+    }
+
+    //each worker VM is set up before any thread starts, so none of them writes to
+    //memory another thread reads
+    int workerTotal = workerCount(jobs.count);
+    Worker workers[MAX_WORKERS];
+    for (int i = 0; i < workerTotal; i++) {
+        workers[i].jobs = &jobs;
+        workers[i].index = i;
+        initVM(&workers[i].vm);
+        workers[i].vm.optimize = vm->optimize;
+    }
+    //the calling thread is the first worker, so a single item needs no extra thread
+    pthread_t threads[MAX_WORKERS];
+    int started = 1;
+    for (; started < workerTotal; started++) {
+        if (pthread_create(&threads[started], NULL, mapWorker, &workers[started]) != 0) break;
+    }
+    if (workerTotal > 0) mapWorker(&workers[0]);
+    for (int i = 1; i < started; i++) pthread_join(threads[i], NULL);
+    //workers that never got a thread just didn't take any items
+    MapStatus status = (MapStatus)atomic_load(&jobs.status);
+
+    //the results are copied in from each worker on this thread, in the map's order
+    Transfer transfers[MAX_WORKERS];
+    for (int i = 0; i < workerTotal; i++) initTransfer(&transfers[i], vm);
+    if (status == MAP_OK) {
+        ObjMap* map = newMap(vm);
+        for (int i = 0; i < jobs.count; i++) {
+            Transfer* transfer = &transfers[jobs.owners[i]];
+            mapSet(map, jobs.keys[i], transferValue(transfer, jobs.results[i]));
+            if (transfer->failed) status = MAP_FIBER;
+        }
+        *results = map;
+    }
+    for (int i = 0; i < workerTotal; i++) {
+        freeTransfer(&transfers[i]);
+        freeVM(&workers[i].vm);
+    }
+    FREE_ARRAY(Value, jobs.keys, jobs.count);
+    FREE_ARRAY(Value, jobs.values, jobs.count);
+    FREE_ARRAY(Value, jobs.results, jobs.count);
+    FREE_ARRAY(int, jobs.owners, jobs.count);
+
+    if (status == MAP_FIBER) {
+        runtimeError(vm, "parallelMap() can't move a fiber to another VM.");
+    } else if (status == MAP_RUNTIME_ERROR) {
+        runtimeError(vm, "parallelMap() function failed in a worker.");
+    }
+    return status == MAP_OK;
+}
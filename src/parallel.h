@@ -0,0 +1,15 @@
+#ifndef cpandi_parallel_h
+#define cpandi_parallel_h
+
+#include "vm.h"
+
+/*Upper bound on worker VMs per parallelMap(), the pool never has more workers than
+items and the calling thread runs one of them*/
+#define MAX_WORKERS 16
+
+/*Calls the function on every value of the map, spread over worker VMs on their own
+threads, and makes a map of the results under the same keys. Values move between VMs
+by deep copy, fibers can't move at all. False after a runtime error*/
+bool parallelMap(VM* vm, Value function, ObjMap* items, ObjMap** results);
+
+#endif
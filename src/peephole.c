@@ -0,0 +1,498 @@
+#include <stdlib.h>
+
+#include "memory.h"
+#include "peephole.h"
+
+/*A jump can never chain through more than this many jumps, which also stops
+threading from spinning on a jump to itself*/
+#define MAX_THREAD_HOPS 16
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_GUARD_CALLEE;
+}
+
+void initInstructionList(InstructionList* list) {
+    list->code = NULL;
+    list->count = 0;
+    list->capacity = 0;
+}
+
+void freeInstructionList(InstructionList* list) {
+    FREE_ARRAY(Instruction, list->code, list->capacity);
+    initInstructionList(list);
+}
+
+int writeInstruction(InstructionList* list, uint8_t op, int operand, int line) {
+    if (list->capacity < list->count + 1) {
+        int oldCapacity = list->capacity;
+        list->capacity = GROW_CAPACITY(oldCapacity);
+        list->code = GROW_ARRAY(Instruction, list->code, oldCapacity, list->capacity);
+    }
+    Instruction* instruction = &list->code[list->count];
+    instruction->op = op;
+    instruction->operand = operand;
+    instruction->line = line;
+    instruction->offset = -1;
+    instruction->length = 1 + operandLength(op);
+    instruction->guardSlot = 0;
+    instruction->guardConstant = 0;
+    instruction->isTarget = false;
+    instruction->removed = false;
+    instruction->isLong = false;
+    return list->count++;
+}
+
+static int readOperand(Chunk* chunk, int offset, int length) {
+    uint8_t* code = chunk->code + offset + 1;
+    if (length == 3) return code[0] << 16 | code[1] << 8 | code[2];
+    if (length == 2) return code[0] << 8 | code[1];
+    if (length == 1) return code[0];
+    return 0;
+}
+
+void decodeChunk(Chunk* chunk, InstructionList* list) {
+    //byte offset -> instruction index, with one extra slot for the end of the code
+    int* indexAt = ALLOCATE(int, chunk->count + 1);
+    int count = 0;
+    for (int offset = 0; offset < chunk->count; offset += instructionLength(chunk, offset)) {
+        indexAt[offset] = count++;
+    }
+    indexAt[chunk->count] = count;
+
+    initInstructionList(list);
+    for (int offset = 0; offset < chunk->count;) {
+        uint8_t op = chunk->code[offset];
+        int length = instructionLength(chunk, offset);
+        int operand = readOperand(chunk, offset, operandLength(op));
+        int next = offset + length;
+
+        switch (op) {
+            case OP_JUMP:
+            case OP_JUMP_LONG:
+                op = OP_JUMP;
+                operand = indexAt[next + operand];
+                break;
+            case OP_JUMP_IF_FALSE:
+            case OP_JUMP_IF_FALSE_LONG:
+                op = OP_JUMP_IF_FALSE;
+                operand = indexAt[next + operand];
+                break;
+            case OP_LOOP:
+            case OP_LOOP_LONG:
+                op = OP_JUMP;
+                operand = indexAt[next - operand];
+                break;
+            case OP_GUARD_CALLEE:
+            case OP_GUARD_CALLEE_LONG:
+                op = OP_GUARD_CALLEE;
+                operand = indexAt[next + readOperand(chunk, offset + 4,
+                                                     length == 8 ? 3 : 2)];
+                break;
+        }
+
+        int index = writeInstruction(list, op, operand, getLine(chunk, offset));
+        if (op == OP_GUARD_CALLEE) {
+            list->code[index].guardSlot = chunk->code[offset + 1];
+            list->code[index].guardConstant = readOperand(chunk, offset + 1, 3);
+        }
+        list->code[index].offset = offset;
+        list->code[index].length = length;
+        offset = next;
+    }
+
+    FREE_ARRAY(int, indexAt, chunk->count + 1);
+}
+
+/*First instruction at or after index that is still in the list*/
+static int nextLive(InstructionList* list, int index) {
+    while (index < list->count && list->code[index].removed) index++;
+    return index;
+}
+
+/*Also points every jump straight at a live instruction*/
+static void markTargets(InstructionList* list) {
+    for (int i = 0; i < list->count; i++) list->code[i].isTarget = false;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed || !isJump(instruction->op)) continue;
+        instruction->operand = nextLive(list, instruction->operand);
+        if (instruction->operand < list->count) {
+            list->code[instruction->operand].isTarget = true;
+        }
+    }
+}
+
+/*A jump that lands on an unconditional jump can go straight to where that one goes.
+A conditional jump landing on another conditional jump takes it too, since the
+condition is still on the stack and still falsey. Conditional jumps (and guards) only
+go forward*/
+static bool threadJumps(InstructionList* list) {
+    bool changed = false;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed || !isJump(instruction->op)) continue;
+
+        int target = nextLive(list, instruction->operand);
+        for (int hops = 0; hops < MAX_THREAD_HOPS && target < list->count; hops++) {
+            Instruction* landing = &list->code[target];
+            if (landing->op != OP_JUMP &&
+                !(instruction->op == OP_JUMP_IF_FALSE && landing->op == OP_JUMP_IF_FALSE)) {
+                break;
+            }
+            int next = nextLive(list, landing->operand);
+            if (next == target) break;
+            if (instruction->op != OP_JUMP && next <= i) break;
+            target = next;
+        }
+
+        if (target != instruction->operand) {
+            instruction->operand = target;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/*Jumping to the very next instruction does nothing (the conditional jump doesn't pop)*/
+static bool removeEmptyJumps(InstructionList* list) {
+    bool changed = false;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed || !isJump(instruction->op)) continue;
+        if (nextLive(list, instruction->operand) == nextLive(list, i + 1)) {
+            instruction->removed = true;
+            changed = true;
+        }
+    }
+    return changed;
+}
+
+/*Walks the control flow from the first instruction, whatever it never reaches (code
+after a return or after an unconditional jump) is dropped*/
+static bool removeUnreachable(InstructionList* list) {
+    bool* reachable = ALLOCATE(bool, list->count);
+    int* work = ALLOCATE(int, list->count);
+    for (int i = 0; i < list->count; i++) reachable[i] = false;
+
+    int pending = 0;
+    int first = nextLive(list, 0);
+    if (first < list->count) {
+        reachable[first] = true;
+        work[pending++] = first;
+    }
+
+    while (pending > 0) {
+        int i = work[--pending];
+        Instruction* instruction = &list->code[i];
+        int successors[2];
+        int successorCount = 0;
+
+        if (instruction->op == OP_JUMP) {
+            successors[successorCount++] = nextLive(list, instruction->operand);
+        } else if (instruction->op != OP_RETURN) {
+            successors[successorCount++] = nextLive(list, i + 1);
+            if (isJump(instruction->op)) {
+                successors[successorCount++] = nextLive(list, instruction->operand);
+            }
+        }
+
+        for (int s = 0; s < successorCount; s++) {
+            int next = successors[s];
+            if (next < list->count && !reachable[next]) {
+                reachable[next] = true;
+                work[pending++] = next;
+            }
+        }
+    }
+
+    bool changed = false;
+    for (int i = 0; i < list->count; i++) {
+        if (!list->code[i].removed && !reachable[i]) {
+            list->code[i].removed = true;
+            changed = true;
+        }
+    }
+
+    FREE_ARRAY(bool, reachable, list->count);
+    FREE_ARRAY(int, work, list->count);
+    return changed;
+}
+
+/*The compiler spells a != b, a >= b and a <= b as a comparison followed by OP_NOT*/
+static bool fuseComparisons(InstructionList* list) {
+    bool changed = false;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed) continue;
+
+        uint8_t fused;
+        switch (instruction->op) {
+            case OP_EQUAL:   fused = OP_NOT_EQUAL;     break;
+            case OP_LESS:    fused = OP_GREATER_EQUAL; break;
+            case OP_GREATER: fused = OP_LESS_EQUAL;    break;
+            default: continue;
+        }
+
+        int next = nextLive(list, i + 1);
+        if (next == list->count) continue;
+        Instruction* negation = &list->code[next];
+        //a jump landing on the OP_NOT still needs it
+        if (negation->op != OP_NOT || negation->isTarget) continue;
+
+        instruction->op = fused;
+        negation->removed = true;
+        changed = true;
+    }
+    return changed;
+}
+
+/*Runs of pops (the end of a scope, mostly) become a single OP_POPN*/
+static bool mergePops(InstructionList* list) {
+    bool changed = false;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed) continue;
+        if (instruction->op != OP_POP && instruction->op != OP_POPN) continue;
+
+        int count = instruction->op == OP_POP ? 1 : instruction->operand;
+        int next = nextLive(list, i + 1);
+        while (next < list->count) {
+            Instruction* pop = &list->code[next];
+            if (pop->isTarget) break;
+            int popCount;
+            if (pop->op == OP_POP) popCount = 1;
+            else if (pop->op == OP_POPN) popCount = pop->operand;
+            else break;
+            if (count + popCount > UINT8_MAX) break;
+
+            count += popCount;
+            pop->removed = true;
+            changed = true;
+            next = nextLive(list, next + 1);
+        }
+
+        if (count > 1) {
+            instruction->op = OP_POPN;
+            instruction->operand = count;
+        }
+    }
+    return changed;
+}
+
+static int encodedLength(Instruction* instruction) {
+    if (instruction->op == OP_GUARD_CALLEE) return instruction->isLong ? 8 : 7;
+    if (isJump(instruction->op)) return instruction->isLong ? 4 : 3;
+    if (instruction->op == OP_CLOSURE || instruction->op == OP_CLOSURE_LONG) {
+        return instruction->length;
+    }
+    return 1 + operandLength(instruction->op);
+}
+
+/*Every jump starts out short and only grows when its distance doesn't fit in 16 bits.
+Growing one jump can push another one out of range, so this repeats until nothing grows*/
+static bool layout(InstructionList* list, int* offsets) {
+    bool grew;
+    do {
+        grew = false;
+        int offset = 0;
+        for (int i = 0; i < list->count; i++) {
+            offsets[i] = offset;
+            if (!list->code[i].removed) offset += encodedLength(&list->code[i]);
+        }
+        offsets[list->count] = offset;
+
+        for (int i = 0; i < list->count; i++) {
+            Instruction* instruction = &list->code[i];
+            if (instruction->removed || !isJump(instruction->op)) continue;
+            int end = offsets[i] + encodedLength(instruction);
+            int target = offsets[instruction->operand];
+            int distance = target >= end ? target - end : end - target;
+            if (distance > 0xffffff) return false;
+            if (distance > UINT16_MAX && !instruction->isLong) {
+                instruction->isLong = true;
+                grew = true;
+            }
+        }
+    } while (grew);
+    return true;
+}
+
+static void emit(Chunk* chunk, InstructionList* list, int* offsets, Chunk* out) {
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed) continue;
+        int line = instruction->line;
+
+        if (isJump(instruction->op)) {
+            int end = offsets[i] + encodedLength(instruction);
+            int target = offsets[instruction->operand];
+            bool isLong = instruction->isLong;
+            int distance;
+            uint8_t op;
+            if (instruction->op == OP_GUARD_CALLEE) {
+                distance = target - end;
+                op = isLong ? OP_GUARD_CALLEE_LONG : OP_GUARD_CALLEE;
+            } else if (target >= end) {
+                distance = target - end;
+                if (instruction->op == OP_JUMP) op = isLong ? OP_JUMP_LONG : OP_JUMP;
+                else op = isLong ? OP_JUMP_IF_FALSE_LONG : OP_JUMP_IF_FALSE;
+            } else {
+                distance = end - target;
+                op = isLong ? OP_LOOP_LONG : OP_LOOP;
+            }
+
+            writeChunk(out, op, line);
+            if (instruction->op == OP_GUARD_CALLEE) {
+                writeChunk(out, instruction->guardSlot, line);
+                writeChunk(out, (instruction->guardConstant >> 16) & 0xff, line);
+                writeChunk(out, (instruction->guardConstant >> 8) & 0xff, line);
+                writeChunk(out, instruction->guardConstant & 0xff, line);
+            }
+            if (isLong) writeChunk(out, (distance >> 16) & 0xff, line);
+            writeChunk(out, (distance >> 8) & 0xff, line);
+            writeChunk(out, distance & 0xff, line);
+        } else {
+            int operandBytes = operandLength(instruction->op);
+            writeChunk(out, instruction->op, line);
+            for (int shift = (operandBytes - 1) * 8; shift >= 0; shift -= 8) {
+                writeChunk(out, (instruction->operand >> shift) & 0xff, line);
+            }
+            //the upvalue pairs of a closure are copied over as they were
+            for (int b = 1 + operandBytes; b < encodedLength(instruction); b++) {
+                writeChunk(out, chunk->code[instruction->offset + b], line);
+            }
+        }
+    }
+}
+
+/*How many values the instruction leaves on the stack minus how many it takes. Ones that
+only peek at the top (OP_SET_LOCAL, OP_JUMP_IF_FALSE...) change nothing*/
+static int stackChange(Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+        case OP_NIL:
+        case OP_TRUE:
+        case OP_FALSE:
+        case OP_GET_LOCAL:
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            return 1;
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_RETURN:
+        case OP_CLOSE_UPVALUE:
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_ADD_NUMBER:
+        case OP_ADD_STRING:
+        case OP_SUBTRACT_NUMBER:
+        case OP_MULTIPLY_NUMBER:
+        case OP_DIVIDE_NUMBER:
+        case OP_GREATER_NUMBER:
+        case OP_LESS_NUMBER:
+        case OP_GREATER_EQUAL_NUMBER:
+        case OP_LESS_EQUAL_NUMBER:
+        case OP_GET_INDEX:
+            return -1;
+        case OP_SET_INDEX:
+            return -2;
+        case OP_POPN:
+            return -instruction->operand;
+        case OP_BUILD_MAP:
+            return 1 - instruction->operand * 2;
+        case OP_CALL:
+            return -instruction->operand;
+        default:
+            return 0;
+    }
+}
+
+/*The highest the stack gets above where the frame starts out. The height in front of
+each instruction comes from the one before it or from a jump to it, whichever is
+higher, so unreachable code still counts and a disagreement can only overestimate*/
+static int measureStack(InstructionList* list) {
+    int* heights = ALLOCATE(int, list->count);
+    for (int i = 0; i < list->count; i++) heights[i] = 0;
+    int height = 0;
+    int highest = 0;
+    bool fallsThrough = true;
+    for (int i = 0; i < list->count; i++) {
+        Instruction* instruction = &list->code[i];
+        if (instruction->removed) continue;
+        if (!fallsThrough || heights[i] > height) height = heights[i];
+
+        int change = stackChange(instruction);
+        //OP_CALL and OP_BUILD_MAP reach their peak before they pop anything
+        if (height > highest) highest = height;
+        height += change;
+        if (height < 0) height = 0;
+        if (height > highest) highest = height;
+
+        if (isJump(instruction->op) && instruction->operand > i &&
+            instruction->operand < list->count && heights[instruction->operand] < height) {
+            heights[instruction->operand] = height;
+        }
+        fallsThrough = instruction->op != OP_JUMP && instruction->op != OP_RETURN;
+    }
+    FREE_ARRAY(int, heights, list->count);
+    return highest;
+}
+
+bool encodeChunk(Chunk* chunk, InstructionList* list) {
+    markTargets(list);
+    int* offsets = ALLOCATE(int, list->count + 1);
+    bool fits = layout(list, offsets);
+    if (fits) {
+        Chunk out;
+        initChunk(&out);
+        emit(chunk, list, offsets, &out);
+
+        FREE_ARRAY(uint8_t, chunk->code, chunk->capacity);
+        FREE_ARRAY(uint8_t, chunk->lines.bytes, chunk->lines.capacity);
+        FREE_ARRAY(LineCheckpoint, chunk->lines.checkpoints, chunk->lines.checkpointCapacity);
+        chunk->code = out.code;
+        chunk->lines = out.lines;
+        chunk->count = out.count;
+        chunk->capacity = out.capacity;
+        chunk->stackSize = measureStack(list);
+    }
+    FREE_ARRAY(int, offsets, list->count + 1);
+    return fits;
+}
+
+bool optimizeChunk(Chunk* chunk) {
+    InstructionList list;
+    decodeChunk(chunk, &list);
+
+    //each rewrite can open up another one (a removed jump leaves two pops next to
+    //each other, a threaded jump leaves its old landing spot unreachable)
+    bool changed;
+    do {
+        changed = false;
+        markTargets(&list);
+        changed |= threadJumps(&list);
+        changed |= removeEmptyJumps(&list);
+        changed |= removeUnreachable(&list);
+        markTargets(&list);
+        changed |= fuseComparisons(&list);
+        changed |= mergePops(&list);
+    } while (changed);
+
+    bool fits = encodeChunk(chunk, &list);
+    freeInstructionList(&list);
+    return fits;
+}
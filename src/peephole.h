@@ -0,0 +1,55 @@
+/*Peephole pass the compiler runs over every finished chunk. It fuses negated
+comparisons, threads jump chains, drops unreachable code, batches pops and picks
+the short or long form of every jump*/
+
+#ifndef cpandi_peephole_h
+#define cpandi_peephole_h
+
+#include "chunk.h"
+
+/*A decoded instruction. A jump stores the index of the instruction it lands on instead
+of a byte offset, so instructions can be rewritten or removed without fixing up every
+jump by hand. Forward and backward jumps are both kept as OP_JUMP, the direction (and
+the short or long form) is only decided when the code is written back out. The same
+goes for OP_GUARD_CALLEE, which is a conditional forward jump*/
+typedef struct {
+    uint8_t op;
+    //constant index, slot, count, or jump target
+    int operand;
+    int line;
+    //where the instruction sat in the chunk it was decoded from (-1 for new ones),
+    //a closure's upvalue pairs are copied from there
+    int offset;
+    int length;
+    //OP_GUARD_CALLEE also carries the slot it checks and the function expected there
+    int guardSlot;
+    int guardConstant;
+    bool isTarget;
+    bool removed;
+    bool isLong;
+} Instruction;
+
+typedef struct {
+    Instruction* code;
+    int count;
+    int capacity;
+} InstructionList;
+
+void initInstructionList(InstructionList* list);
+void freeInstructionList(InstructionList* list);
+
+/*Appends an instruction and returns its index*/
+int writeInstruction(InstructionList* list, uint8_t op, int operand, int line);
+
+/*Splits the chunk's code into a list of instructions*/
+void decodeChunk(Chunk* chunk, InstructionList* list);
+
+/*Writes the list (decoded from this chunk) back as the chunk's code and lines, skipping
+removed instructions, and measures its stackSize. Returns false and leaves the chunk
+alone if a jump doesn't fit*/
+bool encodeChunk(Chunk* chunk, InstructionList* list);
+
+/*Runs the whole pass: decode, rewrite, encode. The constant pool is left alone*/
+bool optimizeChunk(Chunk* chunk);
+
+#endif
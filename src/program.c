@@ -0,0 +1,31 @@
+#include "compiler.h"
+#include "memory.h"
+#include "program.h"
+
+Program* compileProgram(const char* path, const char* source, size_t length) {
+    Program* program = ALLOCATE(Program, 1);
+    initObjectArena(&program->heap);
+
+    //there's no VM, the objects and interned strings all go into the program's heap.
+    //Nothing is lazy since a body compiled on its first call would be written into
+    //a function other threads are running
+    useObjectArena(&program->heap);
+    program->function = compile(NULL, path, source, length, false);
+    useObjectArena(NULL);
+    if (program->function == NULL) {
+        freeProgram(program);
+        return NULL;
+    }
+
+    //the optimizing tier rewrites chunks in place, so it has to leave these alone
+    for (Obj* object = program->heap.objects; object != NULL; object = object->next) {
+        if (object->type == OBJ_FUNCTION) ((ObjFunction*)object)->isOptimized = true;
+    }
+    return program;
+}
+
+void freeProgram(Program* program) {
+    sweepObjects(program->heap.objects);
+    freeTable(&program->heap.strings);
+    FREE(Program, program);
+}
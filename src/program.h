@@ -0,0 +1,24 @@
+#ifndef cpandi_program_h
+#define cpandi_program_h
+
+#include "object.h"
+
+/*A script compiled once and frozen, so any number of VMs on any threads can run it at
+the same time without copying or locking. The functions, their chunks and the constant
+strings (hashes included) belong to the program and are never written again, each VM
+only keeps its own globals, stack and heap*/
+typedef struct {
+    ObjFunction* function;
+    //everything the compile allocated, with the strings it interned
+    ObjectArena heap;
+} Program;
+
+/*Compiles the source into a program, NULL on a compile error, which is reported with the
+path. Every function is compiled right away, so the source isn't needed once this
+returns*/
+Program* compileProgram(const char* path, const char* source, size_t length);
+
+/*No VM may be running the program or holding on to any of its values anymore*/
+void freeProgram(Program* program);
+
+#endif
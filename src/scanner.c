@@ -3,24 +3,25 @@
 
 #include "common.h"
 #include "scanner.h"
+#include "simd.h"
 
 
-typedef struct {
-    //The beginning of the current lexeme being scanned
-    const char* start;
-    //the current position for the scanner
-    const char* current;
-    //What line the current lexeme is on !!!
-    int line;
-} Scanner;
-
-Scanner scanner;
+static THREAD_LOCAL Scanner scanner;
 
 
-void initScanner(const char* source) {
+void initScanner(const char* source, size_t length, int line) {
     scanner.start = source;
     scanner.current = source;
-    scanner.line = 1;
+    scanner.end = source + length;
+    scanner.line = line;
+}
+
+Scanner saveScanner() {
+    return scanner;
+}
+
+void restoreScanner(Scanner saved) {
+    scanner = saved;
 }
 
 //checks if the given character is an alphabet !
@@ -41,18 +42,20 @@ static char advance() {
     return scanner.current[-1];
 }
 
-static char peek() {
-    return *scanner.current;
-}
-
 static bool isAtEnd() {
     //Return if the current position of the scanner is at the end 
-    // Note that the end of the scanner is always '\0'
-    return *scanner.current == '\0';
+    // Note that the source may be a mapped file with no '\0' after it
+    return scanner.current >= scanner.end;
 }
 
-static char peekNext() {
+/*Past the end peek gives '\0', so the loops below stop there without their own check*/
+static char peek() {
     if (isAtEnd()) return '\0';
+    return *scanner.current;
+}
+
+static char peekNext() {
+    if (scanner.end - scanner.current < 2) return '\0';
     //return the current + 1 position !!!!
     return scanner.current[1];
 }
@@ -96,93 +99,76 @@ static void skipWhitespace() {
     //Why the for loop ?
     // helps skip all the white spaces :)
     for (;;) {
+        //runs of blanks, tabs and newlines go by a whole vector at a time, the call
+        //is only worth it when there's some whitespace at all
         char c = peek();
-        switch(c) {
-            //Skip all whitespace and tabs !
-            case ' ':
-            case '\r':
-            case '\t':
-            //Advance to the next character !
-                advance();
-                break;
-            case '\n':
-                //increment the line number
-                scanner.line++;
-                advance();
-                break;
-            case '/':
-                if (peekNext() == '/') {
-                    //A comment goes all the way to end !
-                    while (peek() != '\n' && !isAtEnd()) advance();
-                } else {
-                    return;
-                }
-                break;
-            //default -> in case the next character is not wp -> skip and return
-            default:
-                return;
+        if (c == ' ' || c == '\t' || c == '\r' || c == '\n') {
+            scanner.current = simdSkipWhitespace(scanner.current, scanner.end, &scanner.line);
+        }
+        if (peek() == '/' && peekNext() == '/') {
+            //A comment goes all the way to end ! The newline is skipped next time round
+            scanner.current = simdFindNewline(scanner.current, scanner.end);
+        } else {
+            //default -> in case the next character is not wp -> return
+            return;
         }
     }
 }
 
-static TokenType checkKeyword(int start, int length, const char* rest, TokenType type) {
-    //the function checks two things
-    //1) If the length of the token matches the keyword's length !
-    //2) If the memory block matches the remaining keyword (memcmp) !!!
-    if (scanner.current - scanner.start == start + length && memcmp(scanner.start + start, rest, length)==0) {
-        return type;
-    }
-    //return the identifier
-    return TOKEN_IDENTIFIER;
-
-}
-
-
-
+typedef struct {
+    const char* name;
+    int length;
+    TokenType type;
+} Keyword;
+
+/*A perfect hash of the keywords, built from the first and last letter and the length.
+No two keywords land in the same slot, so one memcmp tells a keyword from an
+identifier. The slots have to be worked out again whenever a keyword is added*/
+#define KEYWORD_HASH(start, length) \
+    (((unsigned char)(start)[0] + 5 * (unsigned char)(start)[(length) - 1] + (length)) & 31)
+
+static const Keyword keywords[32] = {
+    [2] = {"else", 4, TOKEN_ELSE},
+    [3] = {"for", 3, TOKEN_FOR},
+    [4] = {"false", 5, TOKEN_FALSE},
+    [7] = {"class", 5, TOKEN_CLASS},
+    [9] = {"if", 2, TOKEN_IF},
+    [11] = {"or", 2, TOKEN_OR},
+    [13] = {"nil", 3, TOKEN_NIL},
+    [15] = {"fun", 3, TOKEN_FUN},
+    [17] = {"true", 4, TOKEN_TRUE},
+    [18] = {"super", 5, TOKEN_SUPER},
+    [19] = {"var", 3, TOKEN_VAR},
+    [21] = {"while", 5, TOKEN_WHILE},
+    [23] = {"this", 4, TOKEN_THIS},
+    [24] = {"and", 3, TOKEN_AND},
+    [25] = {"print", 5, TOKEN_PRINT},
+    [30] = {"return", 6, TOKEN_RETURN},
+};
 
 static TokenType identifierType() {
-    
-    //This works like a trie where the letters are checked
-    //if the first char is a then check -> the remaining characters are nd...and so on !
-    switch (scanner.start[0]) {
-        case 'a': return checkKeyword(1, 2, "nd", TOKEN_AND);
-        case 'c': return checkKeyword(1, 4, "lass", TOKEN_CLASS);
-        case 'e': return checkKeyword(1, 3, "lse", TOKEN_ELSE);
-        //Since the words false, for and fun all start with s
-        //we manager this with checking the second alphabet.
-        case 'f':
-            if (scanner.current - scanner.start > 1) {
-                switch(scanner.start[1]) {
-                    case 'a': return checkKeyword(2, 3, "lse", TOKEN_FALSE);
-                    case 'o': return checkKeyword(2, 1, "r", TOKEN_FOR);
-                    case 'u': return checkKeyword(2, 1, "n", TOKEN_FUN);
-                }
-            } break;
-        case 'i': return checkKeyword(1, 1, "f", TOKEN_IF);
-        case 'n': return checkKeyword(1, 2, "il", TOKEN_NIL);
-        case 'o': return checkKeyword(1, 1, "r", TOKEN_OR);
-        case 'p': return checkKeyword(1, 4, "rint", TOKEN_PRINT);
-        case 'r': return checkKeyword(1, 5, "eturn", TOKEN_RETURN);
-        case 's': return checkKeyword(1, 4, "uper", TOKEN_SUPER);
-        case 't':
-            if (scanner.current - scanner.start > 1) {
-                switch (scanner.start[1]) {
-                    case 'h': return checkKeyword(2, 2, "is", TOKEN_THIS);
-                    case 'r': return checkKeyword(2, 2, "ue", TOKEN_TRUE);
-                }
-            } break;
-        case 'v': return checkKeyword(1, 2, "ar", TOKEN_VAR);
-        case 'w': return checkKeyword(1, 4, "hile", TOKEN_WHILE);
+    int length = (int)(scanner.current - scanner.start);
+    //keywords are two to six letters long
+    if (length < 2 || length > 6) return TOKEN_IDENTIFIER;
+    const Keyword* keyword = &keywords[KEYWORD_HASH(scanner.start, length)];
+    if (keyword->length == length && memcmp(scanner.start, keyword->name, length) == 0) {
+        return keyword->type;
     }
-
-
     return TOKEN_IDENTIFIER;
 }
 
-
+/*Most names are over before a vector load would pay off, only the long ones (which
+generated code is full of) are handed to the vector kernel*/
+#define LONG_IDENTIFIER 8
 
 static Token identifier() {
-  while (isAlpha(peek()) || isDigit(peek())) advance();
+  while (isAlpha(peek()) || isDigit(peek())) {
+    advance();
+    if (scanner.current - scanner.start == LONG_IDENTIFIER) {
+      scanner.current = simdSkipIdentifier(scanner.current, scanner.end);
+      break;
+    }
+  }
   return makeToken(identifierType());
 }
 
@@ -202,10 +188,7 @@ static Token number() {
 }
 
 static Token string() {
-    while (peek() != '"' && !isAtEnd()) {
-        if (peek() == '\n') scanner.line++;
-        advance();
-    }
+    scanner.current = simdFindQuote(scanner.current, scanner.end, &scanner.line);
 
     if (isAtEnd()) return errorToken("Unterminated string");
 
@@ -242,7 +225,13 @@ Token scanToken() {
         case '{':
             return makeToken(TOKEN_LEFT_BRACE);
         case '}':
-            return makeToken(TOKEN_RIGHT_PAREN);
+            return makeToken(TOKEN_RIGHT_BRACE);
+        case '[':
+            return makeToken(TOKEN_LEFT_BRACKET);
+        case ']':
+            return makeToken(TOKEN_RIGHT_BRACKET);
+        case ':':
+            return makeToken(TOKEN_COLON);
         case ';':
             return makeToken(TOKEN_SEMICOLON);
         case ',':
@@ -1,12 +1,15 @@
 #ifndef cpandi_scanner_h
 #define cpandi_scanner_h
 
+#include <stddef.h>
+
 /*Enum for tokentype*/
 typedef enum {
   // Single-character tokens.
   TOKEN_LEFT_PAREN, TOKEN_RIGHT_PAREN,
   TOKEN_LEFT_BRACE, TOKEN_RIGHT_BRACE,
-  TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
+  TOKEN_LEFT_BRACKET, TOKEN_RIGHT_BRACKET,
+  TOKEN_COLON, TOKEN_COMMA, TOKEN_DOT, TOKEN_MINUS, TOKEN_PLUS,
   TOKEN_SEMICOLON, TOKEN_SLASH, TOKEN_STAR,
   // One or two character tokens.
   TOKEN_BANG, TOKEN_BANG_EQUAL,
@@ -33,10 +36,27 @@ typedef struct {
     int line;
 } Token;
 
-/*The initializer sets all the parameter to the source and line to 1*/
-void initScanner(const char* source);
+typedef struct {
+    //The beginning of the current lexeme being scanned
+    const char* start;
+    //the current position for the scanner
+    const char* current;
+    //one past the last character, the source needn't be '\0' terminated
+    const char* end;
+    //What line the current lexeme is on !!!
+    int line;
+} Scanner;
+
+/*The initializer sets all the parameter to the source, line is where the source
+starts (a lazily compiled function starts partway into its file). Tokens point
+straight into the source, so it has to outlive them*/
+void initScanner(const char* source, size_t length, int line);
 
 /*Scans the tokens*/
 Token scanToken();
 
+/*Saving and restoring the scanner lets the compiler look ahead without consuming tokens*/
+Scanner saveScanner();
+void restoreScanner(Scanner saved);
+
 #endif
\ No newline at end of file
@@ -0,0 +1,484 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+#include <time.h>
+#include <unistd.h>
+
+#include "memory.h"
+#include "scheduler.h"
+#include "transfer.h"
+
+/*Tasks in a ring buffer behind a lock. A worker pushes and pops its own at the back, so
+the newest (smallest) piece of a split runs next while its data is still warm, thieves
+take the oldest from the front, which tends to be the biggest piece left*/
+typedef struct {
+    pthread_mutex_t lock;
+    ObjTask** tasks;
+    int start;
+    int count;
+    int capacity;
+} TaskQueue;
+
+struct Worker {
+    TaskPool* pool;
+    int index;
+    VM vm;
+    pthread_t thread;
+    bool started;
+    TaskQueue deque;
+    //tasks other workers finished while a fiber of this one waited on them, the worker
+    //readies the joiners itself since only it touches its VM
+    TaskQueue woken;
+    //set while the worker may be blocked in its event loop, spawns wake it through the
+    //loop's eventfd
+    atomic_bool idle;
+    //finished task fibers, whose stacks and frames the next tasks reuse
+    ObjFiber** spareFibers;
+    int spareCount;
+    int spareCapacity;
+    //picks where stealing starts
+    uint32_t random;
+    atomic_long tasks;
+    atomic_long steals;
+    atomic_llong idleMicroseconds;
+};
+
+struct TaskPool {
+    //the VM that started the pool, it blocks in taskJoin() instead of running tasks
+    VM* vm;
+    Worker* workers;
+    int workerCount;
+    //where that VM's tasks go, any worker takes them
+    TaskQueue queue;
+    //the globals the workers got, the functions that VM can spawn
+    Table globals;
+    pthread_mutex_t lock;
+    pthread_cond_t done;
+    atomic_bool stopping;
+    atomic_bool failed;
+    double startTime;
+};
+
+static double now() {
+    struct timespec time;
+    clock_gettime(CLOCK_MONOTONIC, &time);
+    return time.tv_sec * 1000.0 + time.tv_nsec / 1000000.0;
+}
+
+static void initQueue(TaskQueue* queue) {
+    pthread_mutex_init(&queue->lock, NULL);
+    queue->tasks = NULL;
+    queue->start = 0;
+    queue->count = 0;
+    queue->capacity = 0;
+}
+
+static void freeQueue(TaskQueue* queue) {
+    FREE_ARRAY(ObjTask*, queue->tasks, queue->capacity);
+    pthread_mutex_destroy(&queue->lock);
+}
+
+static void pushTask(TaskQueue* queue, ObjTask* task) {
+    pthread_mutex_lock(&queue->lock);
+    if (queue->capacity < queue->count + 1) {
+        int oldCapacity = queue->capacity;
+        queue->capacity = GROW_CAPACITY(oldCapacity);
+        queue->tasks = GROW_ARRAY(ObjTask*, queue->tasks, oldCapacity, queue->capacity);
+        //the part that wrapped around the end moves behind the old end
+        int wrapped = queue->start + queue->count - oldCapacity;
+        if (wrapped > 0) {
+            memcpy(&queue->tasks[oldCapacity], queue->tasks, sizeof(ObjTask*) * wrapped);
+        }
+    }
+    queue->tasks[(queue->start + queue->count) % queue->capacity] = task;
+    queue->count++;
+    pthread_mutex_unlock(&queue->lock);
+}
+
+static ObjTask* popNewest(TaskQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    ObjTask* task = NULL;
+    if (queue->count > 0) {
+        queue->count--;
+        task = queue->tasks[(queue->start + queue->count) % queue->capacity];
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+static ObjTask* popOldest(TaskQueue* queue) {
+    pthread_mutex_lock(&queue->lock);
+    ObjTask* task = NULL;
+    if (queue->count > 0) {
+        task = queue->tasks[queue->start];
+        queue->start = (queue->start + 1) % queue->capacity;
+        queue->count--;
+    }
+    pthread_mutex_unlock(&queue->lock);
+    return task;
+}
+
+/*Wakes the worker if it's idle. The fence orders the push the caller just made before
+reading the flag, the worker sets the flag before looking at the queues a last time, so
+one of the two always sees the other*/
+static void wakeIdleWorker(Worker* worker) {
+    atomic_thread_fence(memory_order_seq_cst);
+    if (atomic_exchange(&worker->idle, false)) wakeEventLoop(&worker->vm.loop);
+}
+
+/*A new task wakes one idle worker, a busy one finds it on its own*/
+static void wakeAnyWorker(TaskPool* pool) {
+    atomic_thread_fence(memory_order_seq_cst);
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        if (atomic_exchange(&worker->idle, false)) {
+            wakeEventLoop(&worker->vm.loop);
+            return;
+        }
+    }
+}
+
+/*Stops every worker and lets a VM blocked in taskJoin() know*/
+static void failPool(TaskPool* pool) {
+    atomic_store(&pool->failed, true);
+    pthread_mutex_lock(&pool->lock);
+    pthread_cond_broadcast(&pool->done);
+    pthread_mutex_unlock(&pool->lock);
+    for (int i = 0; i < pool->workerCount; i++) wakeEventLoop(&pool->workers[i].vm.loop);
+}
+
+static void* runWorker(void* argument) {
+    Worker* worker = (Worker*)argument;
+    //the error was reported already, a worker stopped by the pool ends up here too
+    if (runEventLoop(&worker->vm) != INTERPRET_OK && !atomic_load(&worker->pool->stopping)) {
+        failPool(worker->pool);
+    }
+    return NULL;
+}
+
+static int workerCount() {
+    long cores = sysconf(_SC_NPROCESSORS_ONLN);
+    int workers = cores > 0 ? (int)cores : 1;
+    return workers > MAX_TASK_WORKERS ? MAX_TASK_WORKERS : workers;
+}
+
+/*The worker VMs are set up on the calling thread, which is stopped in taskSpawn() so its
+globals can be copied into each of them*/
+static TaskPool* startTaskPool(VM* vm) {
+    TaskPool* pool = ALLOCATE(TaskPool, 1);
+    pool->vm = vm;
+    pool->workerCount = workerCount();
+    pool->workers = ALLOCATE(Worker, pool->workerCount);
+    initQueue(&pool->queue);
+    initTable(&pool->globals);
+    tableAddAll(&vm->globals, &pool->globals);
+    pthread_mutex_init(&pool->lock, NULL);
+    pthread_cond_init(&pool->done, NULL);
+    atomic_init(&pool->stopping, false);
+    atomic_init(&pool->failed, false);
+    pool->startTime = now();
+
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        worker->pool = pool;
+        worker->index = i;
+        worker->started = false;
+        initQueue(&worker->deque);
+        initQueue(&worker->woken);
+        atomic_init(&worker->idle, false);
+        worker->spareFibers = NULL;
+        worker->spareCount = 0;
+        worker->spareCapacity = 0;
+        worker->random = (uint32_t)i * 2654435761u + 1;
+        atomic_init(&worker->tasks, 0);
+        atomic_init(&worker->steals, 0);
+        atomic_init(&worker->idleMicroseconds, 0);
+
+        initVM(&worker->vm);
+        worker->vm.optimize = vm->optimize;
+        worker->vm.loop.worker = worker;
+        Transfer transfer;
+        initTransfer(&transfer, &worker->vm);
+        transferTable(&transfer, &vm->globals, &worker->vm.globals);
+        freeTransfer(&transfer);
+    }
+
+    int started = 0;
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        if (!addWakeFd(&worker->vm.loop)) continue;
+        worker->started = pthread_create(&worker->thread, NULL, runWorker, worker) == 0;
+        if (worker->started) started++;
+    }
+    //nothing would ever run the tasks
+    if (started == 0) atomic_store(&pool->failed, true);
+    return pool;
+}
+
+/*Whether the function is the global under its name, the way a worker finds it again*/
+static bool isGlobalFunction(Table* globals, Value function, ObjString* name) {
+    Value global;
+    return name != NULL && tableGet(globals, OBJ_VAL(name), &global) &&
+           valuesEqual(global, function);
+}
+
+ObjTask* spawnTask(VM* vm, Value function, Value argument) {
+    Worker* worker = vm->loop.worker;
+    TaskPool* pool = worker != NULL ? worker->pool : vm->tasks;
+    ObjString* name = IS_CLOSURE(function) ? AS_CLOSURE(function)->function->name :
+                                             AS_FUNCTION(function)->name;
+    Table* globals = worker != NULL || pool == NULL ? &vm->globals : &pool->globals;
+    if (!isGlobalFunction(globals, function, name)) {
+        runtimeError(vm, "taskSpawn() function must be a global defined before the first "
+                     "taskSpawn().");
+        return NULL;
+    }
+    if (pool != NULL && atomic_load(&pool->failed)) {
+        runtimeError(vm, "The task pool stopped after a task failed.");
+        return NULL;
+    }
+
+    ObjTask* task = newTask(vm, function, name);
+    if (!packValue(&task->argument, argument)) {
+        runtimeError(vm, "taskSpawn() can't move a fiber or task to another VM.");
+        return NULL;
+    }
+    if (pool == NULL) pool = vm->tasks = startTaskPool(vm);
+    pushTask(worker != NULL ? &worker->deque : &pool->queue, task);
+    wakeAnyWorker(pool);
+    return task;
+}
+
+/*The joining VM's copy of the result*/
+static Value receiveResult(VM* vm, ObjTask* task) {
+    if (task->resultPacked) {
+        task->result = unpackValue(vm, &task->packedResult);
+        task->resultPacked = false;
+        freeParcel(&task->packedResult);
+    }
+    return task->result;
+}
+
+bool takeTaskResult(VM* vm, ObjTask* task, Value* result) {
+    if (atomic_load(&task->state) != TASK_DONE) return false;
+    *result = receiveResult(vm, task);
+    return true;
+}
+
+bool parkOnTask(VM* vm, ObjTask* task) {
+    task->joiner = vm->fiber;
+    int expected = TASK_PENDING;
+    if (!atomic_compare_exchange_strong(&task->state, &expected, TASK_WAITING)) return false;
+    vm->fiber->waiting = true;
+    return true;
+}
+
+bool waitForTask(VM* vm, ObjTask* task) {
+    TaskPool* pool = vm->tasks;
+    int expected = TASK_PENDING;
+    atomic_compare_exchange_strong(&task->state, &expected, TASK_WAITING);
+    pthread_mutex_lock(&pool->lock);
+    while (atomic_load(&task->state) != TASK_DONE && !atomic_load(&pool->failed)) {
+        pthread_cond_wait(&pool->done, &pool->lock);
+    }
+    pthread_mutex_unlock(&pool->lock);
+    return atomic_load(&task->state) == TASK_DONE;
+}
+
+bool finishTask(VM* vm, ObjTask* task, Value result) {
+    if (task->vm == vm) {
+        task->result = result;
+    } else if (packValue(&task->packedResult, result)) {
+        task->resultPacked = true;
+    } else {
+        runtimeError(vm, "A task can't return a fiber or task to another VM.");
+        return false;
+    }
+
+    //everything above is published by the exchange, the joiner reads it after it sees
+    //the task done
+    if (atomic_exchange(&task->state, TASK_DONE) != TASK_WAITING) return true;
+    if (task->joiner == NULL) {
+        //a VM that isn't a worker blocks in waitForTask()
+        TaskPool* pool = vm->loop.worker->pool;
+        pthread_mutex_lock(&pool->lock);
+        pthread_cond_broadcast(&pool->done);
+        pthread_mutex_unlock(&pool->lock);
+    } else if (task->vm == vm) {
+        scheduleFiber(&vm->loop, task->joiner, receiveResult(vm, task));
+    } else {
+        Worker* owner = task->vm->loop.worker;
+        pushTask(&owner->woken, task);
+        wakeIdleWorker(owner);
+    }
+    return true;
+}
+
+void recycleTaskFiber(VM* vm, ObjFiber* fiber) {
+    Worker* worker = vm->loop.worker;
+    fiber->task = NULL;
+    fiber->function = NIL_VAL;
+    fiber->frameCount = 0;
+    fiber->stackTop = fiber->stack;
+    fiber->openUpvalues = NULL;
+    if (worker->spareCapacity < worker->spareCount + 1) {
+        int oldCapacity = worker->spareCapacity;
+        worker->spareCapacity = GROW_CAPACITY(oldCapacity);
+        worker->spareFibers = GROW_ARRAY(ObjFiber*, worker->spareFibers, oldCapacity,
+                                         worker->spareCapacity);
+    }
+    worker->spareFibers[worker->spareCount++] = fiber;
+}
+
+/*Another worker's oldest task, trying them all from a random one on*/
+static ObjTask* stealTask(Worker* worker) {
+    TaskPool* pool = worker->pool;
+    worker->random ^= worker->random << 13;
+    worker->random ^= worker->random >> 17;
+    worker->random ^= worker->random << 5;
+    int first = (int)(worker->random % (uint32_t)pool->workerCount);
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* victim = &pool->workers[(first + i) % pool->workerCount];
+        if (victim == worker) continue;
+        ObjTask* task = popOldest(&victim->deque);
+        if (task != NULL) {
+            atomic_fetch_add_explicit(&worker->steals, 1, memory_order_relaxed);
+            return task;
+        }
+    }
+    return NULL;
+}
+
+/*Queues a fiber that calls the task's function. A task from another VM gets the
+function this worker has under the same name*/
+static bool startTask(VM* vm, Worker* worker, ObjTask* task) {
+    Value function = task->function;
+    if (task->vm != vm) {
+        ObjString* name = tableFindString(&vm->strings, task->name->chars, task->name->length,
+                                          task->name->hash);
+        Value global;
+        if (name == NULL || !tableGet(&vm->globals, OBJ_VAL(name), &global) ||
+            (!IS_CLOSURE(global) && !IS_FUNCTION(global)) ||
+            (IS_CLOSURE(global) ? AS_CLOSURE(global)->function : AS_FUNCTION(global))->arity > 1) {
+            //nothing on this worker's stack failed, so there's no trace to print
+            fprintf(stderr, "Task function %s() is no longer a global on worker %d.\n",
+                    task->name->chars, worker->index);
+            failPool(worker->pool);
+            return false;
+        }
+        function = global;
+    }
+    Value argument = unpackValue(vm, &task->argument);
+    freeParcel(&task->argument);
+
+    ObjFiber* fiber;
+    if (worker->spareCount > 0) {
+        fiber = worker->spareFibers[--worker->spareCount];
+        fiber->function = function;
+        fiber->done = false;
+    } else {
+        fiber = newFiber(vm, function);
+    }
+    fiber->task = task;
+    scheduleFiber(&vm->loop, fiber, argument);
+    atomic_fetch_add_explicit(&worker->tasks, 1, memory_order_relaxed);
+    return true;
+}
+
+bool findWork(VM* vm) {
+    Worker* worker = vm->loop.worker;
+    TaskPool* pool = worker->pool;
+    //the second pass runs after announcing the worker idle, anything pushed in between
+    //is either found there or wakes the worker
+    for (int pass = 0; pass < 2; pass++) {
+        if (workerStopping(worker)) return false;
+        bool woke = false;
+        ObjTask* task;
+        while ((task = popOldest(&worker->woken)) != NULL) {
+            scheduleFiber(&vm->loop, task->joiner, receiveResult(vm, task));
+            woke = true;
+        }
+        if (woke) {
+            atomic_store(&worker->idle, false);
+            return true;
+        }
+
+        task = popNewest(&worker->deque);
+        if (task == NULL) task = stealTask(worker);
+        if (task == NULL) task = popOldest(&pool->queue);
+        if (task != NULL) {
+            atomic_store(&worker->idle, false);
+            return startTask(vm, worker, task);
+        }
+        atomic_store(&worker->idle, true);
+        atomic_thread_fence(memory_order_seq_cst);
+    }
+    return false;
+}
+
+bool workerStopping(Worker* worker) {
+    return atomic_load(&worker->pool->stopping) || atomic_load(&worker->pool->failed);
+}
+
+void workerIdled(Worker* worker, double milliseconds) {
+    //it's running fibers again, spawns should wake some other worker
+    atomic_store(&worker->idle, false);
+    atomic_fetch_add_explicit(&worker->idleMicroseconds, (long long)(milliseconds * 1000),
+                              memory_order_relaxed);
+}
+
+static void setStat(VM* vm, ObjMap* map, const char* name, double value) {
+    ObjString* key = copyString(vm, name, (int)strlen(name));
+    mapSet(map, OBJ_VAL(key), NUMBER_VAL(value));
+}
+
+ObjMap* taskStats(VM* vm) {
+    ObjMap* stats = newMap(vm);
+    TaskPool* pool = vm->loop.worker != NULL ? vm->loop.worker->pool : vm->tasks;
+    if (pool == NULL) return stats;
+
+    double elapsed = (now() - pool->startTime) / 1000.0;
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        double idle = atomic_load(&worker->idleMicroseconds) / 1000000.0;
+        double busy = elapsed > idle ? elapsed - idle : 0;
+        ObjMap* map = newMap(vm);
+        setStat(vm, map, "tasks", (double)atomic_load(&worker->tasks));
+        setStat(vm, map, "steals", (double)atomic_load(&worker->steals));
+        setStat(vm, map, "busy", busy);
+        setStat(vm, map, "utilization", elapsed > 0 ? busy / elapsed : 0);
+        mapSet(stats, NUMBER_VAL(i), OBJ_VAL(map));
+    }
+    return stats;
+}
+
+void freeTaskPool(VM* vm) {
+    TaskPool* pool = vm->tasks;
+    if (pool == NULL) return;
+    vm->tasks = NULL;
+    //workers in the middle of a task stop at its next wait
+    atomic_store(&pool->stopping, true);
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        if (worker->started) wakeEventLoop(&worker->vm.loop);
+    }
+    for (int i = 0; i < pool->workerCount; i++) {
+        if (pool->workers[i].started) pthread_join(pool->workers[i].thread, NULL);
+    }
+
+    //tasks and fibers are objects of the VMs, the queues only point at them
+    for (int i = 0; i < pool->workerCount; i++) {
+        Worker* worker = &pool->workers[i];
+        freeVM(&worker->vm);
+        freeQueue(&worker->deque);
+        freeQueue(&worker->woken);
+        FREE_ARRAY(ObjFiber*, worker->spareFibers, worker->spareCapacity);
+    }
+    freeQueue(&pool->queue);
+    freeTable(&pool->globals);
+    pthread_mutex_destroy(&pool->lock);
+    pthread_cond_destroy(&pool->done);
+    FREE_ARRAY(Worker, pool->workers, pool->workerCount);
+    FREE(TaskPool, pool);
+}
@@ -0,0 +1,57 @@
+#ifndef cpandi_scheduler_h
+#define cpandi_scheduler_h
+
+#include "vm.h"
+
+/*Upper bound on task pool workers, a pool has one per core*/
+#define MAX_TASK_WORKERS 16
+
+/*Worker threads that each run their own VM and share the tasks spawned into the pool.
+A worker keeps the tasks it spawns in its own deque and runs the newest first, one with
+nothing to do steals the oldest from another worker. The VM that started the pool hands
+its tasks over through a shared queue*/
+typedef struct TaskPool TaskPool;
+typedef struct Worker Worker;
+
+/*Hands a call of the function to the pool, starting the pool on the first spawn of a VM
+that isn't a worker. The function has to be a top level one the workers know. NULL after
+a runtime error*/
+ObjTask* spawnTask(VM* vm, Value function, Value argument);
+
+/*Takes the task's result into the VM once the task is done, false while it isn't*/
+bool takeTaskResult(VM* vm, ObjTask* task, Value* result);
+
+/*Parks the running fiber of a worker until the task is done, the result comes back as
+the value it continues with. False if the task got done in the meantime*/
+bool parkOnTask(VM* vm, ObjTask* task);
+
+/*Blocks the thread of a VM that isn't a worker until the task is done. False if the pool
+stopped after a task failed*/
+bool waitForTask(VM* vm, ObjTask* task);
+
+/*Hands the result of the task the finishing fiber ran to the one that joins it. False
+after a runtime error*/
+bool finishTask(VM* vm, ObjTask* task, Value result);
+
+/*Keeps the finished fiber of a task, the next task started on the worker reuses it*/
+void recycleTaskFiber(VM* vm, ObjFiber* fiber);
+
+/*For a worker whose fibers are all waiting: readies the fibers whose joined tasks are
+done, or else starts a task from its own deque, another worker's or the shared queue.
+False when there's nothing to do*/
+bool findWork(VM* vm);
+
+/*Whether the worker's loop should give up, the pool is shutting down or failed*/
+bool workerStopping(Worker* worker);
+
+/*Counts the milliseconds the worker spent blocked in its event loop, which it just left*/
+void workerIdled(Worker* worker, double milliseconds);
+
+/*A map of a map per worker with the tasks it ran, the ones it stole, the seconds it was
+busy and its utilization since the pool started*/
+ObjMap* taskStats(VM* vm);
+
+/*Stops the workers the VM started and frees them, their VMs and the queues*/
+void freeTaskPool(VM* vm);
+
+#endif
@@ -0,0 +1,524 @@
+#include "simd.h"
+
+#if defined(__x86_64__) || (defined(__i386__) && defined(__SSE2__))
+#define SIMD_X86
+#include <immintrin.h>
+#endif
+
+/*The scalar versions are the fallback on every other architecture and also
+handle the tails the vector loops leave behind*/
+
+static double scalarSum(const double* values, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += values[i];
+    return sum;
+}
+
+static double scalarDot(const double* a, const double* b, int count) {
+    double sum = 0;
+    for (int i = 0; i < count; i++) sum += a[i] * b[i];
+    return sum;
+}
+
+static void scalarScale(double* values, int count, double factor) {
+    for (int i = 0; i < count; i++) values[i] *= factor;
+}
+
+static void scalarAdd(double* dest, const double* src, int count) {
+    for (int i = 0; i < count; i++) dest[i] += src[i];
+}
+
+/*Min and max give the first NaN in the array if it has any, on every path*/
+static double scalarMin(const double* values, int count, double min) {
+    for (int i = 0; i < count; i++) {
+        if (values[i] != values[i]) return values[i];
+        if (values[i] < min) min = values[i];
+    }
+    return min;
+}
+
+static double scalarMax(const double* values, int count, double max) {
+    for (int i = 0; i < count; i++) {
+        if (values[i] != values[i]) return values[i];
+        if (values[i] > max) max = values[i];
+    }
+    return max;
+}
+
+static void scalarPrefixSum(double* values, int count, double carry) {
+    for (int i = 0; i < count; i++) {
+        carry += values[i];
+        values[i] = carry;
+    }
+}
+
+#ifdef SIMD_X86
+
+/*AVX2 is checked once per call, the check itself is a single load of the cpu model
+gcc and clang fill in at startup*/
+static bool hasAvx2() {
+    return __builtin_cpu_supports("avx2");
+}
+
+#define AVX2 __attribute__((target("avx2")))
+
+static inline double AVX2 horizontalSum256(__m256d v) {
+    __m128d low = _mm256_castpd256_pd128(v);
+    __m128d high = _mm256_extractf128_pd(v, 1);
+    low = _mm_add_pd(low, high);
+    return _mm_cvtsd_f64(_mm_add_sd(low, _mm_unpackhi_pd(low, low)));
+}
+
+/*Four independent accumulators keep the adder pipeline busy*/
+static double AVX2 avx2Sum(const double* values, int count) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    __m256d acc2 = _mm256_setzero_pd(), acc3 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 16 <= count; i += 16) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+        acc1 = _mm256_add_pd(acc1, _mm256_loadu_pd(values + i + 4));
+        acc2 = _mm256_add_pd(acc2, _mm256_loadu_pd(values + i + 8));
+        acc3 = _mm256_add_pd(acc3, _mm256_loadu_pd(values + i + 12));
+    }
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm256_add_pd(acc0, _mm256_loadu_pd(values + i));
+    }
+    __m256d acc = _mm256_add_pd(_mm256_add_pd(acc0, acc1), _mm256_add_pd(acc2, acc3));
+    return horizontalSum256(acc) + scalarSum(values + i, count - i);
+}
+
+static double AVX2 avx2Dot(const double* a, const double* b, int count) {
+    __m256d acc0 = _mm256_setzero_pd(), acc1 = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 8 <= count; i += 8) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+        acc1 = _mm256_add_pd(acc1, _mm256_mul_pd(_mm256_loadu_pd(a + i + 4),
+                                                 _mm256_loadu_pd(b + i + 4)));
+    }
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm256_add_pd(acc0, _mm256_mul_pd(_mm256_loadu_pd(a + i),
+                                                 _mm256_loadu_pd(b + i)));
+    }
+    return horizontalSum256(_mm256_add_pd(acc0, acc1)) +
+           scalarDot(a + i, b + i, count - i);
+}
+
+static void AVX2 avx2Scale(double* values, int count, double factor) {
+    __m256d f = _mm256_set1_pd(factor);
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(values + i, _mm256_mul_pd(_mm256_loadu_pd(values + i), f));
+    }
+    scalarScale(values + i, count - i, factor);
+}
+
+static void AVX2 avx2Add(double* dest, const double* src, int count) {
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        _mm256_storeu_pd(dest + i, _mm256_add_pd(_mm256_loadu_pd(dest + i),
+                                                 _mm256_loadu_pd(src + i)));
+    }
+    scalarAdd(dest + i, src + i, count - i);
+}
+
+static double AVX2 avx2Min(const double* values, int count) {
+    __m256d acc = _mm256_set1_pd(values[0]);
+    __m256d unordered = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d chunk = _mm256_loadu_pd(values + i);
+        acc = _mm256_min_pd(acc, chunk);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(chunk, chunk, _CMP_UNORD_Q));
+    }
+    //min_pd drops NaNs, the scalar loop finds the first one
+    if (_mm256_movemask_pd(unordered)) return scalarMin(values, count, values[0]);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    return scalarMin(values + i, count - i, scalarMin(lanes, 4, lanes[0]));
+}
+
+static double AVX2 avx2Max(const double* values, int count) {
+    __m256d acc = _mm256_set1_pd(values[0]);
+    __m256d unordered = _mm256_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d chunk = _mm256_loadu_pd(values + i);
+        acc = _mm256_max_pd(acc, chunk);
+        unordered = _mm256_or_pd(unordered, _mm256_cmp_pd(chunk, chunk, _CMP_UNORD_Q));
+    }
+    if (_mm256_movemask_pd(unordered)) return scalarMax(values, count, values[0]);
+    double lanes[4];
+    _mm256_storeu_pd(lanes, acc);
+    return scalarMax(values + i, count - i, scalarMax(lanes, 4, lanes[0]));
+}
+
+/*In register scan of four lanes: add the vector shifted by one lane, then by two
+lanes, then the running total carried over from the previous block*/
+static void AVX2 avx2PrefixSum(double* values, int count) {
+    __m256d zero = _mm256_setzero_pd();
+    __m256d carry = zero;
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        __m256d x = _mm256_loadu_pd(values + i);
+        x = _mm256_add_pd(x, _mm256_blend_pd(
+                _mm256_permute4x64_pd(x, _MM_SHUFFLE(2, 1, 0, 0)), zero, 0x1));
+        x = _mm256_add_pd(x, _mm256_blend_pd(
+                _mm256_permute4x64_pd(x, _MM_SHUFFLE(1, 0, 0, 0)), zero, 0x3));
+        x = _mm256_add_pd(x, carry);
+        _mm256_storeu_pd(values + i, x);
+        carry = _mm256_permute4x64_pd(x, _MM_SHUFFLE(3, 3, 3, 3));
+    }
+    scalarPrefixSum(values + i, count - i, _mm256_cvtsd_f64(carry));
+}
+
+/*SSE2 is part of every x86-64 cpu, so these are the baseline vector kernels*/
+
+static double sse2Sum(const double* values, int count) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_loadu_pd(values + i));
+        acc1 = _mm_add_pd(acc1, _mm_loadu_pd(values + i + 2));
+    }
+    __m128d acc = _mm_add_pd(acc0, acc1);
+    acc = _mm_add_sd(acc, _mm_unpackhi_pd(acc, acc));
+    return _mm_cvtsd_f64(acc) + scalarSum(values + i, count - i);
+}
+
+static double sse2Dot(const double* a, const double* b, int count) {
+    __m128d acc0 = _mm_setzero_pd(), acc1 = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 4 <= count; i += 4) {
+        acc0 = _mm_add_pd(acc0, _mm_mul_pd(_mm_loadu_pd(a + i), _mm_loadu_pd(b + i)));
+        acc1 = _mm_add_pd(acc1, _mm_mul_pd(_mm_loadu_pd(a + i + 2),
+                                           _mm_loadu_pd(b + i + 2)));
+    }
+    __m128d acc = _mm_add_pd(acc0, acc1);
+    acc = _mm_add_sd(acc, _mm_unpackhi_pd(acc, acc));
+    return _mm_cvtsd_f64(acc) + scalarDot(a + i, b + i, count - i);
+}
+
+static void sse2Scale(double* values, int count, double factor) {
+    __m128d f = _mm_set1_pd(factor);
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(values + i, _mm_mul_pd(_mm_loadu_pd(values + i), f));
+    }
+    scalarScale(values + i, count - i, factor);
+}
+
+static void sse2Add(double* dest, const double* src, int count) {
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        _mm_storeu_pd(dest + i, _mm_add_pd(_mm_loadu_pd(dest + i), _mm_loadu_pd(src + i)));
+    }
+    scalarAdd(dest + i, src + i, count - i);
+}
+
+static double sse2Min(const double* values, int count) {
+    __m128d acc = _mm_set1_pd(values[0]);
+    __m128d unordered = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d chunk = _mm_loadu_pd(values + i);
+        acc = _mm_min_pd(acc, chunk);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(chunk, chunk));
+    }
+    if (_mm_movemask_pd(unordered)) return scalarMin(values, count, values[0]);
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    return scalarMin(values + i, count - i, lanes[0] < lanes[1] ? lanes[0] : lanes[1]);
+}
+
+static double sse2Max(const double* values, int count) {
+    __m128d acc = _mm_set1_pd(values[0]);
+    __m128d unordered = _mm_setzero_pd();
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d chunk = _mm_loadu_pd(values + i);
+        acc = _mm_max_pd(acc, chunk);
+        unordered = _mm_or_pd(unordered, _mm_cmpunord_pd(chunk, chunk));
+    }
+    if (_mm_movemask_pd(unordered)) return scalarMax(values, count, values[0]);
+    double lanes[2];
+    _mm_storeu_pd(lanes, acc);
+    return scalarMax(values + i, count - i, lanes[0] > lanes[1] ? lanes[0] : lanes[1]);
+}
+
+static void sse2PrefixSum(double* values, int count) {
+    __m128d zero = _mm_setzero_pd();
+    __m128d carry = zero;
+    int i = 0;
+    for (; i + 2 <= count; i += 2) {
+        __m128d x = _mm_loadu_pd(values + i);
+        x = _mm_add_pd(x, _mm_unpacklo_pd(zero, x));
+        x = _mm_add_pd(x, carry);
+        _mm_storeu_pd(values + i, x);
+        carry = _mm_unpackhi_pd(x, x);
+    }
+    scalarPrefixSum(values + i, count - i, _mm_cvtsd_f64(carry));
+}
+
+#endif
+
+double simdSum(const double* values, int count) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2Sum(values, count) : sse2Sum(values, count);
+#else
+    return scalarSum(values, count);
+#endif
+}
+
+double simdDot(const double* a, const double* b, int count) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2Dot(a, b, count) : sse2Dot(a, b, count);
+#else
+    return scalarDot(a, b, count);
+#endif
+}
+
+void simdScale(double* values, int count, double factor) {
+#ifdef SIMD_X86
+    if (hasAvx2()) avx2Scale(values, count, factor);
+    else sse2Scale(values, count, factor);
+#else
+    scalarScale(values, count, factor);
+#endif
+}
+
+void simdAdd(double* dest, const double* src, int count) {
+#ifdef SIMD_X86
+    if (hasAvx2()) avx2Add(dest, src, count);
+    else sse2Add(dest, src, count);
+#else
+    scalarAdd(dest, src, count);
+#endif
+}
+
+double simdMin(const double* values, int count) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2Min(values, count) : sse2Min(values, count);
+#else
+    return scalarMin(values, count, values[0]);
+#endif
+}
+
+double simdMax(const double* values, int count) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2Max(values, count) : sse2Max(values, count);
+#else
+    return scalarMax(values, count, values[0]);
+#endif
+}
+
+void simdPrefixSum(double* values, int count) {
+#ifdef SIMD_X86
+    if (hasAvx2()) avx2PrefixSum(values, count);
+    else sse2PrefixSum(values, count);
+#else
+    scalarPrefixSum(values, count, 0);
+#endif
+}
+
+// Text scanning ----------------------------------------------------------------
+
+/*The scanner's loops over runs of similar characters. Every kernel stops at end, the
+vector loops only load whole blocks that lie before it and leave the rest to the
+scalar loops. lines counts the '\n's passed over*/
+
+static bool isSpace(char c) {
+    return c == ' ' || c == '\t' || c == '\r' || c == '\n';
+}
+
+static bool isIdentifierChar(char c) {
+    return (c >= 'a' && c <= 'z') || (c >= 'A' && c <= 'Z') ||
+           (c >= '0' && c <= '9') || c == '_';
+}
+
+static const char* scalarSkipWhitespace(const char* p, const char* end, int* lines) {
+    for (; p < end && isSpace(*p); p++) {
+        if (*p == '\n') (*lines)++;
+    }
+    return p;
+}
+
+static const char* scalarSkipIdentifier(const char* p, const char* end) {
+    while (p < end && isIdentifierChar(*p)) p++;
+    return p;
+}
+
+static const char* scalarFindNewline(const char* p, const char* end) {
+    while (p < end && *p != '\n') p++;
+    return p;
+}
+
+static const char* scalarFindQuote(const char* p, const char* end, int* lines) {
+    for (; p < end && *p != '"'; p++) {
+        if (*p == '\n') (*lines)++;
+    }
+    return p;
+}
+
+#ifdef SIMD_X86
+
+/*Each block is turned into bit masks, one bit per byte, the first stop is then the
+lowest set bit. Newlines before it are counted with a popcount*/
+
+static inline unsigned linesBefore(unsigned newlines, int stop) {
+    return (unsigned)__builtin_popcount(newlines & ((1u << stop) - 1));
+}
+
+//signed compares are fine, every byte above 127 is simply out of range
+static inline __m256i AVX2 avx2InRange(__m256i c, char low, char high) {
+    return _mm256_and_si256(_mm256_cmpgt_epi8(c, _mm256_set1_epi8(low - 1)),
+                            _mm256_cmpgt_epi8(_mm256_set1_epi8(high + 1), c));
+}
+
+static inline unsigned AVX2 avx2Equal(__m256i c, char byte) {
+    return (unsigned)_mm256_movemask_epi8(_mm256_cmpeq_epi8(c, _mm256_set1_epi8(byte)));
+}
+
+static const char* AVX2 avx2SkipWhitespace(const char* p, const char* end, int* lines) {
+    for (; end - p >= 32; p += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        unsigned newlines = avx2Equal(c, '\n');
+        unsigned stops = ~(newlines | avx2Equal(c, ' ') | avx2Equal(c, '\t') |
+                           avx2Equal(c, '\r'));
+        if (stops != 0) {
+            int stop = __builtin_ctz(stops);
+            *lines += linesBefore(newlines, stop);
+            return p + stop;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return scalarSkipWhitespace(p, end, lines);
+}
+
+static const char* AVX2 avx2SkipIdentifier(const char* p, const char* end) {
+    for (; end - p >= 32; p += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        //or-ing in 0x20 lowercases letters, so one range covers both cases
+        __m256i letter = avx2InRange(_mm256_or_si256(c, _mm256_set1_epi8(0x20)), 'a', 'z');
+        __m256i word = _mm256_or_si256(letter, avx2InRange(c, '0', '9'));
+        unsigned stops = ~((unsigned)_mm256_movemask_epi8(word) | avx2Equal(c, '_'));
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+    return scalarSkipIdentifier(p, end);
+}
+
+static const char* AVX2 avx2FindNewline(const char* p, const char* end) {
+    for (; end - p >= 32; p += 32) {
+        unsigned stops = avx2Equal(_mm256_loadu_si256((const __m256i*)p), '\n');
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+    return scalarFindNewline(p, end);
+}
+
+static const char* AVX2 avx2FindQuote(const char* p, const char* end, int* lines) {
+    for (; end - p >= 32; p += 32) {
+        __m256i c = _mm256_loadu_si256((const __m256i*)p);
+        unsigned newlines = avx2Equal(c, '\n');
+        unsigned stops = avx2Equal(c, '"');
+        if (stops != 0) {
+            int stop = __builtin_ctz(stops);
+            *lines += linesBefore(newlines, stop);
+            return p + stop;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return scalarFindQuote(p, end, lines);
+}
+
+static inline __m128i sse2InRange(__m128i c, char low, char high) {
+    return _mm_and_si128(_mm_cmpgt_epi8(c, _mm_set1_epi8(low - 1)),
+                         _mm_cmpgt_epi8(_mm_set1_epi8(high + 1), c));
+}
+
+static inline unsigned sse2Equal(__m128i c, char byte) {
+    return (unsigned)_mm_movemask_epi8(_mm_cmpeq_epi8(c, _mm_set1_epi8(byte)));
+}
+
+static const char* sse2SkipWhitespace(const char* p, const char* end, int* lines) {
+    for (; end - p >= 16; p += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        unsigned newlines = sse2Equal(c, '\n');
+        unsigned stops = ~(newlines | sse2Equal(c, ' ') | sse2Equal(c, '\t') |
+                           sse2Equal(c, '\r')) & 0xffff;
+        if (stops != 0) {
+            int stop = __builtin_ctz(stops);
+            *lines += linesBefore(newlines, stop);
+            return p + stop;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return scalarSkipWhitespace(p, end, lines);
+}
+
+static const char* sse2SkipIdentifier(const char* p, const char* end) {
+    for (; end - p >= 16; p += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        __m128i letter = sse2InRange(_mm_or_si128(c, _mm_set1_epi8(0x20)), 'a', 'z');
+        __m128i word = _mm_or_si128(letter, sse2InRange(c, '0', '9'));
+        unsigned stops = ~((unsigned)_mm_movemask_epi8(word) | sse2Equal(c, '_')) & 0xffff;
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+    return scalarSkipIdentifier(p, end);
+}
+
+static const char* sse2FindNewline(const char* p, const char* end) {
+    for (; end - p >= 16; p += 16) {
+        unsigned stops = sse2Equal(_mm_loadu_si128((const __m128i*)p), '\n');
+        if (stops != 0) return p + __builtin_ctz(stops);
+    }
+    return scalarFindNewline(p, end);
+}
+
+static const char* sse2FindQuote(const char* p, const char* end, int* lines) {
+    for (; end - p >= 16; p += 16) {
+        __m128i c = _mm_loadu_si128((const __m128i*)p);
+        unsigned newlines = sse2Equal(c, '\n');
+        unsigned stops = sse2Equal(c, '"');
+        if (stops != 0) {
+            int stop = __builtin_ctz(stops);
+            *lines += linesBefore(newlines, stop);
+            return p + stop;
+        }
+        *lines += __builtin_popcount(newlines);
+    }
+    return scalarFindQuote(p, end, lines);
+}
+
+#endif
+
+const char* simdSkipWhitespace(const char* p, const char* end, int* lines) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2SkipWhitespace(p, end, lines) : sse2SkipWhitespace(p, end, lines);
+#else
+    return scalarSkipWhitespace(p, end, lines);
+#endif
+}
+
+const char* simdSkipIdentifier(const char* p, const char* end) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2SkipIdentifier(p, end) : sse2SkipIdentifier(p, end);
+#else
+    return scalarSkipIdentifier(p, end);
+#endif
+}
+
+const char* simdFindNewline(const char* p, const char* end) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2FindNewline(p, end) : sse2FindNewline(p, end);
+#else
+    return scalarFindNewline(p, end);
+#endif
+}
+
+const char* simdFindQuote(const char* p, const char* end, int* lines) {
+#ifdef SIMD_X86
+    return hasAvx2() ? avx2FindQuote(p, end, lines) : sse2FindQuote(p, end, lines);
+#else
+    return scalarFindQuote(p, end, lines);
+#endif
+}
@@ -0,0 +1,45 @@
+/*Bulk kernels over contiguous doubles used by the Float64Array natives, and over
+source text for the scanner. On x86 they pick AVX2 or SSE2 at runtime, everywhere else
+they fall back to plain loops*/
+
+#ifndef cpandi_simd_h
+#define cpandi_simd_h
+
+#include "common.h"
+
+/*Sum of all the elements*/
+double simdSum(const double* values, int count);
+
+/*Dot product of two arrays of the same length*/
+double simdDot(const double* a, const double* b, int count);
+
+/*values[i] *= factor*/
+void simdScale(double* values, int count, double factor);
+
+/*dest[i] += src[i]*/
+void simdAdd(double* dest, const double* src, int count);
+
+/*Smallest and largest element, count has to be at least 1. An array with a NaN gives
+its first NaN*/
+double simdMin(const double* values, int count);
+double simdMax(const double* values, int count);
+
+/*Replaces every element with the running sum up to and including it*/
+void simdPrefixSum(double* values, int count);
+
+/*The text kernels return the first character in [p, end) that stops them, or end.
+Those that can pass over newlines add how many they passed to lines*/
+
+/*Stops at anything but ' ', '\t', '\r' and '\n'*/
+const char* simdSkipWhitespace(const char* p, const char* end, int* lines);
+
+/*Stops at anything but letters, digits and '_'*/
+const char* simdSkipIdentifier(const char* p, const char* end);
+
+/*Stops at the first '\n'*/
+const char* simdFindNewline(const char* p, const char* end);
+
+/*Stops at the first '"'*/
+const char* simdFindQuote(const char* p, const char* end, int* lines);
+
+#endif
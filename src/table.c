@@ -19,10 +19,56 @@ void freeTable(Table* table) {
     initTable(table);
 }
 
+/*Hashes any key value. Strings carry their precomputed FNV-1a hash, numbers hash their
+bits (with -0 folded into 0 so equal numbers land in the same bucket)*/
+static uint32_t hashValue(Value key) {
+    switch (key.type) {
+        case VAL_BOOL:   return AS_BOOL(key) ? 3 : 5;
+        //ints hash as the double they equal, so 1 and 1.0 find the same entry
+        case VAL_INT:
+        case VAL_NUMBER: {
+            double number = AS_NUMBER(key);
+            if (number == 0) number = 0;
+            uint64_t bits;
+            memcpy(&bits, &number, sizeof(bits));
+            bits ^= bits >> 33;
+            bits *= 0xff51afd7ed558ccdull;
+            bits ^= bits >> 33;
+            return (uint32_t)bits;
+        }
+        case VAL_OBJ:
+            if (IS_STRING(key)) return AS_STRING(key)->hash;
+            //any other object is keyed by its identity
+            return (uint32_t)((uintptr_t)AS_OBJ(key) >> 3);
+        default:         return 0; // Nil is never a key.
+    }
+}
+
+/*Interned strings (and every other object) are compared by pointer, so
+looking up a string key never touches its characters*/
+static inline bool keysEqual(Value a, Value b) {
+    if (a.type != b.type) {
+        return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+    }
+    switch (a.type) {
+        case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
+        case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+        case VAL_INT:    return AS_INT(a) == AS_INT(b);
+        case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
+        default:         return false;
+    }
+}
+
+bool isValidKey(Value key) {
+    if (IS_NIL(key)) return false;
+    if (IS_NUMBER(key) && AS_NUMBER(key) != AS_NUMBER(key)) return false;
+    return true;
+}
+
 /*The find entry takes an array of entries, capacity and the key to find the hashing position for a key*/
-static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
+static Entry* findEntry(Entry* entries, int capacity, Value key) {
     //First get the hash code from the key
-    uint32_t index = key->hash % capacity;
+    uint32_t index = hashValue(key) % capacity;
 
     Entry* tombstone = NULL;
 
@@ -30,7 +76,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
         //store a reference to that particular index point
         Entry* entry = &entries[index];
         
-        if (entry->key == NULL) {
+        if (IS_NIL(entry->key)) {
             if (IS_NIL(entry->value)) {
                 //entry (empty)
                 return tombstone != NULL ? tombstone : entry;
@@ -38,7 +84,7 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
                 //we got a tombstone
                 if (tombstone == NULL) tombstone = entry;
             }
-        }   else if (entry->key == key) {
+        }   else if (keysEqual(entry->key, key)) {
             // found a key
             return entry;
         }
@@ -48,13 +94,13 @@ static Entry* findEntry(Entry* entries, int capacity, ObjString* key) {
     }
 }
 
-bool tableGet(Table* table, ObjString* key, Value* value) {
+bool tableGet(Table* table, Value key, Value* value) {
     //if the table count is 0, then return false
     if (table->count == 0) return false;
     
     //if you find an entry that is not null then skip to line 46 and return true
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (IS_NIL(entry->key)) return false;
 
     *value = entry->value;
     return true;
@@ -66,8 +112,8 @@ static void adjustCapacity(Table* table, int capacity) {
     Entry* entries = ALLOCATE(Entry, capacity);
 
     for (int i = 0; i < capacity; i++) {
-        //The key is set to NULL
-        entries[i].key = NULL;
+        //The key is set to nil
+        entries[i].key = NIL_VAL;
         //The values are nil
         entries[i].value = NIL_VAL;
     }
@@ -79,7 +125,7 @@ static void adjustCapacity(Table* table, int capacity) {
         //First get the entry 
         Entry* entry = &table->entries[i];
         //this is a tombstone marker
-        if (entry->key == NULL) continue;
+        if (IS_NIL(entry->key)) continue;
 
         //What the entry pointer does is it finds the entries based on the 
         //new entries pointer and stores the old keys and values in it
@@ -96,16 +142,27 @@ static void adjustCapacity(Table* table, int capacity) {
     table->capacity = capacity;
 }
 
-bool tableSet(Table* table, ObjString* key, Value value) {
+bool tableSet(Table* table, Value key, Value value) {
+    //an existing key is updated where it is, growing moves every entry and would
+    //throw off a map's iteration cursor
+    Entry* entry = NULL;
+    if (table->capacity > 0) {
+        entry = findEntry(table->entries, table->capacity, key);
+        if (!IS_NIL(entry->key)) {
+            entry->value = value;
+            return false;
+        }
+    }
+
     //If the table's elements are > 75% of the capacity
     //then grow the capacity.
     if (table->count + 1 > table->capacity * TABLE_MAX_LOAD) {
         int capacity = GROW_CAPACITY(table->capacity);
         adjustCapacity(table, capacity);
+        entry = findEntry(table->entries, table->capacity, key);
     }
-    Entry* entry = findEntry(table->entries, table->capacity, key);
     
-    bool isNewKey = entry->key == NULL;
+    bool isNewKey = IS_NIL(entry->key);
     //this helps increment the count only when a fresh bucket is overwritten 
     //and not tombstones
     if (isNewKey && IS_NIL(entry->value)) table->count++;
@@ -115,15 +172,15 @@ bool tableSet(Table* table, ObjString* key, Value value) {
     return isNewKey;
 }
 
-bool tableDelete(Table* table, ObjString* key) {
+bool tableDelete(Table* table, Value key) {
     if (table->count == 0) return false;
 
     //find the entry
     Entry* entry = findEntry(table->entries, table->capacity, key);
-    if (entry->key == NULL) return false;
+    if (IS_NIL(entry->key)) return false;
 
     //place a tombstone in the entry
-    entry->key == NULL;
+    entry->key = NIL_VAL;
     entry->value = BOOL_VAL(true);
     return true;
 }
@@ -131,12 +188,28 @@ bool tableDelete(Table* table, ObjString* key) {
 void tableAddAll(Table* from, Table* to) {
     for (int i = 0; i < from->capacity; i++) {
         Entry* entry = &from->entries[i];
-        if (entry->key != NULL) {
+        if (!IS_NIL(entry->key)) {
             tableSet(to, entry->key, entry->value);
         }
     }
 }
 
+void tableReserve(Table* table, int count) {
+    if (count > TABLE_MAX_RESERVE) count = TABLE_MAX_RESERVE;
+    int capacity = table->capacity;
+    while (count > capacity * TABLE_MAX_LOAD) {
+        capacity = GROW_CAPACITY(capacity);
+    }
+    if (capacity != table->capacity) adjustCapacity(table, capacity);
+}
+
+int tableNext(Table* table, int cursor) {
+    for (int i = cursor + 1; i < table->capacity; i++) {
+        if (!IS_NIL(table->entries[i].key)) return i;
+    }
+    return -1;
+}
+
 
 ObjString* tableFindString(Table* table, const char* chars,
                            int length, uint32_t hash) {
@@ -145,14 +218,16 @@ ObjString* tableFindString(Table* table, const char* chars,
   uint32_t index = hash % table->capacity;
   for (;;) {
     Entry* entry = &table->entries[index];
-    if (entry->key == NULL) {
+    if (IS_NIL(entry->key)) {
       // Stop if we find an empty non-tombstone entry.
       if (IS_NIL(entry->value)) return NULL;
-    } else if (entry->key->length == length &&
-        entry->key->hash == hash &&
-        memcmp(entry->key->chars, chars, length) == 0) {
-      // We found it.
-      return entry->key;
+    } else if (IS_STRING(entry->key)) {
+      ObjString* key = AS_STRING(entry->key);
+      if (key->length == length && key->hash == hash &&
+          memcmp(key->chars, chars, length) == 0) {
+        // We found it.
+        return key;
+      }
     }
 
     index = (index + 1) % table->capacity;
@@ -4,9 +4,10 @@
 #include "common.h"
 #include "value.h"
 
-/*Each entry has a string key and a Value associated with it*/
+/*Each entry has a key and a Value associated with it. Keys are numbers, bools or
+objects (interned strings compare by pointer); a nil key marks an empty bucket or a tombstone*/
 typedef struct {
-    ObjString* key;
+    Value key;
     Value value;
 } Entry;
 
@@ -27,17 +28,31 @@ void initTable(Table* table);
 void freeTable(Table* table);
 
 /*This is used to retrieve stuff from the hash table*/
-bool tableGet(Table* table, ObjString* key, Value* value);
+bool tableGet(Table* table, Value key, Value* value);
 
 /*This method helps fill the hash table with entries*/
-bool tableSet(Table* table, ObjString* key, Value value);
+bool tableSet(Table* table, Value key, Value value);
 
 /*This method helps delete the entries from a table, places tombstones on them*/
-bool tableDelete(Table* table, ObjString* key);
+bool tableDelete(Table* table, Value key);
 
 /*This method helps copy all the entries of the hashtable into a new table*/
 void tableAddAll(Table* from, Table* to);
 
+/*The most entries tableReserve makes room for, any more buckets would overflow the
+table's int capacity*/
+#define TABLE_MAX_RESERVE (1 << 29)
+
+/*Grows the table up front so that count entries fit without rehashing, up to
+TABLE_MAX_RESERVE of them*/
+void tableReserve(Table* table, int count);
+
+/*Returns the bucket index of the first live entry after cursor (-1 to start), or -1 when done*/
+int tableNext(Table* table, int cursor);
+
+/*Returns true if the value can be used as a key (nil and NaN can't)*/
+bool isValidKey(Value key);
+
 ObjString* tableFindString(Table* table, const char* chars, int length, uint32_t hash);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,195 @@
+#include <string.h>
+
+#include "memory.h"
+#include "transfer.h"
+
+void initTransfer(Transfer* transfer, VM* vm) {
+    transfer->vm = vm;
+    transfer->copies = NULL;
+    transfer->count = 0;
+    transfer->capacity = 0;
+    transfer->failed = false;
+}
+
+void freeTransfer(Transfer* transfer) {
+    FREE_ARRAY(CopiedObject, transfer->copies, transfer->capacity);
+    initTransfer(transfer, transfer->vm);
+}
+
+static CopiedObject* findCopy(CopiedObject* copies, int capacity, Obj* object) {
+    //objects are at least 16 byte aligned, the low bits carry nothing
+    uint32_t index = (uint32_t)((uintptr_t)object >> 4) & (capacity - 1);
+    for (;;) {
+        CopiedObject* copy = &copies[index];
+        if (copy->from == object || copy->from == NULL) return copy;
+        index = (index + 1) & (capacity - 1);
+    }
+}
+
+static void addCopy(Transfer* transfer, Obj* from, Obj* to) {
+    if (transfer->count + 1 > transfer->capacity * 3 / 4) {
+        int capacity = GROW_CAPACITY(transfer->capacity);
+        CopiedObject* copies = ALLOCATE(CopiedObject, capacity);
+        memset(copies, 0, sizeof(CopiedObject) * capacity);
+        for (int i = 0; i < transfer->capacity; i++) {
+            if (transfer->copies[i].from == NULL) continue;
+            *findCopy(copies, capacity, transfer->copies[i].from) = transfer->copies[i];
+        }
+        FREE_ARRAY(CopiedObject, transfer->copies, transfer->capacity);
+        transfer->copies = copies;
+        transfer->capacity = capacity;
+    }
+    CopiedObject* copy = findCopy(transfer->copies, transfer->capacity, from);
+    copy->from = from;
+    copy->to = to;
+    transfer->count++;
+}
+
+static ObjFunction* copyFunction(Transfer* transfer, ObjFunction* function) {
+    ObjFunction* copy = newFunction(transfer->vm);
+    addCopy(transfer, (Obj*)function, (Obj*)copy);
+    copy->arity = function->arity;
+    copy->upvalueCount = function->upvalueCount;
+    if (function->name != NULL) {
+        copy->name = AS_STRING(transferValue(transfer, OBJ_VAL(function->name)));
+    }
+    //optimized code only guards on the function constants copied along with it
+    copy->isOptimized = function->isOptimized;
+    //the source stays mapped until the scripts finish, each VM compiles its own copy
+    copy->lazySource = function->lazySource;
+    copy->lazyLength = function->lazyLength;
+    copy->lazyLine = function->lazyLine;
+    copyChunkCode(&copy->chunk, &function->chunk);
+    ValueArray* constants = &function->chunk.constants;
+    for (int i = 0; i < constants->count; i++) {
+        writeValueArray(&copy->chunk.constants, transferValue(transfer, constants->values[i]));
+    }
+    return copy;
+}
+
+static ObjClosure* copyClosure(Transfer* transfer, ObjClosure* closure) {
+    ObjFunction* function = AS_FUNCTION(transferValue(transfer, OBJ_VAL(closure->function)));
+    ObjClosure* copy = newClosure(transfer->vm, function);
+    addCopy(transfer, (Obj*)closure, (Obj*)copy);
+    for (int i = 0; i < closure->upvalueCount; i++) {
+        Value upvalue = transferValue(transfer, OBJ_VAL(closure->upvalues[i]));
+        copy->upvalues[i] = (ObjUpvalue*)AS_OBJ(upvalue);
+    }
+    return copy;
+}
+
+/*Whether it's still open or not, the copy is closed over the variable's current value*/
+static ObjUpvalue* copyUpvalue(Transfer* transfer, ObjUpvalue* upvalue) {
+    ObjUpvalue* copy = newUpvalue(transfer->vm, NULL);
+    addCopy(transfer, (Obj*)upvalue, (Obj*)copy);
+    copy->closed = transferValue(transfer, *upvalue->location);
+    copy->location = &copy->closed;
+    return copy;
+}
+
+static ObjMap* copyMap(Transfer* transfer, ObjMap* map) {
+    ObjMap* copy = newMap(transfer->vm);
+    addCopy(transfer, (Obj*)map, (Obj*)copy);
+    for (int i = 0; i < map->table.capacity; i++) {
+        Entry* entry = &map->table.entries[i];
+        if (IS_NIL(entry->key)) continue;
+        mapSet(copy, transferValue(transfer, entry->key),
+               transferValue(transfer, entry->value));
+    }
+    return copy;
+}
+
+Value transferValue(Transfer* transfer, Value value) {
+    if (!IS_OBJ(value)) return value;
+    Obj* object = AS_OBJ(value);
+    if (transfer->capacity > 0) {
+        CopiedObject* copied = findCopy(transfer->copies, transfer->capacity, object);
+        if (copied->from != NULL) return OBJ_VAL(copied->to);
+    }
+
+    VM* vm = transfer->vm;
+    Obj* copy;
+    switch (object->type) {
+        case OBJ_STRING: {
+            ObjString* string = (ObjString*)object;
+            copy = (Obj*)copyString(vm, string->chars, string->length);
+            break;
+        }
+        case OBJ_FUNCTION:
+            return OBJ_VAL(copyFunction(transfer, (ObjFunction*)object));
+        case OBJ_CLOSURE:
+            return OBJ_VAL(copyClosure(transfer, (ObjClosure*)object));
+        case OBJ_UPVALUE:
+            return OBJ_VAL(copyUpvalue(transfer, (ObjUpvalue*)object));
+        case OBJ_MAP:
+            return OBJ_VAL(copyMap(transfer, (ObjMap*)object));
+        case OBJ_NATIVE:
+            copy = (Obj*)newNative(vm, ((ObjNative*)object)->function);
+            break;
+        case OBJ_FLOAT64_ARRAY: {
+            ObjFloat64Array* array = (ObjFloat64Array*)object;
+            ObjFloat64Array* values = newFloat64Array(vm, array->count);
+            if (array->count > 0) memcpy(values->values, array->values, sizeof(double) * array->count);
+            copy = (Obj*)values;
+            break;
+        }
+        case OBJ_STRING_BUILDER: {
+            ObjStringBuilder* builder = (ObjStringBuilder*)object;
+            ObjStringBuilder* text = newStringBuilder(vm, builder->length);
+            appendStringBuilder(text, builder->chars, builder->length);
+            copy = (Obj*)text;
+            break;
+        }
+        default:
+            //a fiber is in the middle of running in its own VM, a task belongs to the
+            //one that spawned it
+            transfer->failed = true;
+            return NIL_VAL;
+    }
+    addCopy(transfer, object, copy);
+    return OBJ_VAL(copy);
+}
+
+void transferTable(Transfer* transfer, Table* from, Table* to) {
+    for (int i = 0; i < from->capacity; i++) {
+        Entry* entry = &from->entries[i];
+        if (IS_NIL(entry->key)) continue;
+        tableSet(to, transferValue(transfer, entry->key), transferValue(transfer, entry->value));
+    }
+}
+
+void initParcel(Parcel* parcel) {
+    parcel->value = NIL_VAL;
+    initObjectArena(&parcel->heap);
+}
+
+bool packValue(Parcel* parcel, Value value) {
+    if (!IS_OBJ(value)) {
+        parcel->value = value;
+        return true;
+    }
+    //without a VM the copies go into the arena, nothing else points into it
+    Transfer transfer;
+    initTransfer(&transfer, NULL);
+    useObjectArena(&parcel->heap);
+    parcel->value = transferValue(&transfer, value);
+    useObjectArena(NULL);
+    bool packed = !transfer.failed;
+    freeTransfer(&transfer);
+    return packed;
+}
+
+Value unpackValue(VM* vm, Parcel* parcel) {
+    if (!IS_OBJ(parcel->value)) return parcel->value;
+    Transfer transfer;
+    initTransfer(&transfer, vm);
+    Value value = transferValue(&transfer, parcel->value);
+    freeTransfer(&transfer);
+    return value;
+}
+
+void freeParcel(Parcel* parcel) {
+    freeObjectList(parcel->heap.objects);
+    freeTable(&parcel->heap.strings);
+    initParcel(parcel);
+}
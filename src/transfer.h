@@ -0,0 +1,45 @@
+#ifndef cpandi_transfer_h
+#define cpandi_transfer_h
+
+#include "vm.h"
+
+/*An object and its copy in another VM*/
+typedef struct {
+    Obj* from;
+    Obj* to;
+} CopiedObject;
+
+/*A deep copy of values into a VM. Every object is copied once, so objects shared
+between values (or by a function and the global it guards on) stay shared in the copy*/
+typedef struct {
+    VM* vm;
+    //open addressing on the original's address, from is NULL in empty buckets
+    CopiedObject* copies;
+    int count;
+    int capacity;
+    //set by a value that can't be copied (a fiber or a task), it becomes nil
+    bool failed;
+} Transfer;
+
+/*Copies go into the VM, or with a NULL VM into the calling thread's object arena*/
+void initTransfer(Transfer* transfer, VM* vm);
+void freeTransfer(Transfer* transfer);
+
+/*The copy of the value. The VM it comes from must not change while it's copied*/
+Value transferValue(Transfer* transfer, Value value);
+
+/*Copies every entry of the table into the other one, values that can't move become nil*/
+void transferTable(Transfer* transfer, Table* from, Table* to);
+
+void initParcel(Parcel* parcel);
+
+/*Copies the value out of the VM into the parcel, false if it holds something that
+can't move*/
+bool packValue(Parcel* parcel, Value value);
+
+/*A copy of the parcel's value in the VM, the parcel stays as it is*/
+Value unpackValue(VM* vm, Parcel* parcel);
+
+void freeParcel(Parcel* parcel);
+
+#endif
@@ -0,0 +1,375 @@
+#include <stdatomic.h>
+#include <string.h>
+
+#include "memory.h"
+#include "object.h"
+#include "peephole.h"
+#include "types.h"
+
+/*What the pass knows about a value. TYPE_ANY is anything at all, two different
+types meeting where paths join become TYPE_ANY*/
+typedef enum {
+    TYPE_NIL,
+    TYPE_BOOL,
+    TYPE_NUMBER,
+    TYPE_STRING,
+    TYPE_ANY,
+} StaticType;
+
+/*Chunks are compiled on several threads at once*/
+static atomic_int sitesSeen;
+static atomic_int sitesSpecialized;
+
+typedef struct {
+    Chunk* chunk;
+    InstructionList list;
+    bool* isTarget;
+    //the types at the start of every jump target, entryHeight is -1 until a path gets there
+    int* entryHeight;
+    uint8_t** entryTypes;
+    int* worklist;
+    int worklistCount;
+    bool* queued;
+    //slots a closure captures can change behind the function's back
+    bool captured[UINT8_COUNT];
+    //the types at the instruction being looked at
+    uint8_t* types;
+    int height;
+    int capacity;
+    bool failed;
+} Inference;
+
+static bool isJump(uint8_t op) {
+    return op == OP_JUMP || op == OP_JUMP_IF_FALSE || op == OP_GUARD_CALLEE;
+}
+
+static void push(Inference* inference, StaticType type) {
+    if (inference->height == inference->capacity) {
+        int oldCapacity = inference->capacity;
+        inference->capacity = GROW_CAPACITY(oldCapacity);
+        inference->types = GROW_ARRAY(uint8_t, inference->types, oldCapacity,
+                                      inference->capacity);
+    }
+    inference->types[inference->height++] = type;
+}
+
+static StaticType pop(Inference* inference, int count) {
+    if (count > inference->height) {
+        inference->failed = true;
+        inference->height = 0;
+        return TYPE_ANY;
+    }
+    inference->height -= count;
+    return count > 0 ? inference->types[inference->height] : TYPE_ANY;
+}
+
+static StaticType slotType(Inference* inference, int slot) {
+    if (slot >= inference->height) {
+        inference->failed = true;
+        return TYPE_ANY;
+    }
+    return inference->captured[slot] ? TYPE_ANY : inference->types[slot];
+}
+
+static StaticType constantType(Value value) {
+    switch (value.type) {
+        case VAL_NIL:    return TYPE_NIL;
+        case VAL_BOOL:   return TYPE_BOOL;
+        case VAL_NUMBER:
+        case VAL_INT:    return TYPE_NUMBER;
+        default:         return IS_STRING(value) ? TYPE_STRING : TYPE_ANY;
+    }
+}
+
+/*Applies the instruction to the types on the stack*/
+static void transfer(Inference* inference, Instruction* instruction) {
+    switch (instruction->op) {
+        case OP_CONSTANT:
+        case OP_CONSTANT_LONG:
+            push(inference, constantType(
+                    inference->chunk->constants.values[instruction->operand]));
+            break;
+        case OP_NIL:   push(inference, TYPE_NIL); break;
+        case OP_TRUE:
+        case OP_FALSE: push(inference, TYPE_BOOL); break;
+
+        case OP_POP:
+        case OP_DEFINE_GLOBAL:
+        case OP_DEFINE_GLOBAL_LONG:
+        case OP_PRINT:
+        case OP_CLOSE_UPVALUE:
+            pop(inference, 1);
+            break;
+        case OP_POPN:
+            pop(inference, instruction->operand);
+            break;
+
+        case OP_GET_LOCAL:
+            push(inference, slotType(inference, instruction->operand));
+            break;
+        case OP_SET_LOCAL:
+            if (instruction->operand >= inference->height - 1) {
+                inference->failed = true;
+                break;
+            }
+            inference->types[instruction->operand] = inference->types[inference->height - 1];
+            break;
+
+        case OP_GET_GLOBAL:
+        case OP_GET_GLOBAL_LONG:
+        case OP_GET_UPVALUE:
+        case OP_CLOSURE:
+        case OP_CLOSURE_LONG:
+            push(inference, TYPE_ANY);
+            break;
+
+        //these leave the value where it is
+        case OP_SET_GLOBAL:
+        case OP_SET_GLOBAL_LONG:
+        case OP_SET_UPVALUE:
+        case OP_JUMP:
+        case OP_JUMP_IF_FALSE:
+        case OP_GUARD_CALLEE:
+            break;
+
+        case OP_EQUAL:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_NOT_EQUAL:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            pop(inference, 2);
+            push(inference, TYPE_BOOL);
+            break;
+
+        //the string case needs both sides to be strings, anything else fails at runtime
+        case OP_ADD: {
+            StaticType b = pop(inference, 1);
+            StaticType a = pop(inference, 1);
+            push(inference, a == b && (a == TYPE_NUMBER || a == TYPE_STRING) ? a : TYPE_ANY);
+            break;
+        }
+        //only numbers get past these
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+            pop(inference, 2);
+            push(inference, TYPE_NUMBER);
+            break;
+        case OP_NEGATE:
+            pop(inference, 1);
+            push(inference, TYPE_NUMBER);
+            break;
+        case OP_NOT:
+            pop(inference, 1);
+            push(inference, TYPE_BOOL);
+            break;
+
+        case OP_GET_INDEX:
+            pop(inference, 2);
+            push(inference, TYPE_ANY);
+            break;
+        case OP_SET_INDEX:
+            pop(inference, 3);
+            push(inference, TYPE_ANY);
+            break;
+        case OP_BUILD_MAP:
+            pop(inference, instruction->operand * 2);
+            push(inference, TYPE_ANY);
+            break;
+        case OP_CALL:
+            pop(inference, instruction->operand + 1);
+            push(inference, TYPE_ANY);
+            break;
+
+        case OP_RETURN:
+            break;
+
+        default:
+            //an opcode the pass doesn't know about yet
+            inference->failed = true;
+            break;
+    }
+}
+
+static uint8_t typedOp(uint8_t op, StaticType a, StaticType b) {
+    if (op == OP_ADD && a == TYPE_STRING && b == TYPE_STRING) return OP_ADD_STRING;
+    if (a != TYPE_NUMBER || b != TYPE_NUMBER) return op;
+    switch (op) {
+        case OP_ADD:           return OP_ADD_NUMBER;
+        case OP_SUBTRACT:      return OP_SUBTRACT_NUMBER;
+        case OP_MULTIPLY:      return OP_MULTIPLY_NUMBER;
+        case OP_DIVIDE:        return OP_DIVIDE_NUMBER;
+        case OP_GREATER:       return OP_GREATER_NUMBER;
+        case OP_LESS:          return OP_LESS_NUMBER;
+        case OP_GREATER_EQUAL: return OP_GREATER_EQUAL_NUMBER;
+        case OP_LESS_EQUAL:    return OP_LESS_EQUAL_NUMBER;
+        default:               return op;
+    }
+}
+
+static void specialize(Inference* inference, Instruction* instruction) {
+    uint8_t op = instruction->op;
+    uint8_t typed;
+    switch (op) {
+        case OP_ADD:
+        case OP_SUBTRACT:
+        case OP_MULTIPLY:
+        case OP_DIVIDE:
+        case OP_GREATER:
+        case OP_LESS:
+        case OP_GREATER_EQUAL:
+        case OP_LESS_EQUAL:
+            typed = typedOp(op, inference->types[inference->height - 2],
+                            inference->types[inference->height - 1]);
+            break;
+        case OP_NEGATE:
+            typed = inference->types[inference->height - 1] == TYPE_NUMBER ?
+                    OP_NEGATE_NUMBER : op;
+            break;
+        default:
+            return;
+    }
+
+    atomic_fetch_add(&sitesSeen, 1);
+    if (typed != op) {
+        atomic_fetch_add(&sitesSpecialized, 1);
+        inference->chunk->code[instruction->offset] = typed;
+    }
+}
+
+/*Joins the current types into the target's entry types and queues the target again
+if that taught it something new*/
+static void mergeInto(Inference* inference, int target) {
+    if (inference->entryHeight[target] == -1) {
+        inference->entryHeight[target] = inference->height;
+        inference->entryTypes[target] = ALLOCATE(uint8_t, inference->height);
+        memcpy(inference->entryTypes[target], inference->types, inference->height);
+    } else if (inference->entryHeight[target] != inference->height) {
+        inference->failed = true;
+        return;
+    } else {
+        bool changed = false;
+        uint8_t* entry = inference->entryTypes[target];
+        for (int i = 0; i < inference->height; i++) {
+            if (entry[i] != inference->types[i] && entry[i] != TYPE_ANY) {
+                entry[i] = TYPE_ANY;
+                changed = true;
+            }
+        }
+        if (!changed) return;
+    }
+
+    if (!inference->queued[target]) {
+        inference->queued[target] = true;
+        inference->worklist[inference->worklistCount++] = target;
+    }
+}
+
+/*Walks from a jump target to the next one, the instruction after an unconditional
+jump, or a return. With rewrite set the entry types are final and the sites on the
+way get specialized*/
+static void runBlock(Inference* inference, int start, bool rewrite) {
+    inference->height = 0;
+    for (int i = 0; i < inference->entryHeight[start]; i++) {
+        push(inference, inference->entryTypes[start][i]);
+    }
+
+    for (int i = start; i < inference->list.count && !inference->failed; i++) {
+        Instruction* instruction = &inference->list.code[i];
+        if (i != start && inference->isTarget[i]) {
+            if (!rewrite) mergeInto(inference, i);
+            return;
+        }
+
+        if (rewrite) specialize(inference, instruction);
+        transfer(inference, instruction);
+        if (isJump(instruction->op) && !rewrite) mergeInto(inference, instruction->operand);
+        if (instruction->op == OP_JUMP || instruction->op == OP_RETURN) return;
+    }
+}
+
+/*Slots of this function that any closure made in it captures*/
+static void findCaptured(Inference* inference) {
+    memset(inference->captured, 0, sizeof(inference->captured));
+    Chunk* chunk = inference->chunk;
+    for (int i = 0; i < inference->list.count; i++) {
+        Instruction* instruction = &inference->list.code[i];
+        if (instruction->op != OP_CLOSURE && instruction->op != OP_CLOSURE_LONG) continue;
+
+        ObjFunction* function = AS_FUNCTION(chunk->constants.values[instruction->operand]);
+        uint8_t* upvalues = chunk->code + instruction->offset + 1 +
+                            operandLength(instruction->op);
+        for (int j = 0; j < function->upvalueCount; j++) {
+            if (upvalues[2 * j]) inference->captured[upvalues[2 * j + 1]] = true;
+        }
+    }
+}
+
+void specializeTypes(Chunk* chunk, int arity) {
+    Inference inference;
+    inference.chunk = chunk;
+    decodeChunk(chunk, &inference.list);
+    int count = inference.list.count;
+    if (count == 0) {
+        freeInstructionList(&inference.list);
+        return;
+    }
+
+    inference.isTarget = ALLOCATE(bool, count);
+    inference.entryHeight = ALLOCATE(int, count);
+    inference.entryTypes = ALLOCATE(uint8_t*, count);
+    inference.worklist = ALLOCATE(int, count);
+    inference.queued = ALLOCATE(bool, count);
+    inference.worklistCount = 0;
+    inference.types = NULL;
+    inference.height = 0;
+    inference.capacity = 0;
+    inference.failed = false;
+    for (int i = 0; i < count; i++) {
+        inference.isTarget[i] = false;
+        inference.entryHeight[i] = -1;
+        inference.entryTypes[i] = NULL;
+        inference.queued[i] = false;
+    }
+    for (int i = 0; i < count; i++) {
+        Instruction* instruction = &inference.list.code[i];
+        if (isJump(instruction->op)) inference.isTarget[instruction->operand] = true;
+    }
+    findCaptured(&inference);
+
+    //the callee and the arguments could be anything
+    for (int i = 0; i <= arity; i++) push(&inference, TYPE_ANY);
+    inference.isTarget[0] = true;
+    mergeInto(&inference, 0);
+
+    while (inference.worklistCount > 0 && !inference.failed) {
+        int start = inference.worklist[--inference.worklistCount];
+        inference.queued[start] = false;
+        runBlock(&inference, start, false);
+    }
+
+    if (!inference.failed) {
+        for (int i = 0; i < count; i++) {
+            if (inference.entryHeight[i] != -1) runBlock(&inference, i, true);
+        }
+    }
+
+    for (int i = 0; i < count; i++) {
+        if (inference.entryHeight[i] != -1) {
+            FREE_ARRAY(uint8_t, inference.entryTypes[i], inference.entryHeight[i]);
+        }
+    }
+    FREE_ARRAY(bool, inference.isTarget, count);
+    FREE_ARRAY(int, inference.entryHeight, count);
+    FREE_ARRAY(uint8_t*, inference.entryTypes, count);
+    FREE_ARRAY(int, inference.worklist, count);
+    FREE_ARRAY(bool, inference.queued, count);
+    FREE_ARRAY(uint8_t, inference.types, inference.capacity);
+    freeInstructionList(&inference.list);
+}
+
+void typeReport(int* specialized, int* total) {
+    *specialized = atomic_load(&sitesSpecialized);
+    *total = atomic_load(&sitesSeen);
+}
@@ -0,0 +1,19 @@
+/*Static type inference the compiler runs over every finished chunk. It tracks what kind
+of value each stack slot (and so each local) holds along every path through the code,
+and where arithmetic or a comparison is proven to only ever see numbers (or, for
+OP_ADD, strings) it swaps in a typed opcode that skips the operand checks*/
+
+#ifndef cpandi_types_h
+#define cpandi_types_h
+
+#include "chunk.h"
+
+/*Rewrites the typed sites in place, typed opcodes have the same length as the generic
+ones. Chunks the pass can't follow are left alone*/
+void specializeTypes(Chunk* chunk, int arity);
+
+/*Arithmetic and comparison sites in every chunk compiled so far, and how many of them
+were specialized*/
+void typeReport(int* specialized, int* total);
+
+#endif
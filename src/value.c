@@ -38,17 +38,35 @@ void printValue(Value value) {
       printf(AS_BOOL(value) ? "true" : "false");
       break;
     case VAL_NIL: printf("nil"); break;
-    case VAL_NUMBER: printf("%g", AS_NUMBER(value)); break;
+    case VAL_NUMBER:
+    case VAL_INT: {
+      char buffer[32];
+      formatNumber(buffer, sizeof(buffer), value);
+      fputs(buffer, stdout);
+      break;
+    }
     case VAL_OBJ: printObject(value); break;
   }
 }
 
+int formatNumber(char* buffer, size_t size, Value value) {
+  //below a million %g prints ints without an exponent, so %d gives the same text
+  if (IS_INT(value) && AS_INT(value) > -1000000 && AS_INT(value) < 1000000) {
+    return snprintf(buffer, size, "%d", AS_INT(value));
+  }
+  return snprintf(buffer, size, "%g", AS_NUMBER(value));
+}
+
 bool valuesEqual(Value a, Value b) {
-  if (a.type != b.type) return false;
+  if (a.type != b.type) {
+    //1 and 1.0 are the same number
+    return IS_NUMBER(a) && IS_NUMBER(b) && AS_NUMBER(a) == AS_NUMBER(b);
+  }
   switch (a.type) {
     case VAL_BOOL:   return AS_BOOL(a) == AS_BOOL(b);
     case VAL_NIL:    return true;
     case VAL_NUMBER: return AS_NUMBER(a) == AS_NUMBER(b);
+    case VAL_INT:    return AS_INT(a) == AS_INT(b);
     case VAL_OBJ:    return AS_OBJ(a) == AS_OBJ(b);
     default:         return false; // Unreachable.
   }
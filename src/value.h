@@ -11,6 +11,7 @@ typedef enum {
   VAL_BOOL,
   VAL_NIL,
   VAL_NUMBER,
+  VAL_INT,
   VAL_OBJ
 } ValueType;
 
@@ -20,6 +21,7 @@ typedef struct {
   union {
     bool boolean;
     double number;
+    int32_t integer;
     // Whenever the value type is an obj, we know that it has to be apointer 
     // to a memory in heap.
     Obj* obj;
@@ -29,19 +31,26 @@ typedef struct {
 //Checks for the values, whether a value type matches the given type !
 #define IS_BOOL(value)    ((value).type == VAL_BOOL)
 #define IS_NIL(value)     ((value).type == VAL_NIL)
-#define IS_NUMBER(value)  ((value).type == VAL_NUMBER)
+/*Numbers come in two representations. Whole numbers that fit in 32 bits are VAL_INT,
+everything else is a VAL_NUMBER double. Scripts can't tell them apart: every int is
+exactly a double, and results that don't fit an int become doubles*/
+#define IS_INT(value)     ((value).type == VAL_INT)
+#define IS_NUMBER(value)  ((value).type == VAL_NUMBER || (value).type == VAL_INT)
 #define IS_OBJ(value)     ((value).type == VAL_OBJ)
 
 //Used to fetch the respective values
 #define AS_OBJ(value)     ((value).as.obj)
 #define AS_BOOL(value)    ((value).as.boolean)
-#define AS_NUMBER(value)  ((value).as.number)
+#define AS_INT(value)     ((value).as.integer)
+//works for either representation (a function so the value is only evaluated once)
+#define AS_NUMBER(value)  asNumber(value)
 
 
 //These macros are used to cast the values to their respective value type :)
 #define BOOL_VAL(value)   ((Value){VAL_BOOL, {.boolean = value}})
 #define NIL_VAL           ((Value){VAL_NIL, {.number = 0}})
 #define NUMBER_VAL(value) ((Value){VAL_NUMBER, {.number = value}})
+#define INT_VAL(value)    ((Value){VAL_INT, {.integer = value}})
 #define OBJ_VAL(object)   ((Value){VAL_OBJ, {.obj = (Obj*)object}})
 
 
@@ -56,8 +65,33 @@ typedef struct {
     Value* values;
 } ValueArray;
 
+static inline double asNumber(Value value) {
+  return IS_INT(value) ? (double)AS_INT(value) : value.as.number;
+}
+
+/*The result of integer arithmetic, as an int while it fits*/
+static inline Value intResult(int64_t result) {
+  if (result >= INT32_MIN && result <= INT32_MAX) return INT_VAL((int32_t)result);
+  return NUMBER_VAL((double)result);
+}
+
+/*The double product of zero and a negative number is -0, which only a double can hold*/
+static inline Value multiplyInts(int32_t a, int32_t b) {
+  int64_t result = (int64_t)a * b;
+  if (result == 0 && (a < 0 || b < 0)) return NUMBER_VAL(-0.0);
+  return intResult(result);
+}
+
+static inline Value negateInt(int32_t a) {
+  if (a == 0) return NUMBER_VAL(-0.0);
+  return intResult(-(int64_t)a);
+}
+
 bool valuesEqual(Value a, Value b);
 
+/*Writes the number the way print shows it, returns the length like snprintf*/
+int formatNumber(char* buffer, size_t size, Value value);
+
 /*Since we have a pointer array, we need a way to initialize, write and free it*/
 
 void initValueArray(ValueArray* array);
@@ -1,41 +1,827 @@
 #include "common.h"
 #include "vm.h"
+#include <limits.h>
+#include <math.h>
 #include <stdarg.h>
 #include <stdio.h>
 #include "debug.h"
 #include "object.h"
 #include "memory.h"
 #include "compiler.h"
+#include "optimizer.h"
+#include "simd.h"
+#include "parallel.h"
+#include "scheduler.h"
 #include <string.h>
 #include <time.h>
+#include <unistd.h>
 
 
 
-/*Defining a global variable called VM !*/
-VM vm;
-
 /*The clock native function*/
-static Value clockNative(int argCount, Value* args) {
-  return NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+static bool clockNative(VM* vm, int argCount, Value* args) {
+  args[-1] = NUMBER_VAL((double)clock() / CLOCKS_PER_SEC);
+  return true;
 }
 
 /*The pandi's meowwwww native function*/
-static Value meowNative(int argCount, Value* args) {
+static bool meowNative(VM* vm, int argCount, Value* args) {
     printf("               ╱|\n");
     printf("              (˚ˎ 。7\n");
     printf("              |、˜〵\n");
     printf("              じしˍ,)ノ\n");
     printf("              meowwwwwwwwww");
+    args[-1] = NIL_VAL;
+    return true;
+}
+
+/*Shared argument check for the Float64Array natives: the first `arrays` arguments have
+to be arrays and the remaining ones numbers*/
+static bool checkFloat64Args(VM* vm, const char* name, int expected, int arrays,
+                             int argCount, Value* args) {
+    if (argCount != expected) {
+        runtimeError(vm, "%s() expects %d arguments but got %d.", name, expected, argCount);
+        return false;
+    }
+    for (int i = 0; i < argCount; i++) {
+        if (i < arrays ? !IS_FLOAT64_ARRAY(args[i]) : !IS_NUMBER(args[i])) {
+            runtimeError(vm, "%s() expects %s as argument %d.", name,
+                         i < arrays ? "a Float64Array" : "a number", i + 1);
+            return false;
+        }
+    }
+    return true;
+}
+
+/*f64Array(length) creates a zero filled Float64Array*/
+static bool f64ArrayNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Array", 1, 0, argCount, args)) return false;
+    double length = AS_NUMBER(args[0]);
+    //NaN and out of range lengths are turned away before the cast, which can't take them
+    if (isnan(length) || length < 0 || length > INT32_MAX || length != (int)length) {
+        runtimeError(vm, "f64Array() length must be a non negative integer.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(newFloat64Array(vm, (int)length));
+    return true;
+}
+
+static bool f64LengthNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Length", 1, 1, argCount, args)) return false;
+    args[-1] = NUMBER_VAL(AS_FLOAT64_ARRAY(args[0])->count);
+    return true;
+}
+
+static bool f64SumNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Sum", 1, 1, argCount, args)) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    args[-1] = NUMBER_VAL(simdSum(array->values, array->count));
+    return true;
+}
+
+static bool f64DotNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Dot", 2, 2, argCount, args)) return false;
+    ObjFloat64Array* a = AS_FLOAT64_ARRAY(args[0]);
+    ObjFloat64Array* b = AS_FLOAT64_ARRAY(args[1]);
+    if (a->count != b->count) {
+        runtimeError(vm, "f64Dot() arrays must have the same length.");
+        return false;
+    }
+    args[-1] = NUMBER_VAL(simdDot(a->values, b->values, a->count));
+    return true;
+}
+
+/*f64Scale(a, factor) multiplies every element in place and returns the array*/
+static bool f64ScaleNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Scale", 2, 1, argCount, args)) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    simdScale(array->values, array->count, AS_NUMBER(args[1]));
+    args[-1] = args[0];
+    return true;
+}
+
+/*f64Add(a, b) adds b into a element wise and returns a*/
+static bool f64AddNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Add", 2, 2, argCount, args)) return false;
+    ObjFloat64Array* dest = AS_FLOAT64_ARRAY(args[0]);
+    ObjFloat64Array* src = AS_FLOAT64_ARRAY(args[1]);
+    if (dest->count != src->count) {
+        runtimeError(vm, "f64Add() arrays must have the same length.");
+        return false;
+    }
+    simdAdd(dest->values, src->values, dest->count);
+    args[-1] = args[0];
+    return true;
+}
+
+static bool f64MinNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Min", 1, 1, argCount, args)) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count == 0) {
+        runtimeError(vm, "f64Min() of an empty array.");
+        return false;
+    }
+    args[-1] = NUMBER_VAL(simdMin(array->values, array->count));
+    return true;
+}
+
+static bool f64MaxNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64Max", 1, 1, argCount, args)) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    if (array->count == 0) {
+        runtimeError(vm, "f64Max() of an empty array.");
+        return false;
+    }
+    args[-1] = NUMBER_VAL(simdMax(array->values, array->count));
+    return true;
+}
+
+/*f64PrefixSum(a) turns a into its running sums in place and returns it*/
+static bool f64PrefixSumNative(VM* vm, int argCount, Value* args) {
+    if (!checkFloat64Args(vm, "f64PrefixSum", 1, 1, argCount, args)) return false;
+    ObjFloat64Array* array = AS_FLOAT64_ARRAY(args[0]);
+    simdPrefixSum(array->values, array->count);
+    args[-1] = args[0];
+    return true;
+}
+
+/*stringBuilder([capacity]) creates an empty builder, the capacity is only a hint*/
+static bool stringBuilderNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1 || (argCount == 1 && !IS_NUMBER(args[0]))) {
+        runtimeError(vm, "stringBuilder() takes an optional number capacity.");
+        return false;
+    }
+    int capacity = 0;
+    if (argCount == 1 && AS_NUMBER(args[0]) > 0 && AS_NUMBER(args[0]) < INT32_MAX) {
+        capacity = (int)AS_NUMBER(args[0]);
+    }
+    args[-1] = OBJ_VAL(newStringBuilder(vm, capacity));
+    return true;
+}
+
+/*sbAppend(sb, values...) appends the printed form of each value straight into the
+buffer (no intermediate ObjString) and returns the builder*/
+static bool sbAppendNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1 || !IS_STRING_BUILDER(args[0])) {
+        runtimeError(vm, "sbAppend() expects a string builder as its first argument.");
+        return false;
+    }
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    for (int i = 1; i < argCount; i++) {
+        Value value = args[i];
+        const char* chars;
+        int length;
+        //same formatting as printValue()
+        char buffer[32];
+        switch (value.type) {
+            case VAL_BOOL:
+                chars = AS_BOOL(value) ? "true" : "false";
+                length = AS_BOOL(value) ? 4 : 5;
+                break;
+            case VAL_NIL:
+                chars = "nil";
+                length = 3;
+                break;
+            case VAL_NUMBER:
+            case VAL_INT:
+                length = formatNumber(buffer, sizeof(buffer), value);
+                chars = buffer;
+                break;
+            case VAL_OBJ:
+                if (IS_STRING(value)) {
+                    chars = AS_STRING(value)->chars;
+                    length = AS_STRING(value)->length;
+                    break;
+                }
+                if (IS_STRING_BUILDER(value)) {
+                    //may be the builder itself, appendStringBuilder allows for that
+                    chars = AS_STRING_BUILDER(value)->chars;
+                    length = AS_STRING_BUILDER(value)->length;
+                    break;
+                }
+                //any other object falls through to the error
+            default:
+                runtimeError(vm, "sbAppend() can only append strings, numbers, bools and nil.");
+                return false;
+        }
+        if (!appendStringBuilder(builder, chars, length)) {
+            runtimeError(vm, "sbAppend() can't build text longer than %d characters.",
+                         INT_MAX);
+            return false;
+        }
+    }
+    args[-1] = args[0];
+    return true;
+}
+
+static bool sbLengthNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING_BUILDER(args[0])) {
+        runtimeError(vm, "sbLength() expects a string builder.");
+        return false;
+    }
+    args[-1] = NUMBER_VAL(AS_STRING_BUILDER(args[0])->length);
+    return true;
+}
+
+/*sbToString(sb) hashes and interns the buffer once, the builder stays usable*/
+static bool sbToStringNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_STRING_BUILDER(args[0])) {
+        runtimeError(vm, "sbToString() expects a string builder.");
+        return false;
+    }
+    ObjStringBuilder* builder = AS_STRING_BUILDER(args[0]);
+    args[-1] = OBJ_VAL(copyString(vm, builder->chars != NULL ? builder->chars : "",
+                                  builder->length));
+    return true;
+}
+
+/*Shared argument check for the map natives: the first argument has to be a map*/
+static bool checkMapArgs(VM* vm, const char* name, int expected, int argCount, Value* args) {
+    if (argCount != expected) {
+        runtimeError(vm, "%s() expects %d arguments but got %d.", name, expected, argCount);
+        return false;
+    }
+    if (!IS_MAP(args[0])) {
+        runtimeError(vm, "%s() expects a map as its first argument.", name);
+        return false;
+    }
+    return true;
+}
+
+/*mapNew([capacity]) creates an empty map pre-sized for capacity entries*/
+static bool mapNewNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1 || (argCount == 1 && !IS_NUMBER(args[0]))) {
+        runtimeError(vm, "mapNew() takes an optional number capacity.");
+        return false;
+    }
+    //checked before the cast, a double past INT_MAX doesn't convert
+    if (argCount == 1 && AS_NUMBER(args[0]) > TABLE_MAX_RESERVE) {
+        runtimeError(vm, "mapNew() capacity can't be more than %d.", TABLE_MAX_RESERVE);
+        return false;
+    }
+    ObjMap* map = newMap(vm);
+    if (argCount == 1 && AS_NUMBER(args[0]) > 0) {
+        tableReserve(&map->table, (int)AS_NUMBER(args[0]));
+    }
+    args[-1] = OBJ_VAL(map);
+    return true;
+}
+
+static bool mapCountNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapCount", 1, argCount, args)) return false;
+    args[-1] = NUMBER_VAL(AS_MAP(args[0])->count);
+    return true;
+}
+
+static bool mapHasNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapHas", 2, argCount, args)) return false;
+    Value value;
+    args[-1] = BOOL_VAL(isValidKey(args[1]) &&
+                        tableGet(&AS_MAP(args[0])->table, args[1], &value));
+    return true;
+}
+
+static bool mapDeleteNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapDelete", 2, argCount, args)) return false;
+    ObjMap* map = AS_MAP(args[0]);
+    args[-1] = BOOL_VAL(isValidKey(args[1]) && mapDelete(map, args[1]));
+    return true;
+}
+
+/*The iteration protocol: cursors are bucket positions, so updating or deleting
+entries while iterating never moves the remaining ones. mapNext(m, nil) starts,
+nil is returned once every entry was visited*/
+static bool mapNextNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapNext", 2, argCount, args)) return false;
+    Table* table = &AS_MAP(args[0])->table;
+    int cursor = -1;
+    if (IS_NUMBER(args[1])) {
+        //nothing comes after the last bucket, the range check also keeps NaN and huge
+        //numbers away from the cast
+        double number = AS_NUMBER(args[1]);
+        if (!(number < table->capacity)) {
+            args[-1] = NIL_VAL;
+            return true;
+        }
+        if (number > -1) cursor = (int)number;
+    } else if (!IS_NIL(args[1])) {
+        runtimeError(vm, "mapNext() cursor must be nil or a number.");
+        return false;
+    }
+    int next = tableNext(table, cursor);
+    args[-1] = next == -1 ? NIL_VAL : NUMBER_VAL(next);
+    return true;
+}
+
+/*Fetches the live entry under a cursor returned by mapNext()*/
+static Entry* cursorEntry(VM* vm, const char* name, Value* args) {
+    Table* table = &AS_MAP(args[0])->table;
+    if (IS_NUMBER(args[1]) && AS_NUMBER(args[1]) >= 0 &&
+        AS_NUMBER(args[1]) < table->capacity) {
+        int cursor = (int)AS_NUMBER(args[1]);
+        if (!IS_NIL(table->entries[cursor].key)) return &table->entries[cursor];
+    }
+    runtimeError(vm, "%s() cursor does not point at an entry.", name);
+    return NULL;
+}
+
+static bool mapKeyNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapKey", 2, argCount, args)) return false;
+    Entry* entry = cursorEntry(vm, "mapKey", args);
+    if (entry == NULL) return false;
+    args[-1] = entry->key;
+    return true;
+}
+
+static bool mapValueNative(VM* vm, int argCount, Value* args) {
+    if (!checkMapArgs(vm, "mapValue", 2, argCount, args)) return false;
+    Entry* entry = cursorEntry(vm, "mapValue", args);
+    if (entry == NULL) return false;
+    args[-1] = entry->value;
+    return true;
+}
+
+/*Makes the fiber the running one by loading its state into the VM*/
+static void loadFiber(VM* vm, ObjFiber* fiber) {
+    vm->fiber = fiber;
+    vm->frames = fiber->frames;
+    vm->frameCount = fiber->frameCount;
+    vm->stack = fiber->stack;
+    vm->stackTop = fiber->stackTop;
+    vm->stackEnd = fiber->stack + fiber->stackCapacity;
+    vm->openUpvalues = fiber->openUpvalues;
+}
+
+/*Suspends the running fiber and continues with another one. The frames and values
+stay where they are, so only the few fields the VM works on get written back*/
+static void switchFiber(VM* vm, ObjFiber* fiber) {
+    ObjFiber* current = vm->fiber;
+    current->frameCount = vm->frameCount;
+    current->stackTop = vm->stackTop;
+    current->openUpvalues = vm->openUpvalues;
+    loadFiber(vm, fiber);
+}
+
+static bool callValue(VM* vm, Value callee, int argCount);
+
+/*Continues the fiber with a value, the result of the call it stopped in or the argument
+of its function if it hasn't started yet. The running fiber must already be put away*/
+static bool enterFiber(VM* vm, ObjFiber* fiber, Value value) {
+    switchFiber(vm, fiber);
+    if (vm->frameCount > 0) {
+        vm->stackTop[-1] = value;
+        return true;
+    }
+
+    vm->activeFibers++;
+    Value function = fiber->function;
+    int arity = IS_CLOSURE(function) ? AS_CLOSURE(function)->function->arity :
+                                       AS_FUNCTION(function)->arity;
+    push(vm, function);
+    if (arity == 1) push(vm, value);
+    return callValue(vm, function, arity);
+}
+
+/*Checks the function a new fiber gets, which takes at most one argument*/
+static bool checkFiberFunction(VM* vm, const char* name, int argCount, Value* args) {
+    if (argCount < 1 || (!IS_CLOSURE(args[0]) && !IS_FUNCTION(args[0]))) {
+        runtimeError(vm, "%s() expects a function.", name);
+        return false;
+    }
+    ObjFunction* function = IS_CLOSURE(args[0]) ? AS_CLOSURE(args[0])->function :
+                                                  AS_FUNCTION(args[0]);
+    if (function->arity > 1) {
+        runtimeError(vm, "%s() function can take at most one argument.", name);
+        return false;
+    }
+    return true;
+}
+
+/*fiberNew(function) creates a fiber that runs the function, which takes at most one
+argument, from the first fiberResume() on*/
+static bool fiberNewNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError(vm, "fiberNew() expects a function.");
+        return false;
+    }
+    if (!checkFiberFunction(vm, "fiberNew", argCount, args)) return false;
+    args[-1] = OBJ_VAL(newFiber(vm, args[0]));
+    return true;
+}
+
+/*fiberSpawn(function, [value]) creates a fiber the event loop runs with the value once
+the running fiber waits or finishes. Scripts only end after their spawned fibers did*/
+static bool fiberSpawnNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 2) {
+        runtimeError(vm, "fiberSpawn() expects a function and an optional value.");
+        return false;
+    }
+    if (!checkFiberFunction(vm, "fiberSpawn", argCount, args)) return false;
+    ObjFiber* fiber = newFiber(vm, args[0]);
+    scheduleFiber(&vm->loop, fiber, argCount == 2 ? args[1] : NIL_VAL);
+    args[-1] = OBJ_VAL(fiber);
+    return true;
+}
+
+/*fiberResume(fiber, [value]) runs the fiber until it yields or returns, and evaluates to
+what it yielded or returned. The value becomes the result of the fiberYield() the fiber
+is waiting in, or the function's argument when the fiber starts*/
+static bool fiberResumeNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_FIBER(args[0])) {
+        runtimeError(vm, "fiberResume() expects a fiber and an optional value.");
+        return false;
+    }
+    ObjFiber* fiber = AS_FIBER(args[0]);
+    if (fiber->done) {
+        runtimeError(vm, "Cannot resume a finished fiber.");
+        return false;
+    }
+    //the running fiber and the ones waiting on it
+    if (fiber == vm->mainFiber || fiber->caller != NULL) {
+        runtimeError(vm, "Cannot resume a fiber that is running.");
+        return false;
+    }
+    if (fiber->waiting) {
+        runtimeError(vm, "Cannot resume a fiber the event loop is waiting on.");
+        return false;
+    }
+
+    //the stack is left as if the call had returned, the result slot gets filled in
+    //once a value comes back to this fiber
+    vm->stackTop = args;
+    fiber->caller = vm->fiber;
+    return enterFiber(vm, fiber, argCount == 2 ? args[1] : NIL_VAL);
+}
+
+/*fiberYield([value]) suspends the running fiber, the fiberResume() that ran it returns
+the value. fiberYield() itself returns what the next fiberResume() passes in*/
+static bool fiberYieldNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 1) {
+        runtimeError(vm, "fiberYield() takes an optional value.");
+        return false;
+    }
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->caller == NULL) {
+        runtimeError(vm, "Cannot yield from a fiber nothing resumed.");
+        return false;
+    }
+
+    vm->stackTop = args;
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    return enterFiber(vm, caller, argCount == 1 ? args[0] : NIL_VAL);
+}
+
+static bool fiberDoneNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_FIBER(args[0])) {
+        runtimeError(vm, "fiberDone() expects a fiber.");
+        return false;
+    }
+    args[-1] = BOOL_VAL(AS_FIBER(args[0])->done);
+    return true;
+}
+
+/*The running fiber was parked in the event loop by the native called with args. Goes on
+with the next fiber that can run, which blocks until I/O or a timer readies one if none
+can yet. When that's the parked fiber itself the native just returns*/
+static bool suspendFiber(VM* vm, Value* args) {
+    ReadyFiber next;
+    //only a task pool worker comes back empty, when the pool stops while this fiber
+    //waits. The error was reported wherever the pool failed
+    if (!nextReadyFiber(vm, &next)) {
+        resetStack(vm);
+        return false;
+    }
+    if (next.fiber == vm->fiber) {
+        args[-1] = next.value;
+        return true;
+    }
+    vm->stackTop = args;
+    return enterFiber(vm, next.fiber, next.value);
+}
+
+/*A descriptor argument, a whole non negative number*/
+static bool checkFd(VM* vm, const char* name, Value value, int* fd) {
+    //NaN and out of range numbers are turned away before the cast, which can't take them
+    if (!IS_NUMBER(value) || isnan(AS_NUMBER(value)) || AS_NUMBER(value) < 0 ||
+        AS_NUMBER(value) > INT32_MAX || AS_NUMBER(value) != (int)AS_NUMBER(value)) {
+        runtimeError(vm, "%s() expects a file descriptor.", name);
+        return false;
+    }
+    *fd = (int)AS_NUMBER(value);
+    return true;
+}
+
+/*Goes ahead with the operation if the descriptor lets it, and otherwise suspends the
+running fiber until it's done. Failures make the native return nil*/
+static bool performIo(VM* vm, const char* name, IoRequest* request, Value* args) {
+    request->fiber = vm->fiber;
+    Value result = NIL_VAL;
+    IoStatus status = tryIo(vm, request, &result);
+    if (status != IO_BLOCKED) {
+        args[-1] = status == IO_DONE ? result : NIL_VAL;
+        return true;
+    }
+    if (!waitForIo(&vm->loop, request)) {
+        runtimeError(vm, "%s() can't wait on descriptor %d, another fiber may be.",
+                     name, request->fd);
+        return false;
+    }
+    return suspendFiber(vm, args);
+}
+
+/*ioOpen(path, [mode]) opens the file for reading ("r", the default), writing ("w") or
+appending ("a"). Evaluates to the descriptor, or nil if it can't be opened*/
+static bool ioOpenNative(VM* vm, int argCount, Value* args) {
+    if (argCount < 1 || argCount > 2 || !IS_STRING(args[0]) ||
+        (argCount == 2 && !IS_STRING(args[1]))) {
+        runtimeError(vm, "ioOpen() expects a path and an optional mode.");
+        return false;
+    }
+    int fd = openFile(AS_CSTRING(args[0]), argCount == 2 ? AS_CSTRING(args[1]) : "r");
+    args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+    return true;
+}
+
+/*ioPipe() evaluates to a map with the read end at 0 and the write end at 1*/
+static bool ioPipeNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError(vm, "ioPipe() takes no arguments.");
+        return false;
+    }
+    int fds[2];
+    if (!openPipe(fds)) {
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    ObjMap* map = newMap(vm);
+    mapSet(map, NUMBER_VAL(0), NUMBER_VAL(fds[0]));
+    mapSet(map, NUMBER_VAL(1), NUMBER_VAL(fds[1]));
+    args[-1] = OBJ_VAL(map);
+    return true;
 }
 
-static void resetStack() {
+/*A port argument, from 0 to 65535. NaN fails the range check, before any cast*/
+static bool isPort(Value value) {
+    return IS_NUMBER(value) && AS_NUMBER(value) >= 0 && AS_NUMBER(value) <= 65535;
+}
+
+/*ioListen(host, port) listens on the IPv4 address, port 0 picks one (see ioPort())*/
+static bool ioListenNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 2 || !IS_STRING(args[0]) || !isPort(args[1])) {
+        runtimeError(vm, "ioListen() expects a host and a port.");
+        return false;
+    }
+    int fd = listenOn(AS_CSTRING(args[0]), (int)AS_NUMBER(args[1]));
+    args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+    return true;
+}
+
+/*ioPort(fd) is the local port of the socket*/
+static bool ioPortNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (argCount != 1) {
+        runtimeError(vm, "ioPort() expects a file descriptor.");
+        return false;
+    }
+    if (!checkFd(vm, "ioPort", args[0], &fd)) return false;
+    int port = socketPort(fd);
+    args[-1] = port < 0 ? NIL_VAL : NUMBER_VAL(port);
+    return true;
+}
+
+/*ioAccept(fd) waits for a connection on the listening socket and evaluates to it*/
+static bool ioAcceptNative(VM* vm, int argCount, Value* args) {
+    IoRequest request = {NULL, IO_ACCEPT, 0, 0, NULL, 0};
+    if (argCount != 1) {
+        runtimeError(vm, "ioAccept() expects a file descriptor.");
+        return false;
+    }
+    if (!checkFd(vm, "ioAccept", args[0], &request.fd)) return false;
+    return performIo(vm, "ioAccept", &request, args);
+}
+
+/*ioConnect(host, port) waits until the connection to the IPv4 address is made, and
+evaluates to the socket or nil if it failed*/
+static bool ioConnectNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 2 || !IS_STRING(args[0]) || !isPort(args[1])) {
+        runtimeError(vm, "ioConnect() expects a host and a port.");
+        return false;
+    }
+    bool connected;
+    int fd = startConnect(AS_CSTRING(args[0]), (int)AS_NUMBER(args[1]), &connected);
+    if (fd < 0 || connected) {
+        args[-1] = fd < 0 ? NIL_VAL : NUMBER_VAL(fd);
+        return true;
+    }
+    //the socket only tells how the connect went once it's writable
+    IoRequest request = {vm->fiber, IO_CONNECT, fd, 0, NULL, 0};
+    if (!waitForIo(&vm->loop, &request)) {
+        close(fd);
+        args[-1] = NIL_VAL;
+        return true;
+    }
+    return suspendFiber(vm, args);
+}
+
+/*ioRead(fd, [size]) waits for input and evaluates to up to size bytes of it (65536 by
+default), or nil at the end of the input*/
+static bool ioReadNative(VM* vm, int argCount, Value* args) {
+    IoRequest request = {NULL, IO_READ, 0, IO_READ_SIZE, NULL, 0};
+    if (argCount < 1 || argCount > 2 || (argCount == 2 && !IS_NUMBER(args[1]))) {
+        runtimeError(vm, "ioRead() expects a file descriptor and an optional size.");
+        return false;
+    }
+    if (!checkFd(vm, "ioRead", args[0], &request.fd)) return false;
+    if (argCount == 2) {
+        if (isnan(AS_NUMBER(args[1])) || AS_NUMBER(args[1]) < 1 ||
+            AS_NUMBER(args[1]) > INT32_MAX - 1) {
+            runtimeError(vm, "ioRead() size must be positive.");
+            return false;
+        }
+        request.size = (int)AS_NUMBER(args[1]);
+    }
+    return performIo(vm, "ioRead", &request, args);
+}
+
+/*ioWrite(fd, string) waits until all of the string is written and evaluates to its
+length, or nil if the write failed*/
+static bool ioWriteNative(VM* vm, int argCount, Value* args) {
+    IoRequest request = {NULL, IO_WRITE, 0, 0, NULL, 0};
+    if (argCount != 2 || !IS_STRING(args[1])) {
+        runtimeError(vm, "ioWrite() expects a file descriptor and a string.");
+        return false;
+    }
+    if (!checkFd(vm, "ioWrite", args[0], &request.fd)) return false;
+    request.data = AS_STRING(args[1]);
+    return performIo(vm, "ioWrite", &request, args);
+}
+
+/*ioClose(fd) closes the descriptor, a fiber waiting on it goes on with nil*/
+static bool ioCloseNative(VM* vm, int argCount, Value* args) {
+    int fd;
+    if (argCount != 1) {
+        runtimeError(vm, "ioClose() expects a file descriptor.");
+        return false;
+    }
+    if (!checkFd(vm, "ioClose", args[0], &fd)) return false;
+    cancelIo(&vm->loop, fd);
+    args[-1] = BOOL_VAL(close(fd) == 0);
+    return true;
+}
+
+/*ioSleep(milliseconds) suspends the running fiber for that long, ioSleep(0) just lets
+the fibers that are ready run first*/
+static bool ioSleepNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_NUMBER(args[0])) {
+        runtimeError(vm, "ioSleep() expects a number of milliseconds.");
+        return false;
+    }
+    double milliseconds = AS_NUMBER(args[0]);
+    if (milliseconds <= 0) {
+        scheduleFiber(&vm->loop, vm->fiber, NIL_VAL);
+    } else {
+        addTimer(&vm->loop, vm->fiber, milliseconds);
+    }
+    return suspendFiber(vm, args);
+}
+
+/*parallelMap(function, map) calls the function on every value of the map on a pool of
+worker VMs, one per core, and evaluates to a map of the results under the same keys.
+The workers get deep copies of the globals, the function and the values, so they share
+nothing with this VM or each other, and the results are copied back*/
+static bool parallelMapNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 2 || !IS_MAP(args[1])) {
+        runtimeError(vm, "parallelMap() expects a function and a map.");
+        return false;
+    }
+    if (!checkFiberFunction(vm, "parallelMap", 1, args)) return false;
+    ObjMap* results;
+    if (!parallelMap(vm, args[0], AS_MAP(args[1]), &results)) return false;
+    args[-1] = OBJ_VAL(results);
+    return true;
+}
+
+/*taskSpawn(function, [value]) runs the function with a copy of the value on the task
+pool, whose workers each have their own VM on a thread of their own, and evaluates to
+the task. The function must be a global the workers got when the pool started with the
+first taskSpawn()*/
+static bool taskSpawnNative(VM* vm, int argCount, Value* args) {
+    if (argCount > 2) {
+        runtimeError(vm, "taskSpawn() expects a function and an optional value.");
+        return false;
+    }
+    if (!checkFiberFunction(vm, "taskSpawn", argCount, args)) return false;
+    ObjTask* task = spawnTask(vm, args[0], argCount == 2 ? args[1] : NIL_VAL);
+    if (task == NULL) return false;
+    args[-1] = OBJ_VAL(task);
+    return true;
+}
+
+/*taskJoin(task) evaluates to what the task's function returned, waiting until it did.
+A worker runs other tasks meanwhile, any other VM blocks its thread*/
+static bool taskJoinNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 1 || !IS_TASK(args[0])) {
+        runtimeError(vm, "taskJoin() expects a task.");
+        return false;
+    }
+    ObjTask* task = AS_TASK(args[0]);
+    if (task->joined) {
+        runtimeError(vm, "Cannot join a task twice.");
+        return false;
+    }
+    task->joined = true;
+    if (takeTaskResult(vm, task, &args[-1])) return true;
+
+    if (vm->loop.worker != NULL) {
+        if (parkOnTask(vm, task)) return suspendFiber(vm, args);
+        //it got done before the fiber was parked
+        takeTaskResult(vm, task, &args[-1]);
+        return true;
+    }
+    if (!waitForTask(vm, task)) {
+        runtimeError(vm, "The task pool stopped after a task failed.");
+        return false;
+    }
+    takeTaskResult(vm, task, &args[-1]);
+    return true;
+}
+
+/*taskStats() evaluates to a map with a map for each task pool worker: the tasks it ran,
+how many it stole, the seconds it was busy and that as a share of the pool's lifetime*/
+static bool taskStatsNative(VM* vm, int argCount, Value* args) {
+    if (argCount != 0) {
+        runtimeError(vm, "taskStats() takes no arguments.");
+        return false;
+    }
+    args[-1] = OBJ_VAL(taskStats(vm));
+    return true;
+}
+
+/*A fiber returning from its function hands the result to the fiber that resumed it.
+Without one (a spawned fiber, or the main one) the result is dropped and the event loop
+picks what runs next, once nothing is left the main fiber is loaded back without frames.
+The fiber can't run again, so its stack and frames are freed right away. It runs once
+per fiber, kept out of run() so it doesn't crowd the hot loop. A task's fiber first
+hands the result to the task, and is kept for the worker's next task*/
+static __attribute__((noinline)) bool finishFiber(VM* vm, Value result) {
+    ObjFiber* fiber = vm->fiber;
+    if (fiber->task != NULL && !finishTask(vm, fiber->task, result)) return false;
+    ObjFiber* caller = fiber->caller;
+    fiber->caller = NULL;
+    vm->frameCount = 0;
+    vm->stackTop = vm->stack;
+    if (fiber != vm->mainFiber) {
+        fiber->done = true;
+        vm->activeFibers--;
+    } else {
+        vm->mainResult = result;
+    }
+
+    bool ok = true;
+    ReadyFiber next;
+    if (caller != NULL) {
+        ok = enterFiber(vm, caller, result);
+    } else if (nextReadyFiber(vm, &next)) {
+        ok = enterFiber(vm, next.fiber, next.value);
+    } else {
+        switchFiber(vm, vm->mainFiber);
+    }
+
+    if (fiber->task != NULL) {
+        recycleTaskFiber(vm, fiber);
+    } else if (fiber != vm->mainFiber) {
+        FREE_ARRAY(CallFrame, fiber->frames, FRAMES_MAX);
+        FREE_ARRAY(Value, fiber->stack, fiber->stackCapacity);
+        fiber->frames = NULL;
+        fiber->stack = NULL;
+        fiber->stackTop = NULL;
+        fiber->stackCapacity = 0;
+    }
+    return ok;
+}
+
+static void resetStack(VM* vm) {
+    //an error ends the failing fiber, every fiber waiting on it and everything the
+    //event loop still had
+    for (ObjFiber* fiber = vm->fiber; fiber != NULL && fiber != vm->mainFiber;) {
+        ObjFiber* caller = fiber->caller;
+        fiber->caller = NULL;
+        fiber->done = true;
+        vm->activeFibers--;
+        fiber = caller;
+    }
+    clearEventLoop(vm);
+    ObjFiber* fiber = vm->mainFiber;
     //This shows that the stack is empty since the stackTop points to 0
-    vm.stackTop = vm.stack;
-    vm.frameCount = 0;
+    fiber->stackTop = fiber->stack;
+    fiber->frameCount = 0;
+    fiber->openUpvalues = NULL;
+    loadFiber(vm, fiber);
 }
 
 /*Print a runtime error for unlimited args*/
-static void runtimeError(const char* format, ...) {
+void runtimeError(VM* vm, const char* format, ...) {
     //The va_list is a way that stores the unlimited (...) args
     va_list args;
     va_start(args, format);
@@ -45,121 +831,295 @@ static void runtimeError(const char* format, ...) {
     
     fputs("\n", stderr);
     
-    for (int i = vm.frameCount - 1; i >= 0; i--) {
-        CallFrame* frame = &vm.frames[i];
-        ObjFunction* function = frame->function;
-        size_t instruction = frame->ip - function->chunk.code - 1;
-        fprintf(stderr, "[line %d] in ", 
-            function->chunk.lines[instruction]);
-        if (function->name == NULL) {
-            fprintf(stderr, "script\n");
-        } else {
-            fprintf(stderr, "%s()\n", function->name->chars);
+    //the trace goes on through the fibers that resumed the failing one
+    vm->fiber->frameCount = vm->frameCount;
+    for (ObjFiber* fiber = vm->fiber; fiber != NULL; fiber = fiber->caller) {
+        for (int i = fiber->frameCount - 1; i >= 0; i--) {
+            CallFrame* frame = &fiber->frames[i];
+            ObjFunction* function = frame->function;
+            size_t instruction = frame->ip - function->chunk.code - 1;
+            fprintf(stderr, "[line %d] in ", 
+                getLine(&function->chunk, (int)instruction));
+            if (function->name == NULL) {
+                fprintf(stderr, "script\n");
+            } else {
+                fprintf(stderr, "%s()\n", function->name->chars);
+            }
+        }
     }
-  }
 
-    resetStack();
+    resetStack(vm);
 }
 
 /*This method defines native functions !*/
-static void defineNative(const char* name, NativeFn function) {
-    push(OBJ_VAL(copyString(name, (int)strlen(name))));
-    push(OBJ_VAL(newNative(function)));
-    tableSet(&vm.globals, AS_STRING(vm.stack[0]), vm.stack[1]);
-    pop();
-    pop();
+static void defineNative(VM* vm, const char* name, NativeFn function) {
+    push(vm, OBJ_VAL(copyString(vm, name, (int)strlen(name))));
+    push(vm, OBJ_VAL(newNative(vm, function)));
+    tableSet(&vm->globals, vm->stack[0], vm->stack[1]);
+    pop(vm);
+    pop(vm);
 }
 
-void initVM() {
-    resetStack();
-    vm.objects = NULL;
-    initTable(&vm.globals);
-    initTable(&vm.strings);
+void initVM(VM* vm) {
+    initProgramVM(vm, NULL);
+}
+
+void initProgramVM(VM* vm, Program* program) {
+    vm->objects = NULL;
+    vm->mainFiber = newFiber(vm, NIL_VAL);
+    vm->fiber = vm->mainFiber;
+    vm->activeFibers = 0;
+    initEventLoop(&vm->loop);
+    vm->mainResult = NIL_VAL;
+    resetStack(vm);
+    vm->optimize = false;
+    //set before the natives below intern their names
+    vm->program = program;
+    vm->tasks = NULL;
+    initTable(&vm->globals);
+    initTable(&vm->strings);
 
-    defineNative("clock", clockNative);
-    defineNative("meow", meowNative);
+    defineNative(vm, "clock", clockNative);
+    defineNative(vm, "meow", meowNative);
+    defineNative(vm, "mapNew", mapNewNative);
+    defineNative(vm, "mapCount", mapCountNative);
+    defineNative(vm, "mapHas", mapHasNative);
+    defineNative(vm, "mapDelete", mapDeleteNative);
+    defineNative(vm, "mapNext", mapNextNative);
+    defineNative(vm, "mapKey", mapKeyNative);
+    defineNative(vm, "mapValue", mapValueNative);
+    defineNative(vm, "stringBuilder", stringBuilderNative);
+    defineNative(vm, "sbAppend", sbAppendNative);
+    defineNative(vm, "sbLength", sbLengthNative);
+    defineNative(vm, "sbToString", sbToStringNative);
+    defineNative(vm, "f64Array", f64ArrayNative);
+    defineNative(vm, "f64Length", f64LengthNative);
+    defineNative(vm, "f64Sum", f64SumNative);
+    defineNative(vm, "f64Dot", f64DotNative);
+    defineNative(vm, "f64Scale", f64ScaleNative);
+    defineNative(vm, "f64Add", f64AddNative);
+    defineNative(vm, "f64Min", f64MinNative);
+    defineNative(vm, "f64Max", f64MaxNative);
+    defineNative(vm, "f64PrefixSum", f64PrefixSumNative);
+    defineNative(vm, "fiberNew", fiberNewNative);
+    defineNative(vm, "fiberResume", fiberResumeNative);
+    defineNative(vm, "fiberYield", fiberYieldNative);
+    defineNative(vm, "fiberDone", fiberDoneNative);
+    defineNative(vm, "fiberSpawn", fiberSpawnNative);
+    defineNative(vm, "ioOpen", ioOpenNative);
+    defineNative(vm, "ioPipe", ioPipeNative);
+    defineNative(vm, "ioListen", ioListenNative);
+    defineNative(vm, "ioPort", ioPortNative);
+    defineNative(vm, "ioAccept", ioAcceptNative);
+    defineNative(vm, "ioConnect", ioConnectNative);
+    defineNative(vm, "ioRead", ioReadNative);
+    defineNative(vm, "ioWrite", ioWriteNative);
+    defineNative(vm, "ioClose", ioCloseNative);
+    defineNative(vm, "ioSleep", ioSleepNative);
+    defineNative(vm, "parallelMap", parallelMapNative);
+    defineNative(vm, "taskSpawn", taskSpawnNative);
+    defineNative(vm, "taskJoin", taskJoinNative);
+    defineNative(vm, "taskStats", taskStatsNative);
 }
 
-void freeVM() {
-    freeTable(&vm.globals);
-    freeTable(&vm.strings);
-    freeObjects();
+void freeVM(VM* vm) {
+    //the workers may still be running tasks that belong to this VM
+    freeTaskPool(vm);
+    freeEventLoop(&vm->loop);
+    freeTable(&vm->globals);
+    freeTable(&vm->strings);
+    freeObjects(vm);
 }
 
-void push(Value value) {
+void push(VM* vm, Value value) {
     //Dereference the top and put a value
-    *vm.stackTop = value;
+    *vm->stackTop = value;
     //incrmeent the pointer.
-    vm.stackTop++;
+    vm->stackTop++;
 }
 
-Value pop() {
+Value pop(VM* vm) {
     //Decrement the pointer to go to the value below
     //since the pointer has gone below, the current value where it points
     //becomes inaccessible !!!
-    vm.stackTop--;
+    vm->stackTop--;
     //return the value
-    return *vm.stackTop;
+    return *vm->stackTop;
 }
 
 /*Helps peek the stack with the given distance*/
-static Value peek(int distance) {
-    return vm.stackTop[-1 - distance];
+static Value peek(VM* vm, int distance) {
+    return vm->stackTop[-1 - distance];
+}
+
+/*Gives the running fiber's stack room for size more values. The values move, so the
+frames and open upvalues pointing into the stack are moved along*/
+static void growStack(VM* vm, int size) {
+    ObjFiber* fiber = vm->fiber;
+    int count = (int)(vm->stackTop - vm->stack);
+    int capacity = fiber->stackCapacity * 2;
+    while (capacity < count + size) capacity *= 2;
+
+    Value* stack = ALLOCATE(Value, capacity);
+    memcpy(stack, vm->stack, sizeof(Value) * count);
+    for (int i = 0; i < vm->frameCount; i++) {
+        vm->frames[i].slots = stack + (vm->frames[i].slots - vm->stack);
+    }
+    for (ObjUpvalue* upvalue = vm->openUpvalues; upvalue != NULL; upvalue = upvalue->next) {
+        upvalue->location = stack + (upvalue->location - vm->stack);
+    }
+    FREE_ARRAY(Value, vm->stack, fiber->stackCapacity);
+
+    fiber->stack = stack;
+    fiber->stackCapacity = capacity;
+    vm->stack = stack;
+    vm->stackTop = stack + count;
+    vm->stackEnd = stack + capacity;
+}
+
+/*Whether any frame on the stack, or any suspended fiber, may be running the function*/
+static bool isRunning(VM* vm, ObjFunction* function) {
+    if (vm->activeFibers > 0) return true;
+    for (int i = 0; i < vm->frameCount; i++) {
+        if (vm->frames[i].function == function) return true;
+    }
+    return false;
 }
 
-/*This method inserts the function into the current call frame of the VM*/
-static bool call(ObjFunction* function, int argCount) {
+/*This method inserts the function into the current call frame of the VM. Suspended
+fibers may be in the middle of the function too, while there are any it is never
+optimized in place*/
+static bool call(VM* vm, ObjFunction* function, int argCount) {
     
     if (argCount != function->arity) {
-        runtimeError("Expected %d arguments but got %d.", function->arity, argCount);
+        runtimeError(vm, "Expected %d arguments but got %d.", function->arity, argCount);
         return false;
     }
 
-    if (vm.frameCount == FRAMES_MAX) {
-        runtimeError("Stack Overflow");
+    if (vm->frameCount == FRAMES_MAX) {
+        runtimeError(vm, "Stack Overflow");
         return false;
     }
+
+    //the first call compiles a function the compiler only pre-parsed
+    if (function->lazySource != NULL && !compileLazy(vm, function)) {
+        runtimeError(vm, "Could not compile %s().", function->name->chars);
+        return false;
+    }
+
+    //the optimizing tier rewrites the code in place, so it waits for a call where
+    //no frame is still running the function
+    if (vm->optimize && !function->isOptimized && ++function->callCount >= HOT_CALL_COUNT &&
+        !isRunning(vm, function)) {
+        optimizeFunction(vm, function);
+    }
+
+    //room for everything the function ever pushes (the compiler measured it), which
+    //may take moving to a bigger stack
+    int stackSize = function->chunk.stackSize;
+    if (vm->stackTop + stackSize > vm->stackEnd) growStack(vm, stackSize);
     
     //fetch the call frame -> and have a frame pointer
-    CallFrame* frame = &vm.frames[vm.frameCount++];
+    CallFrame* frame = &vm->frames[vm->frameCount++];
     //push the function, the IP of the caller and the slots
     frame->function = function;
+    frame->closure = NULL;
     frame->ip = function->chunk.code;
-    frame->slots = vm.stackTop - argCount - 1;
+    frame->slots = vm->stackTop - argCount - 1;
     //return true.
     return true;
 }
 
-/*This method helps executing the callee function*/
-static bool callValue(Value callee, int argCount) {
+/*This method helps executing the callee function. It has to stay inlined into run(),
+as a real call per OP_CALL makes call heavy code about 20% slower*/
+static inline __attribute__((always_inline)) bool callValue(VM* vm, Value callee,
+                                                            int argCount) {
     if (IS_OBJ(callee)) {
         switch (OBJ_TYPE(callee)) {
+            case OBJ_CLOSURE: {
+                ObjClosure* closure = AS_CLOSURE(callee);
+                if (!call(vm, closure->function, argCount)) return false;
+                vm->frames[vm->frameCount - 1].closure = closure;
+                return true;
+            }
             case OBJ_FUNCTION:
-                return call(AS_FUNCTION(callee), argCount);
+                return call(vm, AS_FUNCTION(callee), argCount);
             case OBJ_NATIVE: {
                 NativeFn native = AS_NATIVE(callee);
-                Value result = native(argCount, vm.stackTop - argCount);
-                vm.stackTop -= argCount + 1;
-                push(result);
+                ObjFiber* fiber = vm->fiber;
+                //the native leaves its result in the callee's slot
+                if (!native(vm, argCount, vm->stackTop - argCount)) return false;
+                //one that switched fibers already left the stack as it should be
+                if (vm->fiber == fiber) vm->stackTop -= argCount;
                 return true;
             }
             default:
                 break;
         }
     }
-    runtimeError("Can only call functions and classes");
+    runtimeError(vm, "Can only call functions and classes");
     return false;
 }
 
+/*Returns the upvalue for the stack slot, reusing the open one if the slot is
+already captured so every closure shares the same variable*/
+static ObjUpvalue* captureUpvalue(VM* vm, Value* local) {
+    ObjUpvalue* prevUpvalue = NULL;
+    ObjUpvalue* upvalue = vm->openUpvalues;
+    while (upvalue != NULL && upvalue->location > local) {
+        prevUpvalue = upvalue;
+        upvalue = upvalue->next;
+    }
+
+    if (upvalue != NULL && upvalue->location == local) {
+        return upvalue;
+    }
+
+    ObjUpvalue* createdUpvalue = newUpvalue(vm, local);
+    createdUpvalue->next = upvalue;
+
+    if (prevUpvalue == NULL) {
+        vm->openUpvalues = createdUpvalue;
+    } else {
+        prevUpvalue->next = createdUpvalue;
+    }
+
+    return createdUpvalue;
+}
+
+/*Moves every captured variable at or above last off the stack and into its upvalue*/
+static void closeUpvalues(VM* vm, Value* last) {
+    while (vm->openUpvalues != NULL && vm->openUpvalues->location >= last) {
+        ObjUpvalue* upvalue = vm->openUpvalues;
+        upvalue->closed = *upvalue->location;
+        upvalue->location = &upvalue->closed;
+        vm->openUpvalues = upvalue->next;
+    }
+}
+
+/*Validates a Float64Array index on top of the stack and returns it, -1 on error*/
+static int arrayIndex(VM* vm, ObjFloat64Array* array, Value index) {
+    if (!IS_NUMBER(index)) {
+        runtimeError(vm, "Array index must be a number.");
+        return -1;
+    }
+    double number = AS_NUMBER(index);
+    if (isnan(number) || number < 0 || number >= array->count || number != (int)number) {
+        runtimeError(vm, "Array index %g out of bounds.", number);
+        return -1;
+    }
+    return (int)number;
+}
+
 /*Helps typecheck the not operator*/
 static bool isFalsey(Value value) {
     return IS_NIL(value) || (IS_BOOL(value) && !AS_BOOL(value));
 }
 
 /*Function helps concatenate two strings*/
-static void concatenate() {
-  ObjString* b = AS_STRING(pop());
-  ObjString* a = AS_STRING(pop());
+static void concatenate(VM* vm) {
+  ObjString* b = AS_STRING(pop(vm));
+  ObjString* a = AS_STRING(pop(vm));
 
   int length = a->length + b->length;
   char* chars = ALLOCATE(char, length + 1);
@@ -167,14 +1127,31 @@ static void concatenate() {
   memcpy(chars + a->length, b->chars, b->length);
   chars[length] = '\0';
 
-  ObjString* result = takeString(chars, length);
-  push(OBJ_VAL(result));
+  ObjString* result = takeString(vm, chars, length);
+  push(vm, OBJ_VAL(result));
 }
 
 
+/*The generic arithmetic and comparison opcodes on two ints. Kept out of run() since
+inlining these cases there slowed the whole dispatch loop down, the typed opcodes keep
+their int paths inline*/
+static __attribute__((noinline)) void intBinary(VM* vm, uint8_t instruction) {
+    int32_t b = AS_INT(pop(vm));
+    int32_t a = AS_INT(pop(vm));
+    switch (instruction) {
+        case OP_GREATER:       push(vm, BOOL_VAL(a > b));            break;
+        case OP_LESS:          push(vm, BOOL_VAL(a < b));            break;
+        case OP_GREATER_EQUAL: push(vm, BOOL_VAL(a >= b));           break;
+        case OP_LESS_EQUAL:    push(vm, BOOL_VAL(a <= b));           break;
+        case OP_ADD:           push(vm, intResult((int64_t)a + b));  break;
+        case OP_SUBTRACT:      push(vm, intResult((int64_t)a - b));  break;
+        case OP_MULTIPLY:      push(vm, multiplyInts(a, b));         break;
+    }
+}
+
 
-static InterpretResult run() {
-    CallFrame* frame = &vm.frames[vm.frameCount - 1];
+static InterpretResult run(VM* vm) {
+    CallFrame* frame = &vm->frames[vm->frameCount - 1];
 
     //Start with defining macros
     /*The read byte macro, dereferences and reads the current instruction pointer*/
@@ -182,29 +1159,67 @@ static InterpretResult run() {
     /*The read constant macro will read the index number of the constant value, and fetch 
     it from the value constant pool*/
     #define READ_CONSTANT() (frame->function->chunk.constants.values[READ_BYTE()])
+    /*The long forms carry a 24 bit operand*/
+    #define READ_LONG() \
+        (frame->ip += 3, \
+        (int)(frame->ip[-3] << 16 | frame->ip[-2] << 8 | frame->ip[-1]))
+    #define READ_CONSTANT_LONG() (frame->function->chunk.constants.values[READ_LONG()])
     /*This macros helps read the number of places the body of the conditional occupies*/
     #define READ_SHORT() \
         (frame->ip += 2, \
         (uint16_t)((frame->ip[-2] << 8 | frame->ip[-1])))
     /*This macro helps read the string from the stack*/
     #define READ_STRING() AS_STRING(READ_CONSTANT())
+    #define READ_STRING_LONG() AS_STRING(READ_CONSTANT_LONG())
+    /*Result type for the fused comparisons that negate OP_LESS and OP_GREATER*/
+    #define NOT_BOOL_VAL(value) BOOL_VAL(!(value))
     //MACRO for binary operations !!!
     #define BINARY_OP(valueType, op) \
         do { \
-        if (!IS_NUMBER(peek(0)) || !IS_NUMBER(peek(1))) { \
-            runtimeError("Operands must be numbers."); \
+        if (!IS_NUMBER(peek(vm, 0)) || !IS_NUMBER(peek(vm, 1))) { \
+            runtimeError(vm, "Operands must be numbers."); \
             return INTERPRET_RUNTIME_ERROR; \
         } \
-        double b = AS_NUMBER(pop()); \
-        double a = AS_NUMBER(pop()); \
-        push(valueType(a op b)); \
+        double b = AS_NUMBER(pop(vm)); \
+        double a = AS_NUMBER(pop(vm)); \
+        push(vm, valueType(a op b)); \
+        } while (false)
+    /*Two ints go through intBinary*/
+    #define INT_BINARY_OP(opcode, valueType, op) \
+        do { \
+        if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) { \
+            intBinary(vm, opcode); \
+        } else { \
+            BINARY_OP(valueType, op); \
+        } \
+        } while (false)
+
+    /*The typed forms only run where the compiler proved the operands are numbers*/
+    #define NUMBER_OP(valueType, op) \
+        do { \
+        Value* left = vm->stackTop - 2; \
+        *left = valueType(AS_NUMBER(left[0]) op AS_NUMBER(left[1])); \
+        vm->stackTop--; \
+        } while (false)
+    /*One test for both operands, VAL_INT is the only type both of whose low bits are set*/
+    _Static_assert(VAL_INT == 3 && VAL_OBJ == 4, "INT_PAIR relies on the ValueType order");
+    #define INT_PAIR(a, b) (((a).type & (b).type) == VAL_INT)
+    #define INT_NUMBER_OP(intType, valueType, op) \
+        do { \
+        Value* left = vm->stackTop - 2; \
+        if (INT_PAIR(left[0], left[1])) { \
+            *left = intType((int64_t)AS_INT(left[0]) op AS_INT(left[1])); \
+        } else { \
+            *left = valueType(AS_NUMBER(left[0]) op AS_NUMBER(left[1])); \
+        } \
+        vm->stackTop--; \
         } while (false)
 
     for (;;) {
         //If the flag DTE is defined then print each instruction 
         #ifdef DEBUG_TRACE_EXECUTION
             printf("          ");
-            for (Value* slot = vm.stack; slot < vm.stackTop; slot++) {
+            for (Value* slot = vm->stack; slot < vm->stackTop; slot++) {
             printf("[ ");
             printValue(*slot);
             printf(" ]");
@@ -224,92 +1239,221 @@ static InterpretResult run() {
             case OP_CONSTANT: {
                 Value constant = READ_CONSTANT();
                 //The constant that is read is pushed on the VM's stack.
-                push(constant);
+                push(vm, constant);
                 break;
             }
-            case OP_NIL:      push(NIL_VAL);                   break;
-            case OP_TRUE:     push(BOOL_VAL(true));            break;
-            case OP_FALSE:    push(BOOL_VAL(false));           break;
-            case OP_POP:      pop();                           break;
+            case OP_CONSTANT_LONG:
+                push(vm, READ_CONSTANT_LONG());
+                break;
+            case OP_NIL:      push(vm, NIL_VAL);                   break;
+            case OP_TRUE:     push(vm, BOOL_VAL(true));            break;
+            case OP_FALSE:    push(vm, BOOL_VAL(false));           break;
+            case OP_POP:      pop(vm);                           break;
+            case OP_POPN:     vm->stackTop -= READ_BYTE();      break;
             case OP_GET_LOCAL: {
                 uint8_t slot = READ_BYTE();
                 //this operation finds the location of the element on the stack and pushes it on the top again
-                push(frame->slots[slot]);
+                push(vm, frame->slots[slot]);
                 break;
             }
             case OP_SET_LOCAL: {
                 uint8_t slot = READ_BYTE();
-                frame->slots[slot] = peek(0);
+                frame->slots[slot] = peek(vm, 0);
                 break;
             }
 
-            case OP_GET_GLOBAL: {
-                ObjString* name = READ_STRING();
+            case OP_GET_GLOBAL:
+            case OP_GET_GLOBAL_LONG: {
+                ObjString* name = instruction == OP_GET_GLOBAL ?
+                    READ_STRING() : READ_STRING_LONG();
                 Value value;
-                if (!tableGet(&vm.globals, name, &value)) {
-                    runtimeError("Undefined variable '%s'.", name->chars);
+                if (!tableGet(&vm->globals, OBJ_VAL(name), &value)) {
+                    runtimeError(vm, "Undefined variable '%s'.", name->chars);
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(value);
+                push(vm, value);
                 break;
             }
-            case OP_DEFINE_GLOBAL: {
-                ObjString* name = READ_STRING();
-                tableSet(&vm.globals, name, peek(0));
-                pop();
+            case OP_DEFINE_GLOBAL:
+            case OP_DEFINE_GLOBAL_LONG: {
+                ObjString* name = instruction == OP_DEFINE_GLOBAL ?
+                    READ_STRING() : READ_STRING_LONG();
+                tableSet(&vm->globals, OBJ_VAL(name), peek(vm, 0));
+                pop(vm);
                 break;
             }
-            case OP_SET_GLOBAL: {
+            case OP_SET_GLOBAL:
+            case OP_SET_GLOBAL_LONG: {
                 //the name of the string is stored using the read string macro
-                ObjString* name = READ_STRING();
+                ObjString* name = instruction == OP_SET_GLOBAL ?
+                    READ_STRING() : READ_STRING_LONG();
                 //if the key is new then the variable does not exist 
-                if (tableSet(&vm.globals, name, peek(0))) {
+                if (tableSet(&vm->globals, OBJ_VAL(name), peek(vm, 0))) {
                     //then delete the name from the global hash table (the one we ended up setting in table set)
-                    tableDelete(&vm.globals, name);
+                    tableDelete(&vm->globals, OBJ_VAL(name));
                     //push a runtime error ->undefined variable
-                    runtimeError("Undefined variable '%s'", name->chars);
+                    runtimeError(vm, "Undefined variable '%s'", name->chars);
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                break;
+            }
+            case OP_GET_UPVALUE: {
+                uint8_t slot = READ_BYTE();
+                push(vm, *frame->closure->upvalues[slot]->location);
+                break;
+            }
+            case OP_SET_UPVALUE: {
+                uint8_t slot = READ_BYTE();
+                *frame->closure->upvalues[slot]->location = peek(vm, 0);
+                break;
+            }
+            case OP_GET_INDEX: {
+                if (IS_FLOAT64_ARRAY(peek(vm, 1))) {
+                    ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(vm, 1));
+                    int index = arrayIndex(vm, array, peek(vm, 0));
+                    if (index == -1) return INTERPRET_RUNTIME_ERROR;
+                    vm->stackTop -= 2;
+                    push(vm, NUMBER_VAL(array->values[index]));
+                    break;
+                }
+                if (!IS_MAP(peek(vm, 1))) {
+                    runtimeError(vm, "Only maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!isValidKey(peek(vm, 0))) {
+                    runtimeError(vm, "Map key cannot be nil or NaN.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                Value key = pop(vm);
+                ObjMap* map = AS_MAP(pop(vm));
+                Value value;
+                //a missing key reads as nil, mapHas() tells the two apart
+                if (!tableGet(&map->table, key, &value)) value = NIL_VAL;
+                push(vm, value);
+                break;
+            }
+            case OP_SET_INDEX: {
+                if (IS_FLOAT64_ARRAY(peek(vm, 2))) {
+                    ObjFloat64Array* array = AS_FLOAT64_ARRAY(peek(vm, 2));
+                    int index = arrayIndex(vm, array, peek(vm, 1));
+                    if (index == -1) return INTERPRET_RUNTIME_ERROR;
+                    if (!IS_NUMBER(peek(vm, 0))) {
+                        runtimeError(vm, "Float64Array elements must be numbers.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    array->values[index] = AS_NUMBER(peek(vm, 0));
+                    Value value = pop(vm);
+                    vm->stackTop -= 2;
+                    push(vm, value);
+                    break;
+                }
+                if (!IS_MAP(peek(vm, 2))) {
+                    runtimeError(vm, "Only maps and arrays can be indexed.");
+                    return INTERPRET_RUNTIME_ERROR;
+                }
+                if (!isValidKey(peek(vm, 1))) {
+                    runtimeError(vm, "Map key cannot be nil or NaN.");
                     return INTERPRET_RUNTIME_ERROR;
                 }
+                Value value = pop(vm);
+                Value key = pop(vm);
+                ObjMap* map = AS_MAP(pop(vm));
+                mapSet(map, key, value);
+                //the assignment expression evaluates to the assigned value
+                push(vm, value);
+                break;
+            }
+            case OP_BUILD_MAP: {
+                int count = READ_BYTE();
+                ObjMap* map = newMap(vm);
+                //the literal size is known, so the buckets are allocated once
+                tableReserve(&map->table, count);
+                Value* entries = vm->stackTop - count * 2;
+                for (int i = 0; i < count; i++) {
+                    if (!isValidKey(entries[i * 2])) {
+                        runtimeError(vm, "Map key cannot be nil or NaN.");
+                        return INTERPRET_RUNTIME_ERROR;
+                    }
+                    mapSet(map, entries[i * 2], entries[i * 2 + 1]);
+                }
+                vm->stackTop = entries;
+                push(vm, OBJ_VAL(map));
                 break;
             }
             case OP_EQUAL: {
-                    Value b = pop();
-                    Value a = pop();
-                    push(BOOL_VAL(valuesEqual(a, b)));
+                    Value b = pop(vm);
+                    Value a = pop(vm);
+                    push(vm, BOOL_VAL(valuesEqual(a, b)));
                     break;
             }
-            case OP_GREATER:  BINARY_OP(BOOL_VAL, >); break;
-            case OP_LESS:     BINARY_OP(BOOL_VAL, <); break;
+            case OP_GREATER:  INT_BINARY_OP(OP_GREATER, BOOL_VAL, >); break;
+            case OP_LESS:     INT_BINARY_OP(OP_LESS, BOOL_VAL, <); break;
+            case OP_NOT_EQUAL: {
+                Value b = pop(vm);
+                Value a = pop(vm);
+                push(vm, BOOL_VAL(!valuesEqual(a, b)));
+                break;
+            }
+            //written as !(a < b) rather than a >= b so NaN behaves like OP_LESS, OP_NOT did
+            case OP_GREATER_EQUAL: INT_BINARY_OP(OP_GREATER_EQUAL, NOT_BOOL_VAL, <); break;
+            case OP_LESS_EQUAL:    INT_BINARY_OP(OP_LESS_EQUAL, NOT_BOOL_VAL, >); break;
             case OP_ADD: {
 
-                if (IS_STRING(peek(0)) && IS_STRING(peek(1))) {
-                    concatenate(); } 
-                else if (IS_NUMBER(peek(0)) && IS_NUMBER(peek(1))) {
-                    double b = AS_NUMBER(pop());
-                    double a = AS_NUMBER(pop());
-                    push(NUMBER_VAL(a + b));
+                if (IS_INT(peek(vm, 0)) && IS_INT(peek(vm, 1))) {
+                    intBinary(vm, OP_ADD);
+                } else if (IS_STRING(peek(vm, 0)) && IS_STRING(peek(vm, 1))) {
+                    concatenate(vm); } 
+                else if (IS_NUMBER(peek(vm, 0)) && IS_NUMBER(peek(vm, 1))) {
+                    double b = AS_NUMBER(pop(vm));
+                    double a = AS_NUMBER(pop(vm));
+                    push(vm, NUMBER_VAL(a + b));
                 } else {
-                runtimeError(
+                runtimeError(vm, 
                     "Operands must be two numbers or two strings.");
                     return INTERPRET_RUNTIME_ERROR;
                 } break;
             }
-            case OP_SUBTRACT: BINARY_OP(NUMBER_VAL, -);        break;
-            case OP_MULTIPLY: BINARY_OP(NUMBER_VAL, *);        break;
+            case OP_SUBTRACT: INT_BINARY_OP(OP_SUBTRACT, NUMBER_VAL, -); break;
+            case OP_MULTIPLY: INT_BINARY_OP(OP_MULTIPLY, NUMBER_VAL, *); break;
             case OP_DIVIDE:   BINARY_OP(NUMBER_VAL, /);        break;
-            case OP_NOT:      push(BOOL_VAL(isFalsey(pop()))); break;
+            case OP_NOT:      push(vm, BOOL_VAL(isFalsey(pop(vm)))); break;
             //In case the value is a simple negate instruction, take the constant at the 
             //top of the stack and simply pop and push a negative version of it.
             case OP_NEGATE:
-                if (!IS_NUMBER(peek(0))) {
-                    runtimeError("Operand must be a number");
+                if (!IS_NUMBER(peek(vm, 0))) {
+                    runtimeError(vm, "Operand must be a number");
                     return INTERPRET_RUNTIME_ERROR;
                 }
-                push(NUMBER_VAL(-AS_NUMBER(pop())));
+                if (IS_INT(peek(vm, 0))) push(vm, negateInt(AS_INT(pop(vm))));
+                else push(vm, NUMBER_VAL(-AS_NUMBER(pop(vm))));
+                break;
+
+            case OP_ADD_NUMBER:      INT_NUMBER_OP(intResult, NUMBER_VAL, +); break;
+            case OP_ADD_STRING:      concatenate(vm); break;
+            case OP_SUBTRACT_NUMBER: INT_NUMBER_OP(intResult, NUMBER_VAL, -); break;
+            case OP_MULTIPLY_NUMBER: {
+                Value* left = vm->stackTop - 2;
+                if (INT_PAIR(left[0], left[1])) {
+                    *left = multiplyInts(AS_INT(left[0]), AS_INT(left[1]));
+                } else {
+                    *left = NUMBER_VAL(AS_NUMBER(left[0]) * AS_NUMBER(left[1]));
+                }
+                vm->stackTop--;
                 break;
+            }
+            case OP_DIVIDE_NUMBER:   NUMBER_OP(NUMBER_VAL, /); break;
+            case OP_NEGATE_NUMBER: {
+                Value* top = vm->stackTop - 1;
+                *top = IS_INT(*top) ? negateInt(AS_INT(*top)) : NUMBER_VAL(-AS_NUMBER(*top));
+                break;
+            }
+            case OP_GREATER_NUMBER:       INT_NUMBER_OP(BOOL_VAL, BOOL_VAL, >); break;
+            case OP_LESS_NUMBER:          INT_NUMBER_OP(BOOL_VAL, BOOL_VAL, <); break;
+            case OP_GREATER_EQUAL_NUMBER: INT_NUMBER_OP(NOT_BOOL_VAL, NOT_BOOL_VAL, <); break;
+            case OP_LESS_EQUAL_NUMBER:    INT_NUMBER_OP(NOT_BOOL_VAL, NOT_BOOL_VAL, >); break;
 
             case OP_PRINT: {
-                printValue(pop());
+                printValue(pop(vm));
                 printf("\n");
                 break;
             }
@@ -322,7 +1466,7 @@ static InterpretResult run() {
 
             case OP_JUMP_IF_FALSE: {
                 uint16_t offset = READ_SHORT();
-                if (isFalsey(peek(0))) frame->ip += offset;
+                if (isFalsey(peek(vm, 0))) frame->ip += offset;
                 break;
             }
             
@@ -332,32 +1476,89 @@ static InterpretResult run() {
                 break;
             }
 
+            case OP_JUMP_LONG: {
+                int offset = READ_LONG();
+                frame->ip += offset;
+                break;
+            }
+
+            case OP_JUMP_IF_FALSE_LONG: {
+                int offset = READ_LONG();
+                if (isFalsey(peek(vm, 0))) frame->ip += offset;
+                break;
+            }
+
+            case OP_LOOP_LONG: {
+                int offset = READ_LONG();
+                frame->ip -= offset;
+                break;
+            }
+
             case OP_CALL: {
                 //read the byte first to understand how many arguments there are
                 int argCount = READ_BYTE();
                 //if one peeks and finds the argument count does not match the one stored in function declaration
                 //throw a runtime error.
-                if (!callValue(peek(argCount), argCount)) {
+                if (!callValue(vm, peek(vm, argCount), argCount)) {
                     return INTERPRET_RUNTIME_ERROR;
                 }
                 //if the call value is successful then the function gets a new 
                 //call frame on the stack
-                frame = &vm.frames[vm.frameCount - 1];
+                frame = &vm->frames[vm->frameCount - 1];
+                break;
+            }
+
+            //the inlined body right after runs only while the slot still holds
+            //the function it was copied from, otherwise the regular call does
+            case OP_GUARD_CALLEE:
+            case OP_GUARD_CALLEE_LONG: {
+                uint8_t slot = READ_BYTE();
+                Value expected = READ_CONSTANT_LONG();
+                int offset = instruction == OP_GUARD_CALLEE ? READ_SHORT() : READ_LONG();
+                if (!valuesEqual(frame->slots[slot], expected)) frame->ip += offset;
+                break;
+            }
+
+            case OP_CLOSURE:
+            case OP_CLOSURE_LONG: {
+                ObjFunction* function = AS_FUNCTION(instruction == OP_CLOSURE ?
+                    READ_CONSTANT() : READ_CONSTANT_LONG());
+                ObjClosure* closure = newClosure(vm, function);
+                push(vm, OBJ_VAL(closure));
+                for (int i = 0; i < closure->upvalueCount; i++) {
+                    uint8_t isLocal = READ_BYTE();
+                    uint8_t index = READ_BYTE();
+                    if (isLocal) {
+                        closure->upvalues[i] = captureUpvalue(vm, frame->slots + index);
+                    } else {
+                        closure->upvalues[i] = frame->closure->upvalues[index];
+                    }
+                }
                 break;
             }
 
+            case OP_CLOSE_UPVALUE:
+                closeUpvalues(vm, vm->stackTop - 1);
+                pop(vm);
+                break;
+
             case OP_RETURN: {
                 //When a return is read, the stack is popped !!
-                Value result = pop();
-                vm.frameCount--;
-                if (vm.frameCount == 0) {
-                    pop();
-                    return INTERPRET_OK;
+                Value result = pop(vm);
+                closeUpvalues(vm, frame->slots);
+                vm->frameCount--;
+                if (vm->frameCount == 0) {
+                    pop(vm);
+                    if (!finishFiber(vm, result)) return INTERPRET_RUNTIME_ERROR;
+                    //back on the main fiber without frames, nothing is left to run
+                    if (vm->frameCount == 0) return INTERPRET_OK;
+                    frame = &vm->frames[vm->frameCount - 1];
+                    break;
                 }
 
-                vm.stackTop = frame->slots;
-                push(result);
-                frame = &vm.frames[vm.frameCount - 1];
+                vm->stackTop = frame->slots;
+                push(vm, result);
+                frame = &vm->frames[vm->frameCount - 1];
                 break;
             }
         }
@@ -368,18 +1569,56 @@ static InterpretResult run() {
     #undef READ_STRING
     #undef READ_SHORT
     #undef READ_CONSTANT
+    #undef READ_CONSTANT_LONG
+    #undef READ_LONG
+    #undef READ_STRING_LONG
     #undef BINARY_OP
+    #undef INT_BINARY_OP
+    #undef NUMBER_OP
+    #undef INT_NUMBER_OP
+    #undef INT_PAIR
+    #undef NOT_BOOL_VAL
 }
 
 
-InterpretResult interpret(const char* source) {
-    ObjFunction* function = compile(source);
+InterpretResult interpret(VM* vm, const char* source) {
+    ObjFunction* function = compile(vm, NULL, source, strlen(source), false);
     if (function == NULL) return INTERPRET_COMPILE_ERROR;
+    return interpretFunction(vm, function);
+}
+
+InterpretResult callFunction(VM* vm, Value function, int argCount, Value* args,
+                             Value* result) {
+    push(vm, function);
+    for (int i = 0; i < argCount; i++) push(vm, args[i]);
+    if (!callValue(vm, function, argCount)) return INTERPRET_RUNTIME_ERROR;
+    //a native is done already, its result took the callee's slot
+    if (vm->frameCount == 0) {
+        *result = pop(vm);
+        return INTERPRET_OK;
+    }
+
+    InterpretResult status = run(vm);
+    *result = status == INTERPRET_OK ? vm->mainResult : NIL_VAL;
+    return status;
+}
+
+InterpretResult runEventLoop(VM* vm) {
+    ReadyFiber next;
+    while (nextReadyFiber(vm, &next)) {
+        //the fibers hand control back to the idle main fiber once none is ready
+        if (!enterFiber(vm, next.fiber, next.value)) return INTERPRET_RUNTIME_ERROR;
+        InterpretResult status = run(vm);
+        if (status != INTERPRET_OK) return status;
+    }
+    return INTERPRET_OK;
+}
 
+InterpretResult interpretFunction(VM* vm, ObjFunction* function) {
     //The first value on the stack is the outermost function on the stack
-    push(OBJ_VAL(function));
+    push(vm, OBJ_VAL(function));
 
-    call(function, 0);
+    call(vm, function, 0);
 
-    return run();
+    return run(vm);
 }
\ No newline at end of file
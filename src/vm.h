@@ -5,33 +5,48 @@
 #include "table.h"
 #include "value.h"
 #include "object.h"
+#include "program.h"
+#include "loop.h"
 
 #define FRAMES_MAX 64
-#define STACK_MAX (FRAMES_MAX * UINT8_COUNT)
-
-/*Data structure to keep track of the Call frame*/
-typedef struct {
-    ObjFunction* function;
-    //the caller stores the return address so that the function can jump here once
-    //the callee finishes its execution
-    uint8_t* ip;
-    //The first slot in the stack that we had reserved -> is used by the function
-    Value* slots;
-} CallFrame;
-
-/* Defining a data structure to keep a track of the state of the VM */
-typedef struct {
-    CallFrame frames[FRAMES_MAX];
+/*Stack slots a fiber's stack starts out with. It grows whenever a call needs more than
+is left, each function's chunk knows how much it needs*/
+#define FRAME_SLOTS UINT8_COUNT
+
+/* Defining a data structure to keep a track of the state of the VM. Nothing about a
+running script lives outside of it, so every thread can run its own VM */
+struct VM {
+    //the fiber that is running, its frames and stack are loaded into the fields below
+    //and only written back to it when another fiber takes over
+    ObjFiber* fiber;
+    //scripts start out on this one
+    ObjFiber* mainFiber;
+    //fibers besides the main one that started and haven't finished
+    int activeFibers;
+    //fibers waiting on I/O, timers or their turn
+    EventLoop loop;
+    //what the main fiber's function returned last
+    Value mainResult;
+    CallFrame* frames;
     int frameCount;
     //Creating a VM stack for interpreting instructions
-    Value stack[STACK_MAX];
+    Value* stack;
     Value* stackTop;
+    Value* stackEnd;
     //This is a hash table for storing the global variable
     Table globals;
     //The objects is an object pointer which is the head of our linked list !
     Table strings;
+    //captured variables that still live on the stack
+    ObjUpvalue* openUpvalues;
     Obj* objects;
-} VM;
+    //hot functions go through the optimizing tier (--optimize)
+    bool optimize;
+    //the frozen program this VM shares with others, NULL if it only runs its own scripts
+    Program* program;
+    //the task pool its taskSpawn() calls started, a worker's VM uses its worker's pool
+    struct TaskPool* tasks;
+};
 
 /*Return values for the result of the interpretation of the VM*/
 typedef enum {
@@ -40,23 +55,40 @@ typedef enum {
     INTERPRET_RUNTIME_ERROR
 } InterpretResult;
 
-extern VM vm;
-
-/*Method to initialize the VM*/
-void initVM();
-/*Method to clean the VM*/
-void freeVM();
+/*Method to initialize the VM, the caller owns the memory. A VM and everything it
+allocated may only be used by one thread at a time*/
+void initVM(VM* vm);
+/*Initializes a VM that runs the shared program, with interpretFunction(vm,
+program->function). It uses the program's interned strings as its own, so the names in
+the program's code and those the VM makes itself are the same objects*/
+void initProgramVM(VM* vm, Program* program);
+/*Method to clean the VM, the program it runs is left alone*/
+void freeVM(VM* vm);
 /*Method to interpret the bytecode*/
-InterpretResult interpret(const char* source);
+InterpretResult interpret(VM* vm, const char* source);
+/*Runs a script function that was compiled ahead of time for this VM*/
+InterpretResult interpretFunction(VM* vm, ObjFunction* function);
+
+/*Calls the function with the arguments on the idle VM and runs until nothing is left
+to run, result is what the function returned*/
+InterpretResult callFunction(VM* vm, Value function, int argCount, Value* args,
+                             Value* result);
+
+/*Runs the fibers the event loop readies on the idle VM until it has none left, which
+for a task pool worker is when the pool stops*/
+InterpretResult runEventLoop(VM* vm);
 
 /*Stack operation to push a value on the stack*/
-void push(Value value);
+void push(VM* vm, Value value);
 
 /*Stack operation to remove and return the topmost value from the stack*/
-Value pop();
+Value pop(VM* vm);
+
+/*Reports a runtime error with a stack trace and unwinds the stack (natives use this too)*/
+void runtimeError(VM* vm, const char* format, ...);
 
-static InterpretResult run();
+static InterpretResult run(VM* vm);
 
-static void resetStack();
+static void resetStack(VM* vm);
 
 #endif
\ No newline at end of file
@@ -0,0 +1,50 @@
+#!/bin/sh
+# Runs every script in this directory and compares what it prints (stdout and stderr)
+# with the expected file next to it. A script with a NAME.out file runs with the plain
+# binary, one with a NAME.code file with the binary that also prints the disassembly of
+# everything it compiles. Scripts run from this directory, so the paths in error
+# messages are just their names. Cache files are removed around every run, so each
+# script is compiled. A first line of the form "// flags: --optimize" passes those
+# flags to the binary.
+#
+#   sh run.sh ../src/main-release ../src/main-code
+
+if [ $# -lt 2 ]; then
+  echo "Usage: run.sh binary code-binary" >&2
+  exit 64
+fi
+binary=$(cd "$(dirname "$1")" && pwd)/$(basename "$1")
+codeBinary=$(cd "$(dirname "$2")" && pwd)/$(basename "$2")
+cd "$(dirname "$0")" || exit 1
+actual=$(mktemp)
+passed=0
+failed=0
+
+for script in *.pandi; do
+  name=$(basename "$script" .pandi)
+  if [ -f "$name.code" ]; then
+    run=$codeBinary
+    expected=$name.code
+  else
+    run=$binary
+    expected=$name.out
+  fi
+
+  flags=$(sed -n '1s|^// flags: *||p' "$script")
+
+  rm -f "$name.pandic"
+  "$run" $flags "$script" > "$actual" 2>&1
+  rm -f "$name.pandic"
+
+  if cmp -s "$expected" "$actual"; then
+    passed=$((passed + 1))
+  else
+    echo "FAIL $name"
+    diff "$expected" "$actual" | head -n 20
+    failed=$((failed + 1))
+  fi
+done
+
+rm -f "$actual"
+echo "$passed passed, $failed failed"
+[ $failed -eq 0 ]
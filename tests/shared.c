@@ -0,0 +1,116 @@
+#include <pthread.h>
+#include <stdatomic.h>
+#include <stdio.h>
+#include <string.h>
+
+#include "program.h"
+#include "vm.h"
+
+/*Embeds the interpreter the way a multi-threaded host would: one program compiled once,
+then run over and over by a VM on every thread. Prints what went wrong and fails if
+anything did*/
+
+#define THREADS 8
+#define RUNS 20
+
+static const char* source =
+    "fun fib(n) { if (n < 2) return n; return fib(n - 1) + fib(n - 2); }\n"
+    "fun counter() { var c = 0; fun inc() { c = c + 1; return c; } return inc; }\n"
+    "fun join(a, b) { return a + b; }\n"
+    "var m = mapNew(); m[\"kx\"] = 1; m[\"k\" + \"x\"] = m[\"k\" + \"x\"] + 1;\n"
+    "var inc = counter(); inc(); inc();\n"
+    "var built = join(\"fi\", \"b\");\n"
+    "var ok = m[\"kx\"] == 2 and inc() == 3 and fib(15) == 610;\n";
+
+static Program* program;
+static atomic_int failures = 0;
+
+static void fail(const char* message) {
+    fprintf(stderr, "shared: %s\n", message);
+    atomic_fetch_add(&failures, 1);
+}
+
+/*The program's own interned copy of the string*/
+static ObjString* programString(const char* chars) {
+    Table* strings = &program->heap.strings;
+    for (int i = tableNext(strings, -1); i != -1; i = tableNext(strings, i)) {
+        ObjString* string = AS_STRING(strings->entries[i].key);
+        if (string->length == (int)strlen(chars) &&
+            memcmp(string->chars, chars, string->length) == 0) {
+            return string;
+        }
+    }
+    return NULL;
+}
+
+static Value global(VM* vm, const char* name) {
+    Value value = NIL_VAL;
+    tableGet(&vm->globals, OBJ_VAL(copyString(vm, name, (int)strlen(name))), &value);
+    return value;
+}
+
+static void* runProgram(void* argument) {
+    VM vm;
+    initProgramVM(&vm, program);
+    //half of them with the optimizing tier, which has to leave the shared chunks alone
+    vm.optimize = (long)argument % 2 == 1;
+
+    for (int run = 0; run < RUNS; run++) {
+        if (interpretFunction(&vm, program->function) != INTERPRET_OK) {
+            fail("the program failed to run");
+        } else if (!IS_BOOL(global(&vm, "ok")) || !AS_BOOL(global(&vm, "ok"))) {
+            fail("the program computed the wrong results");
+        }
+    }
+
+    //a string built at runtime is the very object the program interned
+    Value built = global(&vm, "built");
+    if (!IS_STRING(built) || AS_STRING(built) != programString("fib")) {
+        fail("a string built at runtime isn't the program's interned one");
+    }
+    //the VM still compiles code of its own next to the program
+    if (interpret(&vm, "ok = ok and fib(10) == 55 and join(\"k\", \"x\") == \"kx\";") !=
+            INTERPRET_OK || !AS_BOOL(global(&vm, "ok"))) {
+        fail("code the VM compiled itself didn't see the program");
+    }
+
+    freeVM(&vm);
+    return NULL;
+}
+
+/*Nothing the VMs do may write into the program's functions*/
+static void checkFrozen(const char* when) {
+    for (Obj* object = program->heap.objects; object != NULL; object = object->next) {
+        if (object->type != OBJ_FUNCTION) continue;
+        ObjFunction* function = (ObjFunction*)object;
+        if (function->lazySource != NULL) {
+            fprintf(stderr, "shared: %s, a function body isn't compiled\n", when);
+            atomic_fetch_add(&failures, 1);
+        }
+        if (function->callCount != 0 || !function->isOptimized) {
+            fprintf(stderr, "shared: %s, a function can still be optimized\n", when);
+            atomic_fetch_add(&failures, 1);
+        }
+    }
+}
+
+int main() {
+    program = compileProgram("shared", source, strlen(source));
+    if (program == NULL) {
+        fail("the program didn't compile");
+        return 1;
+    }
+    checkFrozen("after compiling");
+
+    pthread_t threads[THREADS];
+    for (long i = 0; i < THREADS; i++) {
+        pthread_create(&threads[i], NULL, runProgram, (void*)i);
+    }
+    for (int i = 0; i < THREADS; i++) pthread_join(threads[i], NULL);
+    checkFrozen("after running");
+
+    freeProgram(program);
+    if (atomic_load(&failures) > 0) return 1;
+    printf("shared: %d VMs ran one program %d times each\n", THREADS, RUNS);
+    return 0;
+}